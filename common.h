@@ -13,6 +13,15 @@
 #define LUAMONGO_GRIDFILE        "mongo.GridFile"
 #define LUAMONGO_GRIDFSCHUNK     "mongo.GridFSChunk"
 #define LUAMONGO_GRIDFILEBUILDER "mongo.GridFileBuilder"
+#define LUAMONGO_BULK            "mongo.BulkWrite"
+#define LUAMONGO_PIPELINE        "mongo.Pipeline"
+#define LUAMONGO_ASYNC           "mongo.AsyncClient"
+#define LUAMONGO_FUTURE          "mongo.Future"
+#define LUAMONGO_WIRE            "mongo.Wire"
+#define LUAMONGO_MULTIPLEXER     "mongo.Multiplexer"
+#define LUAMONGO_PREPARED        "mongo.PreparedCommand"
+#define LUAMONGO_INSERTBUFFER    "mongo.InsertBuffer"
+#define LUAMONGO_POOL            "mongo.Pool"
 // not an actual class, pseudo-base for error messages
 #define LUAMONGO_DBCLIENT       "mongo.DBClient"
 #else
@@ -24,17 +33,30 @@
 #define LUAMONGO_GRIDFILE        "GridFile"
 #define LUAMONGO_GRIDFSCHUNK     "GridFSChunk"
 #define LUAMONGO_GRIDFILEBUILDER "GridFileBuilder"
+#define LUAMONGO_BULK            "BulkWrite"
+#define LUAMONGO_PIPELINE        "Pipeline"
+#define LUAMONGO_ASYNC           "AsyncClient"
+#define LUAMONGO_FUTURE          "Future"
+#define LUAMONGO_WIRE            "Wire"
+#define LUAMONGO_MULTIPLEXER     "Multiplexer"
+#define LUAMONGO_PREPARED        "PreparedCommand"
+#define LUAMONGO_INSERTBUFFER    "InsertBuffer"
+#define LUAMONGO_POOL            "Pool"
 // not an actual class, pseudo-base for error messages
 #define LUAMONGO_DBCLIENT       "DBClient"
 #endif
 
 #define LUAMONGO_ERR_CONNECTION_FAILED  "Connection failed: %s"
 #define LUAMONGO_ERR_REPLICASET_FAILED  "ReplicaSet.New failed: %s"
+#define LUAMONGO_ERR_POOL_FAILED        "Pool.New failed: %s"
 #define LUAMONGO_ERR_GRIDFS_FAILED      "GridFS failed: %s"
 #define LUAMONGO_ERR_GRIDFSCHUNK_FAILED "GridFSChunk failed: %s"
 #define LUAMONGO_ERR_QUERY_FAILED       "Query failed: %s"
 #define LUAMONGO_ERR_CONNECT_FAILED     "Connection to %s failed: %s"
 #define LUAMONGO_ERR_CONNECTION_LOST    "Connection lost"
+#define LUAMONGO_ERR_UNAVAILABLE        "Connection to %s unavailable (%s, retry in %d ms): %s"
+#define LUAMONGO_ERR_CLOSED             "Attempt to use a closed %s"
+#define LUAMONGO_ERR_MULTIPLEXED        "Requests of a Multiplexer are in flight on the connection"
 #define LUAMONGO_UNSUPPORTED_BSON_TYPE  "Unsupported BSON type `%s'"
 #define LUAMONGO_UNSUPPORTED_LUA_TYPE   "Unsupported Lua type `%s'"
 #define LUAMONGO_REQUIRES_JSON_OR_TABLE "JSON string or Lua table required"
@@ -21,12 +21,21 @@
  * IN THE SOFTWARE.
  */
 
+#include <algorithm>
 #include <iostream>
+#include <list>
+#include <map>
+#include <vector>
 #include <client/dbclient.h>
 #include <client/init.h>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 #include <sys/time.h>
 #include "utils.h"
 #include "common.h"
+#include "mongo_pool.h"
 
 extern int mongo_bsontypes_register(lua_State *L);
 extern int mongo_connection_register(lua_State *L);
@@ -37,13 +46,21 @@ extern int mongo_gridfs_register(lua_State *L);
 extern int mongo_gridfile_register(lua_State *L);
 extern int mongo_gridfschunk_register(lua_State *L);
 extern int mongo_gridfilebuilder_register(lua_State *L);
+extern int mongo_bulk_register(lua_State *L);
+extern int mongo_pipeline_register(lua_State *L);
+extern int mongo_async_register(lua_State *L);
+extern int mongo_wire_register(lua_State *L);
+extern int mongo_multiplexer_register(lua_State *L);
+extern int mongo_prepared_register(lua_State *L);
+extern int mongo_insert_buffer_register(lua_State *L);
+extern int mongo_pool_register(lua_State *L);
 
 int mongo_sleep(lua_State *L) {
     double sleeptime = luaL_checknumber(L, 1);
     double seconds   = floor(sleeptime);
     struct timespec req;
     req.tv_sec  = (time_t)seconds;
-    req.tv_nsec = (long)((sleeptime-seconds)*1e6);
+    req.tv_nsec = (long)((sleeptime-seconds)*1e9);
     nanosleep(&req, 0);
     return 0;
 }
@@ -56,11 +73,24 @@ int mongo_time(lua_State *L) {
     return 1;
 }
 
+/*
+ * process-wide state, shared by the Lua states of all the threads
+ */
 struct Initializer {
     mongo::client::GlobalInstance *instance;
+    boost::mutex mutex;
+    std::map<std::string, ConnectionPoolPtr> pools;
+    // background threads, and the ids of the ones which returned
+    std::list<boost::thread *> threads;
+    std::vector<boost::thread::id> finished;
     Initializer() : instance(0) { }
-    ~Initializer() { delete instance; }
+    // the pools close their connections and the threads return before the
+    // driver shuts down and the module is unmapped
+    ~Initializer() { pools.clear(); join_threads(); delete instance; }
+    void join_threads();
     void init() {
+        boost::mutex::scoped_lock lock(mutex);
+        if (instance) return;
         try {
             instance = new mongo::client::GlobalInstance();
             instance->assertInitialized();
@@ -73,6 +103,88 @@ struct Initializer {
 };
 Initializer initializer;
 
+namespace {
+    void run_background(const boost::function<void ()> &body) {
+        try {
+            body();
+        } catch (boost::thread_interrupted &) {
+        }
+        boost::mutex::scoped_lock lock(initializer.mutex);
+        initializer.finished.push_back(boost::this_thread::get_id());
+    }
+}
+
+/*
+ * interrupts the background threads and waits for them; a thread blocked on
+ * a socket returns after the timeout of its connection
+ */
+void Initializer::join_threads() {
+    for (;;) {
+        std::list<boost::thread *> running;
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            running.swap(threads);
+            finished.clear();
+        }
+        if (running.empty()) return;
+        std::list<boost::thread *>::iterator it;
+        for (it = running.begin(); it != running.end(); ++it) {
+            (*it)->interrupt();
+        }
+        for (it = running.begin(); it != running.end(); ++it) {
+            (*it)->join();
+            delete *it;
+        }
+    }
+}
+
+/*
+ * starts a thread of the maintenance of a pool, the monitor of a replica
+ * set or a worker. Owners only ask their threads to stop, they are joined
+ * here once they returned and all of them when the module is unloaded, so
+ * no thread outlives the driver or the code of the module.
+ */
+void background_thread_start(const boost::function<void ()> &body) {
+    std::vector<boost::thread *> done;
+    {
+        boost::mutex::scoped_lock lock(initializer.mutex);
+        std::list<boost::thread *>::iterator it = initializer.threads.begin();
+        while (it != initializer.threads.end()) {
+            if (std::find(initializer.finished.begin(), initializer.finished.end(),
+                          (*it)->get_id()) != initializer.finished.end()) {
+                done.push_back(*it);
+                initializer.threads.erase(it++);
+            } else {
+                ++it;
+            }
+        }
+        initializer.finished.clear();
+        initializer.threads.push_back(new boost::thread(boost::bind(run_background, body)));
+    }
+    // they already returned
+    for (size_t i = 0; i < done.size(); ++i) {
+        done[i]->join();
+        delete done[i];
+    }
+}
+
+ConnectionPoolPtr shared_pool_find(const std::string &name) {
+    boost::mutex::scoped_lock lock(initializer.mutex);
+    std::map<std::string, ConnectionPoolPtr>::iterator it = initializer.pools.find(name);
+    return it == initializer.pools.end() ? ConnectionPoolPtr() : it->second;
+}
+
+// returns the pool already registered as name, if any
+ConnectionPoolPtr shared_pool_insert(const std::string &name, const ConnectionPoolPtr &pool) {
+    boost::mutex::scoped_lock lock(initializer.mutex);
+    return initializer.pools.insert(std::make_pair(name, pool)).first->second;
+}
+
+bool shared_pool_drop(const std::string &name) {
+    boost::mutex::scoped_lock lock(initializer.mutex);
+    return initializer.pools.erase(name) > 0;
+}
+
 /*
  *
  * library entry point
@@ -125,6 +237,38 @@ LM_EXPORT int luaopen_mongo(lua_State *L) {
     mongo_gridfilebuilder_register(L);
     lua_setfield(L, -2, LUAMONGO_GRIDFILEBUILDER);
 
+    // LUAMONGO_BULK
+    mongo_bulk_register(L);
+    lua_setfield(L, -2, LUAMONGO_BULK);
+
+    // LUAMONGO_PIPELINE
+    mongo_pipeline_register(L);
+    lua_setfield(L, -2, LUAMONGO_PIPELINE);
+
+    // LUAMONGO_ASYNC
+    mongo_async_register(L);
+    lua_setfield(L, -2, LUAMONGO_ASYNC);
+
+    // LUAMONGO_WIRE
+    mongo_wire_register(L);
+    lua_setfield(L, -2, LUAMONGO_WIRE);
+
+    // LUAMONGO_MULTIPLEXER
+    mongo_multiplexer_register(L);
+    lua_setfield(L, -2, LUAMONGO_MULTIPLEXER);
+
+    // LUAMONGO_PREPARED
+    mongo_prepared_register(L);
+    lua_setfield(L, -2, LUAMONGO_PREPARED);
+
+    // LUAMONGO_INSERTBUFFER
+    mongo_insert_buffer_register(L);
+    lua_setfield(L, -2, LUAMONGO_INSERTBUFFER);
+
+    // LUAMONGO_POOL
+    mongo_pool_register(L);
+    lua_setfield(L, -2, LUAMONGO_POOL);
+
     /*
      * push the created table to the top of the stack
      * so "mongo = require('mongo')" works
@@ -0,0 +1,754 @@
+#include <client/dbclient.h>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread_time.hpp>
+#include <deque>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "utils.h"
+#include "common.h"
+#include "mongo_dbclient.h"
+#include "mongo_cache.h"
+
+using namespace mongo;
+
+extern void bson_to_lua(lua_State *L, const BSONObj &obj);
+extern bool lua_to_bson_ordered(lua_State *L, int index, BSONObj &object);
+extern bool lua_to_bson_ordered_query(lua_State *L, int index, Query &query);
+extern bool lua_to_write_concern(lua_State *L, int index, WriteConcern &wc);
+extern void background_thread_start(const boost::function<void ()> &body);
+
+// registry field of the table mapping DBClients to their AsyncClient, with
+// weak values
+#define LUAMONGO_ASYNC_CLIENTS "luamongo.async_clients"
+// seconds, socket timeout of the workers when the DBClient has none
+#define ASYNC_SOCKET_TIMEOUT 30
+
+namespace {
+    /*
+     * An operation run by a worker thread. Its arguments are converted to
+     * BSON by the Lua thread before it is queued and its results are only
+     * decoded by the Lua thread once done is set.
+     */
+    struct AsyncJob {
+        enum Type { FIND_ONE, QUERY, COUNT, INSERT, UPDATE, REMOVE, COMMAND };
+
+        Type type;
+        std::string ns;
+        BSONObj query;      // query, document or command
+        BSONObj object;     // projection or update object
+        int options;
+        int limit;
+        int skip;
+        bool upsert;
+        bool multi;         // multi for updates, justOne for removes
+        WriteConcern wc;    // of writes
+        // of writes, keeps the DBClient from caching results of ns until
+        // the write is done
+        boost::shared_ptr<bool> hold;
+
+        boost::mutex mutex;
+        boost::condition_variable finished;
+        bool done;
+        std::string error;
+        std::vector<BSONObj> results;
+        long long n;
+
+        AsyncJob(Type type, const std::string &ns) :
+            type(type), ns(ns), options(0), limit(0), skip(0), upsert(false),
+            multi(false), done(false), n(0) { }
+    };
+
+    typedef boost::shared_ptr<AsyncJob> AsyncJobPtr;
+
+    void run_job(DBClientBase *client, AsyncJob &job) {
+        const BSONObj *fields = job.object.isEmpty() ? NULL : &job.object;
+
+        switch (job.type) {
+        case AsyncJob::FIND_ONE: {
+            BSONObj doc = client->findOne(job.ns, Query(job.query), fields, job.options);
+            if (!doc.isEmpty()) job.results.push_back(doc.getOwned());
+            break;
+        }
+        case AsyncJob::QUERY: {
+            std::auto_ptr<DBClientCursor> cursor =
+                client->query(job.ns, Query(job.query), job.limit, job.skip, fields, job.options);
+            if (!cursor.get()) {
+                throw std::runtime_error(LUAMONGO_ERR_CONNECTION_LOST);
+            }
+            while (cursor->more()) {
+                job.results.push_back(cursor->nextSafe().getOwned());
+            }
+            break;
+        }
+        case AsyncJob::COUNT:
+            job.n = client->count(job.ns, job.query, job.options);
+            break;
+        case AsyncJob::INSERT:
+            client->insert(job.ns, job.query, 0, &job.wc);
+            break;
+        case AsyncJob::UPDATE:
+            client->update(job.ns, Query(job.query), job.object, job.upsert, job.multi, &job.wc);
+            break;
+        case AsyncJob::REMOVE:
+            client->remove(job.ns, Query(job.query), job.multi, &job.wc);
+            break;
+        case AsyncJob::COMMAND: {
+            BSONObj info;
+            if (!client->runCommand(job.ns, job.query, info, job.options)) {
+                throw std::runtime_error(info["errmsg"].str());
+            }
+            job.results.push_back(info.getOwned());
+            break;
+        }
+        }
+    }
+
+    void finish_job(AsyncJob &job, const std::string &error) {
+        job.hold.reset();
+        boost::mutex::scoped_lock lock(job.mutex);
+        job.error = error;
+        job.done = true;
+        job.finished.notify_all();
+    }
+
+    class AsyncPool;
+    typedef boost::shared_ptr<AsyncPool> AsyncPoolPtr;
+
+    /*
+     * Worker threads, each one with its own connection to the server of the
+     * DBClient which created the pool, opened when its first job arrives.
+     * Workers share the ownership of the pool, so stopping it never waits
+     * for a running job; they are joined once they return or when the
+     * module is unloaded, which the socket timeout of their connection
+     * bounds.
+     */
+    class AsyncPool {
+    public:
+        static AsyncPoolPtr start(const std::string &address,
+                                  const std::vector<LuaCredential> &credentials,
+                                  const WriteConcern &wc, double timeout, int nthreads) {
+            AsyncPoolPtr pool(new AsyncPool(address, credentials, wc, timeout));
+            try {
+                for (int i = 0; i < nthreads; ++i) {
+                    background_thread_start(boost::bind(&AsyncPool::work, pool));
+                }
+            } catch (...) {
+                pool->stop();
+                throw;
+            }
+            return pool;
+        }
+
+        // pending jobs fail, running ones finish in their worker
+        void stop() {
+            std::deque<AsyncJobPtr> pending;
+            {
+                boost::mutex::scoped_lock lock(mutex);
+                stopping = true;
+                pending.swap(queue);
+            }
+            available.notify_all();
+            for (size_t i = 0; i < pending.size(); ++i) {
+                finish_job(*pending[i], "async client closed");
+            }
+        }
+
+        const WriteConcern& write_concern() const { return wc; }
+
+        void submit(const AsyncJobPtr &job) {
+            {
+                boost::mutex::scoped_lock lock(mutex);
+                queue.push_back(job);
+            }
+            available.notify_one();
+        }
+
+    private:
+        std::string address;
+        std::vector<LuaCredential> credentials;
+        WriteConcern wc;
+        double timeout;
+
+        boost::mutex mutex;
+        boost::condition_variable available;
+        std::deque<AsyncJobPtr> queue;
+        bool stopping;
+
+        AsyncPool(const std::string &address,
+                  const std::vector<LuaCredential> &credentials,
+                  const WriteConcern &wc, double timeout) :
+            address(address), credentials(credentials), wc(wc), timeout(timeout),
+            stopping(false) { }
+
+        DBClientBase* connect() {
+            std::string errmsg;
+            ConnectionString cs = ConnectionString::parse(address, errmsg);
+            if (!cs.isValid()) {
+                throw std::runtime_error(errmsg);
+            }
+            std::auto_ptr<DBClientBase> client(cs.connect(errmsg, timeout));
+            if (!client.get()) {
+                throw std::runtime_error(errmsg);
+            }
+            for (size_t i = 0; i < credentials.size(); ++i) {
+                const LuaCredential &c = credentials[i];
+                if (!client->auth(c.dbname, c.username, c.password, errmsg, c.digestPassword)) {
+                    throw std::runtime_error(errmsg);
+                }
+            }
+            client->setWriteConcern(wc);
+            return client.release();
+        }
+
+        void work() {
+            DBClientBase *client = NULL;
+
+            for (;;) {
+                AsyncJobPtr job;
+                {
+                    boost::mutex::scoped_lock lock(mutex);
+                    while (queue.empty() && !stopping) {
+                        available.wait(lock);
+                    }
+                    if (stopping) break;
+                    job = queue.front();
+                    queue.pop_front();
+                }
+
+                std::string error;
+                try {
+                    if (!client) client = connect();
+                    run_job(client, *job);
+                } catch (std::exception &e) {
+                    error = e.what();
+                    if (error.empty()) error = "unknown error";
+                    if (client && client->isFailed()) {
+                        delete client;
+                        client = NULL;
+                    }
+                }
+                finish_job(*job, error);
+            }
+
+            delete client;
+        }
+    };
+
+    /*
+     * AsyncClient userdata, its DBClient is its owner
+     */
+    struct LuaAsync {
+        AsyncPoolPtr *pool;
+        LuaDBClient *owner;
+    };
+
+    inline LuaAsync* userdata_to_async(lua_State *L, int index) {
+        LuaAsync *async = (LuaAsync *)luaL_checkudata(L, index, LUAMONGO_ASYNC);
+        if (!async->pool)
+            luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_ASYNC);
+
+        return async;
+    }
+
+    inline AsyncJobPtr& userdata_to_future(lua_State *L, int index) {
+        return **((AsyncJobPtr **)luaL_checkudata(L, index, LUAMONGO_FUTURE));
+    }
+
+    int submit_job(lua_State *L, LuaAsync *async, const AsyncJobPtr &job) {
+        AsyncJobPtr **future = (AsyncJobPtr **)lua_newuserdata(L, sizeof(AsyncJobPtr *));
+        *future = new AsyncJobPtr(job);
+
+        luaL_getmetatable(L, LUAMONGO_FUTURE);
+        lua_setmetatable(L, -2);
+
+        (*async->pool)->submit(job);
+
+        return 1;
+    }
+
+    /*
+     * write concern of a write job: the one of the pool overridden by the
+     * table at index, if any. The cached results of ns are dropped when the
+     * write is queued, and no result of ns is cached until it is done.
+     */
+    void prepare_write(lua_State *L, LuaAsync *async, AsyncJob &job, int index) {
+        job.wc = (*async->pool)->write_concern();
+        lua_to_write_concern(L, index, job.wc);
+        dbclient_invalidate(async->owner, job.ns);
+        if (async->owner->cache) {
+            job.hold = async->owner->cache->hold(job.ns);
+        }
+    }
+
+    int push_job_result(lua_State *L, const AsyncJob &job) {
+        if (!job.error.empty()) {
+            lua_pushnil(L);
+            lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_FUTURE, "wait", job.error.c_str());
+            return 2;
+        }
+
+        switch (job.type) {
+        case AsyncJob::FIND_ONE:
+        case AsyncJob::COMMAND:
+            if (job.results.empty()) {
+                lua_pushnil(L);
+            } else {
+                bson_to_lua(L, job.results[0]);
+            }
+            break;
+        case AsyncJob::QUERY:
+            lua_createtable(L, job.results.size(), 0);
+            for (size_t i = 0; i < job.results.size(); ++i) {
+                bson_to_lua(L, job.results[i]);
+                lua_rawseti(L, -2, i + 1);
+            }
+            break;
+        case AsyncJob::COUNT:
+            lua_pushnumber(L, job.n);
+            break;
+        default:
+            lua_pushboolean(L, 1);
+        }
+
+        return 1;
+    }
+
+    /*
+     * yields the calling coroutine until the future is ready, blocks when it
+     * is called from the main thread
+     */
+    const char *future_await_chunk =
+        "local running, yield = coroutine.running, coroutine.yield\n"
+        "return function(self)\n"
+        "    local co, main = running()\n"
+        "    if co and not main then\n"
+        "        while not self:ready() do yield(self) end\n"
+        "    end\n"
+        "    return self:wait()\n"
+        "end\n";
+}
+
+/*
+ * async = db:async([{threads=4, timeout=seconds}])
+ *    returns the AsyncClient of the DBClient, creating it when it has none
+ *    in use. Its threads open their own connections to the same server,
+ *    replaying the credentials of db:auth() and the default write concern,
+ *    with the socket timeout of the DBClient unless timeout is given.
+ */
+int async_create(lua_State *L, int owner, int nthreads, double timeout) {
+    LuaDBClient *db = userdata_to_luadbclient(L, owner);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, LUAMONGO_ASYNC_CLIENTS);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_createtable(L, 0, 1);
+        lua_pushliteral(L, "v");
+        lua_setfield(L, -2, "__mode");
+        lua_setmetatable(L, -2);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, LUA_REGISTRYINDEX, LUAMONGO_ASYNC_CLIENTS);
+    }
+    int clients = lua_gettop(L);
+
+    lua_pushvalue(L, owner);
+    lua_rawget(L, clients);
+    if (lua_touserdata(L, -1) && ((LuaAsync *)lua_touserdata(L, -1))->pool) {
+        return 1;
+    }
+    lua_pop(L, 1);
+
+    if (timeout <= 0) timeout = db->client->getSoTimeout();
+    if (timeout <= 0) timeout = ASYNC_SOCKET_TIMEOUT;
+
+    try {
+        LuaAsync *async = (LuaAsync *)lua_newuserdata(L, sizeof(LuaAsync));
+        async->pool = NULL;
+        async->owner = db;
+        luaL_getmetatable(L, LUAMONGO_ASYNC);
+        lua_setmetatable(L, -2);
+
+        async->pool = new AsyncPoolPtr(AsyncPool::start(
+            db->client->getServerAddress(), *db->credentials,
+            db->client->getWriteConcern(), timeout, nthreads));
+        lua_set_owner(L, -1, owner);
+
+        lua_pushvalue(L, owner);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, clients);
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "async", e.what());
+        return 2;
+    }
+
+    return 1;
+}
+
+/*
+ * future = async:find_one(ns, json_str/lua_table/query_obj, json_str/lua_table, options)
+ */
+static int async_find_one(lua_State *L) {
+    LuaAsync *async = userdata_to_async(L, 1);
+    const char *ns = luaL_checkstring(L, 2);
+
+    try {
+        AsyncJobPtr job(new AsyncJob(AsyncJob::FIND_ONE, ns));
+        Query query;
+        if (!lua_isnoneornil(L, 3) && !lua_to_bson_ordered_query(L, 3, query)) {
+            throw (LUAMONGO_REQUIRES_QUERY);
+        }
+        job->query = query.obj;
+        if (!lua_isnoneornil(L, 4) && !lua_to_bson_ordered(L, 4, job->object)) {
+            throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+        }
+        job->options = luaL_optint(L, 5, 0);
+        return submit_job(L, async, job);
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_ASYNC, "find_one", e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_ASYNC, "find_one", err);
+        return 2;
+    }
+}
+
+/*
+ * future = async:query(ns, json_str/lua_table/query_obj, limit, skip, json_str/lua_table, options)
+ *    the future resolves to an array with all the documents
+ */
+static int async_query(lua_State *L) {
+    LuaAsync *async = userdata_to_async(L, 1);
+    const char *ns = luaL_checkstring(L, 2);
+
+    try {
+        AsyncJobPtr job(new AsyncJob(AsyncJob::QUERY, ns));
+        Query query;
+        if (!lua_isnoneornil(L, 3) && !lua_to_bson_ordered_query(L, 3, query)) {
+            throw (LUAMONGO_REQUIRES_QUERY);
+        }
+        job->query = query.obj;
+        job->limit = luaL_optint(L, 4, 0);
+        job->skip = luaL_optint(L, 5, 0);
+        if (!lua_isnoneornil(L, 6) && !lua_to_bson_ordered(L, 6, job->object)) {
+            throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+        }
+        job->options = luaL_optint(L, 7, 0);
+        return submit_job(L, async, job);
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_ASYNC, "query", e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_ASYNC, "query", err);
+        return 2;
+    }
+}
+
+/*
+ * future = async:count(ns, json_str/lua_table)
+ */
+static int async_count(lua_State *L) {
+    LuaAsync *async = userdata_to_async(L, 1);
+    const char *ns = luaL_checkstring(L, 2);
+
+    try {
+        AsyncJobPtr job(new AsyncJob(AsyncJob::COUNT, ns));
+        if (!lua_isnoneornil(L, 3) && !lua_to_bson_ordered(L, 3, job->query)) {
+            throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+        }
+        return submit_job(L, async, job);
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_ASYNC, "count", e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_ASYNC, "count", err);
+        return 2;
+    }
+}
+
+/*
+ * future = async:insert(ns, json_str/lua_table[, write_concern])
+ */
+static int async_insert(lua_State *L) {
+    LuaAsync *async = userdata_to_async(L, 1);
+    const char *ns = luaL_checkstring(L, 2);
+
+    try {
+        AsyncJobPtr job(new AsyncJob(AsyncJob::INSERT, ns));
+        if (!lua_to_bson_ordered(L, 3, job->query)) {
+            throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+        }
+        prepare_write(L, async, *job, 4);
+        return submit_job(L, async, job);
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_ASYNC, "insert", e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_ASYNC, "insert", err);
+        return 2;
+    }
+}
+
+/*
+ * future = async:update(ns, json_str/lua_table/query_obj, json_str/lua_table, upsert, multi[, write_concern])
+ */
+static int async_update(lua_State *L) {
+    LuaAsync *async = userdata_to_async(L, 1);
+    const char *ns = luaL_checkstring(L, 2);
+
+    try {
+        AsyncJobPtr job(new AsyncJob(AsyncJob::UPDATE, ns));
+        Query query;
+        if (!lua_to_bson_ordered_query(L, 3, query)) {
+            throw (LUAMONGO_REQUIRES_QUERY);
+        }
+        job->query = query.obj;
+        if (!lua_to_bson_ordered(L, 4, job->object)) {
+            throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+        }
+        job->upsert = lua_toboolean(L, 5);
+        job->multi = lua_toboolean(L, 6);
+        prepare_write(L, async, *job, 7);
+        return submit_job(L, async, job);
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_ASYNC, "update", e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_ASYNC, "update", err);
+        return 2;
+    }
+}
+
+/*
+ * future = async:remove(ns, json_str/lua_table/query_obj, justOne[, write_concern])
+ */
+static int async_remove(lua_State *L) {
+    LuaAsync *async = userdata_to_async(L, 1);
+    const char *ns = luaL_checkstring(L, 2);
+
+    try {
+        AsyncJobPtr job(new AsyncJob(AsyncJob::REMOVE, ns));
+        Query query;
+        if (!lua_to_bson_ordered_query(L, 3, query)) {
+            throw (LUAMONGO_REQUIRES_QUERY);
+        }
+        job->query = query.obj;
+        job->multi = lua_toboolean(L, 4);
+        prepare_write(L, async, *job, 5);
+        return submit_job(L, async, job);
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_ASYNC, "remove", e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_ASYNC, "remove", err);
+        return 2;
+    }
+}
+
+/*
+ * future = async:run_command(dbname, json_str/lua_table(ordered), options)
+ */
+static int async_run_command(lua_State *L) {
+    LuaAsync *async = userdata_to_async(L, 1);
+    const char *ns = luaL_checkstring(L, 2);
+
+    try {
+        AsyncJobPtr job(new AsyncJob(AsyncJob::COMMAND, ns));
+        if (!lua_to_bson_ordered(L, 3, job->query)) {
+            throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+        }
+        job->options = luaL_optint(L, 4, 0);
+        return submit_job(L, async, job);
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_ASYNC, "run_command", e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_ASYNC, "run_command", err);
+        return 2;
+    }
+}
+
+/*
+ * async:close()
+ *    fails the queued operations without waiting for the running ones,
+ *    their futures still get their results
+ * __gc, __close
+ */
+static int async_close(lua_State *L) {
+    LuaAsync *async = (LuaAsync *)luaL_checkudata(L, 1, LUAMONGO_ASYNC);
+
+    if (async->pool) {
+        (*async->pool)->stop();
+        delete async->pool;
+        async->pool = NULL;
+    }
+
+    return 0;
+}
+
+/*
+ * __tostring
+ */
+static int async_tostring(lua_State *L) {
+    LuaAsync *async = (LuaAsync *)luaL_checkudata(L, 1, LUAMONGO_ASYNC);
+
+    lua_pushfstring(L, "%s: %p", LUAMONGO_ASYNC, async->pool ? async->pool->get() : NULL);
+
+    return 1;
+}
+
+/*
+ * ok = future:ready()
+ */
+static int future_ready(lua_State *L) {
+    AsyncJobPtr &job = userdata_to_future(L, 1);
+
+    boost::mutex::scoped_lock lock(job->mutex);
+    lua_pushboolean(L, job->done);
+
+    return 1;
+}
+
+/*
+ * result,err = future:wait([timeout])
+ *    blocks until the operation is done, at most timeout seconds, and returns
+ *    its result: a table or nil for find_one and run_command, an array for
+ *    query, a number for count and true for writes
+ */
+static int future_wait(lua_State *L) {
+    AsyncJobPtr &job = userdata_to_future(L, 1);
+    bool done;
+
+    {
+        boost::mutex::scoped_lock lock(job->mutex);
+        if (lua_isnoneornil(L, 2)) {
+            while (!job->done) {
+                job->finished.wait(lock);
+            }
+        } else {
+            boost::system_time deadline = boost::get_system_time() +
+                boost::posix_time::milliseconds((long)(luaL_checknumber(L, 2) * 1000));
+            while (!job->done && job->finished.timed_wait(lock, deadline)) {
+            }
+        }
+        done = job->done;
+    }
+
+    if (!done) {
+        lua_pushnil(L);
+        lua_pushliteral(L, "timeout");
+        return 2;
+    }
+
+    return push_job_result(L, *job);
+}
+
+/*
+ * __gc
+ */
+static int future_gc(lua_State *L) {
+    AsyncJobPtr **future = (AsyncJobPtr **)luaL_checkudata(L, 1, LUAMONGO_FUTURE);
+
+    delete *future;
+    *future = NULL;
+
+    return 0;
+}
+
+/*
+ * __tostring
+ */
+static int future_tostring(lua_State *L) {
+    AsyncJobPtr &job = userdata_to_future(L, 1);
+
+    lua_pushfstring(L, "%s: %p", LUAMONGO_FUTURE, job.get());
+
+    return 1;
+}
+
+int mongo_async_register(lua_State *L) {
+    static const luaL_Reg async_methods[] = {
+        {"close", async_close},
+        {"count", async_count},
+        {"find_one", async_find_one},
+        {"insert", async_insert},
+        {"query", async_query},
+        {"remove", async_remove},
+        {"run_command", async_run_command},
+        {"update", async_update},
+        {NULL, NULL}
+    };
+
+    static const luaL_Reg future_methods[] = {
+        {"ready", future_ready},
+        {"wait", future_wait},
+        {NULL, NULL}
+    };
+
+    static const luaL_Reg async_class_methods[] = {
+        {NULL, NULL}
+    };
+
+    luaL_newmetatable(L, LUAMONGO_ASYNC);
+    luaL_setfuncs(L, async_methods, 0);
+    lua_pushvalue(L,-1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, async_close);
+    lua_setfield(L, -2, "__gc");
+
+#if LUA_VERSION_NUM >= 504
+    lua_pushcfunction(L, async_close);
+    lua_setfield(L, -2, "__close");
+#endif
+
+    lua_pushcfunction(L, async_tostring);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pop(L,1);
+
+    luaL_newmetatable(L, LUAMONGO_FUTURE);
+    luaL_setfuncs(L, future_methods, 0);
+    if (luaL_loadstring(L, future_await_chunk) != 0) {
+        lua_error(L);
+    }
+    lua_call(L, 0, 1);
+    lua_setfield(L, -2, "await");
+    lua_pushvalue(L,-1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, future_gc);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pushcfunction(L, future_tostring);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pop(L,1);
+
+    #if LUA_VERSION_NUM < 502
+    luaL_register(L, LUAMONGO_ASYNC, async_class_methods);
+    #else
+    luaL_newlib(L, async_class_methods);
+    #endif
+
+    return 1;
+}
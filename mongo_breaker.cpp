@@ -0,0 +1,67 @@
+#include <stdlib.h>
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include "mongo_breaker.h"
+
+extern double monotonic_time();
+
+CircuitBreaker::CircuitBreaker(const BreakerOptions &options) :
+    state(CLOSED), failures(0), totalFailures(0), rejected(0), opened(0), since(0),
+    opts(options), nextAttempt(0) {
+    if (opts.threshold < 1) opts.threshold = 1;
+    opts.jitter = std::min(1.0, std::max(0.0, opts.jitter));
+    seed = (unsigned int)(monotonic_time() * 1e6) ^ (unsigned int)(size_t)this;
+}
+
+bool CircuitBreaker::allow(double now) {
+    if (now >= nextAttempt) {
+        if (state == OPEN) {
+            state = HALF_OPEN;
+            since = now;
+        }
+        return true;
+    }
+    ++rejected;
+    return false;
+}
+
+void CircuitBreaker::success(double now) {
+    failures = 0;
+    nextAttempt = 0;
+    if (state != CLOSED) {
+        state = CLOSED;
+        since = now;
+    }
+}
+
+void CircuitBreaker::failure(double now, const std::string &error) {
+    ++failures;
+    ++totalFailures;
+    lastError = error;
+    if (state == HALF_OPEN || failures >= opts.threshold) {
+        if (state != OPEN) {
+            ++opened;
+            since = now;
+        }
+        state = OPEN;
+        nextAttempt = now + opts.cooldown;
+        return;
+    }
+    // the delay is taken uniformly in [(1 - jitter) * delay, delay]
+    double delay = std::min(opts.maxBackoff, opts.backoff * std::pow(2.0, failures - 1));
+    delay *= 1 - opts.jitter * rand_r(&seed) / ((double)RAND_MAX + 1);
+    nextAttempt = now + delay;
+}
+
+double CircuitBreaker::wait(double now) const {
+    return std::max(0.0, nextAttempt - now);
+}
+
+const char* CircuitBreaker::state_name(State state) {
+    switch (state) {
+    case OPEN: return "open";
+    case HALF_OPEN: return "half_open";
+    default: return "closed";
+    }
+}
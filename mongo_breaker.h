@@ -0,0 +1,62 @@
+#ifndef LUAMONGO_BREAKER_H
+#define LUAMONGO_BREAKER_H
+
+#include <string>
+
+struct BreakerOptions {
+    // consecutive connection failures opening the circuit
+    int threshold;
+    // seconds the circuit stays open before a probe is let through
+    double cooldown;
+    // seconds, delay before the first reconnection, doubled at every
+    // failure up to maxBackoff
+    double backoff;
+    double maxBackoff;
+    // part of the delay which is random, between 0 and 1
+    double jitter;
+
+    BreakerOptions() : threshold(5), cooldown(10), backoff(0.1), maxBackoff(10),
+                       jitter(0.5) { }
+};
+
+/*
+ * Reconnection policy of a Connection. After a failure the next attempt is
+ * delayed with an exponential backoff and jitter, and calls before it fail
+ * at once. After threshold consecutive failures the circuit opens and calls
+ * fail at once for cooldown seconds; then a single attempt (half-open) either
+ * closes it or opens it again. Times come from monotonic_time().
+ */
+class CircuitBreaker {
+public:
+    enum State { CLOSED, OPEN, HALF_OPEN };
+
+    explicit CircuitBreaker(const BreakerOptions &options);
+
+    // whether a connection attempt can be made now, counts the rejections
+    bool allow(double now);
+    void success(double now);
+    void failure(double now, const std::string &error);
+    // seconds until allow() accepts an attempt, 0 if it does now
+    double wait(double now) const;
+
+    const BreakerOptions& options() const { return opts; }
+    static const char* state_name(State state);
+
+    // host:port of the Connection, empty before connection:connect()
+    std::string server;
+    State state;
+    int failures;
+    std::string lastError;
+    unsigned long long totalFailures;
+    unsigned long long rejected;
+    unsigned long long opened;
+    // last change of state
+    double since;
+
+private:
+    BreakerOptions opts;
+    double nextAttempt;
+    unsigned int seed;
+};
+
+#endif
@@ -0,0 +1,451 @@
+#include <client/dbclient.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "utils.h"
+#include "common.h"
+#include "mongo_dbclient.h"
+#include "mongo_bulk.h"
+
+using namespace mongo;
+
+extern void bson_to_lua(lua_State *L, const BSONObj &obj);
+extern bool lua_to_bson_ordered(lua_State *L, int index, BSONObj &object);
+extern bool lua_to_bson_ordered_query(lua_State *L, int index, Query &query);
+extern bool lua_to_write_concern(lua_State *L, int index, WriteConcern &wc);
+
+namespace {
+    // limits of one write command accepted by the server
+    const size_t MAX_WRITE_BATCH_SIZE  = 1000;
+    const int    MAX_WRITE_BATCH_BYTES = BSONObjMaxUserSize - 16 * 1024;
+
+    const char *command_names[] = { "insert", "update", "delete" };
+    const char *entries_names[] = { "documents", "updates", "deletes" };
+
+    struct BulkWrite {
+        LuaDBClient *owner;
+        std::string ns;
+        bool ordered;
+        std::vector<WriteOp> ops;
+
+        BulkWrite(LuaDBClient *owner, const std::string &ns, bool ordered) :
+            owner(owner), ns(ns), ordered(ordered) { }
+    };
+
+    inline BulkWrite* userdata_to_bulk(lua_State *L, int index) {
+        void *ud = 0;
+
+        ud = luaL_checkudata(L, index, LUAMONGO_BULK);
+        BulkWrite *bulk = *((BulkWrite **)ud);
+        if (!bulk)
+            luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_BULK);
+        if (!bulk->owner->client)
+            luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_DBCLIENT);
+
+        return bulk;
+    }
+
+    /*
+     * adds the counters of one write command reply to result, first is the
+     * position in indexes of the first entry sent with that command
+     */
+    void merge_reply(WriteOp::Type type, const BSONObj &reply,
+                     const std::vector<size_t> &indexes, size_t first,
+                     WriteOpsResult &result) {
+        long long n = reply["n"].numberLong();
+        long long upserted = 0;
+
+        if (reply["upserted"].type() == Array) {
+            BSONObjIterator it(reply["upserted"].embeddedObject());
+            while (it.more()) {
+                BSONObj entry = it.next().embeddedObject();
+                BSONObjBuilder b;
+                b.append("index", (long long)indexes[first + entry["index"].numberInt()] + 1);
+                b.appendAs(entry["_id"], "_id");
+                result.upserted.push_back(b.obj());
+                ++upserted;
+            }
+        }
+
+        switch (type) {
+        case WriteOp::WRITE_INSERT:
+            result.nInserted += n;
+            break;
+        case WriteOp::WRITE_UPDATE:
+            result.nMatched  += n - upserted;
+            result.nModified += reply["nModified"].numberLong();
+            result.nUpserted += upserted;
+            break;
+        case WriteOp::WRITE_DELETE:
+            result.nRemoved  += n;
+            break;
+        }
+
+        if (reply["writeErrors"].type() == Array) {
+            BSONObjIterator it(reply["writeErrors"].embeddedObject());
+            while (it.more()) {
+                BSONObj error = it.next().embeddedObject();
+                BSONObjBuilder b;
+                b.append("index", (long long)indexes[first + error["index"].numberInt()] + 1);
+                b.append("code", error["code"].numberInt());
+                b.append("errmsg", error["errmsg"].str());
+                result.writeErrors.push_back(b.obj());
+            }
+        }
+
+        if (reply["writeConcernError"].isABSONObj()) {
+            result.writeConcernErrors.push_back(reply["writeConcernError"].embeddedObject().getOwned());
+        }
+    }
+
+    /*
+     * sends the operations at indexes, all of the same type, in as few
+     * write commands as the server limits allow. Returns false when an
+     * ordered execution has to stop after a write error.
+     */
+    bool send_write_batches(DBClientBase *client, const std::string &db,
+                            const std::string &collection, WriteOp::Type type,
+                            const std::vector<WriteOp> &ops,
+                            const std::vector<size_t> &indexes, bool ordered,
+                            const BSONObj &writeConcern, WriteOpsResult &result) {
+        size_t first = 0;
+
+        while (first < indexes.size()) {
+            size_t last = first;
+            BSONObjBuilder cmd;
+            cmd.append(command_names[type], collection);
+            {
+                BSONArrayBuilder entries(cmd.subarrayStart(entries_names[type]));
+                int bytes = 0;
+                while (last < indexes.size() && last - first < MAX_WRITE_BATCH_SIZE) {
+                    const BSONObj &entry = ops[indexes[last]].entry;
+                    // a single oversized entry is sent alone and rejected by the server
+                    if (last > first && bytes + entry.objsize() > MAX_WRITE_BATCH_BYTES)
+                        break;
+                    entries.append(entry);
+                    bytes += entry.objsize();
+                    ++last;
+                }
+                entries.done();
+            }
+            cmd.append("ordered", ordered);
+            cmd.append("writeConcern", writeConcern);
+
+            BSONObj reply;
+            if (!client->runCommand(db, cmd.obj(), reply)) {
+                throw std::runtime_error(reply["errmsg"].str());
+            }
+            size_t errors = result.writeErrors.size();
+            merge_reply(type, reply, indexes, first, result);
+            if (ordered && result.writeErrors.size() > errors)
+                return false;
+
+            first = last;
+        }
+
+        return true;
+    }
+}
+
+/*
+ * Sends ops to ns using insert, update and delete write commands. Ordered
+ * executions send consecutive runs of the same type in order and stop at the
+ * first write error; unordered ones send one group per type.
+ */
+void write_ops_execute(DBClientBase *client, const std::string &ns,
+                       const std::vector<WriteOp> &ops, bool ordered,
+                       const WriteConcern &wc, WriteOpsResult &result) {
+    size_t dot = ns.find('.');
+    if (dot == std::string::npos) {
+        throw std::invalid_argument("invalid namespace: " + ns);
+    }
+    std::string db = ns.substr(0, dot);
+    std::string collection = ns.substr(dot + 1);
+    BSONObj writeConcern = wc.obj();
+
+    if (ordered) {
+        size_t i = 0;
+        while (i < ops.size()) {
+            WriteOp::Type type = ops[i].type;
+            std::vector<size_t> run;
+            for (; i < ops.size() && ops[i].type == type; ++i)
+                run.push_back(i);
+            if (!send_write_batches(client, db, collection, type, ops, run, true, writeConcern, result))
+                return;
+        }
+    } else {
+        const WriteOp::Type types[] = {
+            WriteOp::WRITE_INSERT, WriteOp::WRITE_UPDATE, WriteOp::WRITE_DELETE
+        };
+        for (int t = 0; t < 3; ++t) {
+            std::vector<size_t> group;
+            for (size_t i = 0; i < ops.size(); ++i)
+                if (ops[i].type == types[t])
+                    group.push_back(i);
+            if (!group.empty())
+                send_write_batches(client, db, collection, types[t], ops, group, false, writeConcern, result);
+        }
+    }
+}
+
+static void push_objects(lua_State *L, const char *name, const std::vector<BSONObj> &objects) {
+    lua_pushstring(L, name);
+    lua_newtable(L);
+    for (size_t i = 0; i < objects.size(); ++i) {
+        bson_to_lua(L, objects[i]);
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_rawset(L, -3);
+}
+
+void write_ops_result_push(lua_State *L, const WriteOpsResult &result) {
+    lua_newtable(L);
+    LUA_PUSH_ATTRIB_FLOAT("nInserted", result.nInserted);
+    LUA_PUSH_ATTRIB_FLOAT("nMatched", result.nMatched);
+    LUA_PUSH_ATTRIB_FLOAT("nModified", result.nModified);
+    LUA_PUSH_ATTRIB_FLOAT("nRemoved", result.nRemoved);
+    LUA_PUSH_ATTRIB_FLOAT("nUpserted", result.nUpserted);
+    push_objects(L, "upserted", result.upserted);
+    push_objects(L, "writeErrors", result.writeErrors);
+    push_objects(L, "writeConcernErrors", result.writeConcernErrors);
+}
+
+/*
+ * creates a BulkWrite for the DBClient at index owner, keeping it alive
+ */
+int bulk_create(lua_State *L, int owner, const char *ns, bool ordered) {
+    LuaDBClient *db = userdata_to_luadbclient(L, owner);
+
+    BulkWrite **bulk = (BulkWrite **)lua_newuserdata(L, sizeof(BulkWrite *));
+    *bulk = new BulkWrite(db, ns, ordered);
+
+    luaL_getmetatable(L, LUAMONGO_BULK);
+    lua_setmetatable(L, -2);
+
+    lua_set_owner(L, lua_gettop(L), owner);
+
+    return 1;
+}
+
+/*
+ * ok,err = bulk:insert(json_str/lua_table)
+ */
+static int bulk_insert(lua_State *L) {
+    BulkWrite *bulk = userdata_to_bulk(L, 1);
+
+    try {
+        BSONObj doc;
+        if (!lua_to_bson_ordered(L, 2, doc)) {
+            throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+        }
+        bulk->ops.push_back(WriteOp(WriteOp::WRITE_INSERT, doc));
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_BULK, "insert", e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_BULK, "insert", err);
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * ok,err = bulk:update(query, json_str/lua_table[, {upsert=bool, multi=bool}])
+ */
+static int bulk_update(lua_State *L) {
+    BulkWrite *bulk = userdata_to_bulk(L, 1);
+
+    try {
+        Query query;
+        if (!lua_to_bson_ordered_query(L, 2, query)) {
+            throw (LUAMONGO_REQUIRES_QUERY);
+        }
+        BSONObj obj;
+        if (!lua_to_bson_ordered(L, 3, obj)) {
+            throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+        }
+        bool upsert = false;
+        bool multi = false;
+        if (lua_type(L, 4) == LUA_TTABLE) {
+            lua_getfield(L, 4, "upsert");
+            upsert = lua_toboolean(L, -1);
+            lua_getfield(L, 4, "multi");
+            multi = lua_toboolean(L, -1);
+            lua_pop(L, 2);
+        }
+
+        BSONObjBuilder b;
+        b.append("q", query.getFilter());
+        b.append("u", obj);
+        b.append("upsert", upsert);
+        b.append("multi", multi);
+        bulk->ops.push_back(WriteOp(WriteOp::WRITE_UPDATE, b.obj()));
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_BULK, "update", e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_BULK, "update", err);
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * ok,err = bulk:remove(query[, {limit=0|1}])
+ *    limit 1 removes only the first matching document
+ */
+static int bulk_remove(lua_State *L) {
+    BulkWrite *bulk = userdata_to_bulk(L, 1);
+
+    try {
+        Query query;
+        if (!lua_to_bson_ordered_query(L, 2, query)) {
+            throw (LUAMONGO_REQUIRES_QUERY);
+        }
+        int limit = 0;
+        if (lua_type(L, 3) == LUA_TTABLE) {
+            lua_getfield(L, 3, "limit");
+            limit = luaL_optint(L, -1, 0);
+            lua_pop(L, 1);
+            if (limit != 0 && limit != 1) {
+                throw ("limit must be 0 or 1");
+            }
+        }
+
+        BSONObjBuilder b;
+        b.append("q", query.getFilter());
+        b.append("limit", limit);
+        bulk->ops.push_back(WriteOp(WriteOp::WRITE_DELETE, b.obj()));
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_BULK, "remove", e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_BULK, "remove", err);
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * result,err = bulk:execute([write_concern])
+ *    result = {nInserted=n, nMatched=n, nModified=n, nRemoved=n, nUpserted=n,
+ *              upserted={{index=i, _id=id}, ...},
+ *              writeErrors={{index=i, code=n, errmsg=str}, ...},
+ *              writeConcernErrors={...}}
+ *    indexes are the positions of the operations in the order they were
+ *    added; the queued operations are cleared, so the object can be reused.
+ *    write_concern defaults to the one of the connection.
+ */
+static int bulk_execute(lua_State *L) {
+    BulkWrite *bulk = userdata_to_bulk(L, 1);
+
+    std::vector<WriteOp> ops;
+    ops.swap(bulk->ops);
+
+    try {
+        dbclient_check_multiplexed(bulk->owner);
+        dbclient_flush_cursors(bulk->owner);
+        dbclient_invalidate(bulk->owner, bulk->ns);
+        WriteConcern wc = bulk->owner->client->getWriteConcern();
+        lua_to_write_concern(L, 2, wc);
+        WriteOpsResult result;
+        write_ops_execute(bulk->owner->client, bulk->ns, ops, bulk->ordered, wc, result);
+        write_ops_result_push(L, result);
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_BULK, "execute", e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_BULK, "execute", err);
+        return 2;
+    }
+
+    return 1;
+}
+
+/*
+ * n = bulk:count()
+ *    number of queued operations
+ */
+static int bulk_count(lua_State *L) {
+    BulkWrite *bulk = userdata_to_bulk(L, 1);
+
+    lua_pushinteger(L, bulk->ops.size());
+
+    return 1;
+}
+
+/*
+ * __gc
+ */
+static int bulk_gc(lua_State *L) {
+    BulkWrite **bulk = (BulkWrite **)luaL_checkudata(L, 1, LUAMONGO_BULK);
+
+    delete *bulk;
+    *bulk = NULL;
+
+    return 0;
+}
+
+/*
+ * __tostring
+ */
+static int bulk_tostring(lua_State *L) {
+    BulkWrite *bulk = *((BulkWrite **)luaL_checkudata(L, 1, LUAMONGO_BULK));
+
+    lua_pushfstring(L, "%s: %p", LUAMONGO_BULK, bulk);
+
+    return 1;
+}
+
+int mongo_bulk_register(lua_State *L) {
+    static const luaL_Reg bulk_methods[] = {
+        {"count", bulk_count},
+        {"execute", bulk_execute},
+        {"insert", bulk_insert},
+        {"remove", bulk_remove},
+        {"update", bulk_update},
+        {NULL, NULL}
+    };
+
+    static const luaL_Reg bulk_class_methods[] = {
+        {NULL, NULL}
+    };
+
+    luaL_newmetatable(L, LUAMONGO_BULK);
+    luaL_setfuncs(L, bulk_methods, 0);
+    lua_pushvalue(L,-1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, bulk_gc);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pushcfunction(L, bulk_tostring);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pushcfunction(L, bulk_count);
+    lua_setfield(L, -2, "__len");
+
+    lua_pop(L,1);
+
+    #if LUA_VERSION_NUM < 502
+    luaL_register(L, LUAMONGO_BULK, bulk_class_methods);
+    #else
+    luaL_newlib(L, bulk_class_methods);
+    #endif
+
+    return 1;
+}
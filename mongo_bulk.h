@@ -0,0 +1,45 @@
+#ifndef LUAMONGO_BULK_H
+#define LUAMONGO_BULK_H
+
+#include <client/dbclient.h>
+#include <string>
+#include <vector>
+
+/*
+ * One statement of an insert, update or delete write command, entry is
+ * the document, the {q, u, upsert, multi} or the {q, limit} object.
+ */
+struct WriteOp {
+    enum Type { WRITE_INSERT, WRITE_UPDATE, WRITE_DELETE };
+
+    Type type;
+    mongo::BSONObj entry;
+
+    WriteOp(Type type, const mongo::BSONObj &entry) : type(type), entry(entry) { }
+};
+
+/*
+ * Merged replies of the write commands sent for a list of WriteOps, the
+ * index fields are 1-based positions in that list.
+ */
+struct WriteOpsResult {
+    long long nInserted;
+    long long nMatched;
+    long long nModified;
+    long long nRemoved;
+    long long nUpserted;
+    // {index, _id} and {index, code, errmsg} objects
+    std::vector<mongo::BSONObj> upserted;
+    std::vector<mongo::BSONObj> writeErrors;
+    std::vector<mongo::BSONObj> writeConcernErrors;
+
+    WriteOpsResult() : nInserted(0), nMatched(0), nModified(0),
+                       nRemoved(0), nUpserted(0) { }
+};
+
+void write_ops_execute(mongo::DBClientBase *client, const std::string &ns,
+                       const std::vector<WriteOp> &ops, bool ordered,
+                       const mongo::WriteConcern &wc, WriteOpsResult &result);
+void write_ops_result_push(lua_State *L, const WriteOpsResult &result);
+
+#endif
@@ -0,0 +1,114 @@
+#include <client/dbclient.h>
+#include "mongo_cache.h"
+
+using namespace mongo;
+
+extern double monotonic_time();
+
+namespace {
+    // bookkeeping cost of an entry besides its key and result
+    const size_t ENTRY_OVERHEAD = 128;
+}
+
+QueryCache::QueryCache(size_t maxBytes, double ttl) :
+    hits(0), misses(0), maxBytes(maxBytes), usedBytes(0), ttl(ttl) {
+}
+
+/*
+ * ns, a NUL separator and the raw bytes of the query, the projection and
+ * the options
+ */
+std::string QueryCache::key(const std::string &ns, const BSONObj &query,
+                            const BSONObj *fields, int options) {
+    std::string k(ns);
+    k.push_back('\0');
+    k.append(query.objdata(), query.objsize());
+    if (fields) {
+        k.append(fields->objdata(), fields->objsize());
+    }
+    k.append((const char *)&options, sizeof(options));
+    return k;
+}
+
+bool QueryCache::get(const std::string &key, BSONObj &result) {
+    EntryMap::iterator it = entries.find(key);
+    if (it == entries.end()) {
+        ++misses;
+        return false;
+    }
+    if (it->second.expires <= monotonic_time()) {
+        erase(it);
+        ++misses;
+        return false;
+    }
+    lru.splice(lru.begin(), lru, it->second.lru);
+    result = it->second.result;
+    ++hits;
+    return true;
+}
+
+void QueryCache::put(const std::string &key, const BSONObj &result) {
+    size_t bytes = key.size() + result.objsize() + ENTRY_OVERHEAD;
+    if (bytes > maxBytes) return;
+
+    EntryMap::iterator it = entries.find(key);
+    if (it != entries.end()) {
+        erase(it);
+    }
+    while (usedBytes + bytes > maxBytes && !lru.empty()) {
+        erase(entries.find(lru.back()));
+    }
+
+    lru.push_front(key);
+    Entry &entry = entries[key];
+    entry.result = result.getOwned();
+    entry.expires = monotonic_time() + ttl;
+    entry.bytes = bytes;
+    entry.lru = lru.begin();
+    usedBytes += bytes;
+}
+
+void QueryCache::invalidate(const std::string &ns) {
+    std::string prefix(ns);
+    prefix.push_back('\0');
+
+    EntryMap::iterator it = entries.lower_bound(prefix);
+    while (it != entries.end() && it->first.compare(0, prefix.size(), prefix) == 0) {
+        erase(it++);
+    }
+}
+
+boost::shared_ptr<bool> QueryCache::hold(const std::string &ns) {
+    std::multimap<std::string, boost::weak_ptr<bool> >::iterator it = holds.begin();
+    while (it != holds.end()) {
+        if (it->second.expired()) {
+            holds.erase(it++);
+        } else {
+            ++it;
+        }
+    }
+    boost::shared_ptr<bool> token(new bool(true));
+    holds.insert(std::make_pair(ns, boost::weak_ptr<bool>(token)));
+    return token;
+}
+
+bool QueryCache::held(const std::string &ns) {
+    std::multimap<std::string, boost::weak_ptr<bool> >::iterator it = holds.lower_bound(ns);
+    while (it != holds.end() && it->first == ns) {
+        if (!it->second.expired()) return true;
+        holds.erase(it++);
+    }
+    return false;
+}
+
+void QueryCache::clear() {
+    entries.clear();
+    lru.clear();
+    usedBytes = 0;
+}
+
+void QueryCache::erase(EntryMap::iterator it) {
+    usedBytes -= it->second.bytes;
+    lru.erase(it->second.lru);
+    entries.erase(it);
+}
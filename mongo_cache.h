@@ -0,0 +1,60 @@
+#ifndef LUAMONGO_CACHE_H
+#define LUAMONGO_CACHE_H
+
+#include <client/dbclient.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <list>
+#include <map>
+#include <string>
+
+/*
+ * LRU cache of find_one results of a DBClient, stored as raw BSON. Keys begin
+ * with the namespace, so all the entries of a namespace are contiguous and
+ * can be dropped at once when it is written.
+ */
+class QueryCache {
+public:
+    QueryCache(size_t maxBytes, double ttl);
+
+    static std::string key(const std::string &ns, const mongo::BSONObj &query,
+                           const mongo::BSONObj *fields, int options);
+
+    // an empty result means no document matched
+    bool get(const std::string &key, mongo::BSONObj &result);
+    void put(const std::string &key, const mongo::BSONObj &result);
+    void invalidate(const std::string &ns);
+    void clear();
+    // a write to ns runs in another thread: results of ns are not cached
+    // until the returned token is released, once the write is done
+    boost::shared_ptr<bool> hold(const std::string &ns);
+    bool held(const std::string &ns);
+    // takes over the holds of the cache it replaces
+    void adopt_holds(const QueryCache &other) { holds = other.holds; }
+
+    size_t hits;
+    size_t misses;
+    size_t size() const { return entries.size(); }
+    size_t bytes() const { return usedBytes; }
+
+private:
+    struct Entry {
+        mongo::BSONObj result;
+        double expires;
+        size_t bytes;
+        std::list<std::string>::iterator lru;
+    };
+    typedef std::map<std::string, Entry> EntryMap;
+
+    EntryMap entries;
+    // most recently used first
+    std::list<std::string> lru;
+    size_t maxBytes;
+    size_t usedBytes;
+    double ttl;
+    std::multimap<std::string, boost::weak_ptr<bool> > holds;
+
+    void erase(EntryMap::iterator it);
+};
+
+#endif
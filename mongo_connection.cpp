@@ -1,16 +1,22 @@
 #include <client/dbclient.h>
 #include "utils.h"
 #include "common.h"
+#include "mongo_dbclient.h"
+#include "mongo_breaker.h"
+#include "mongo_wire.h"
 
 using namespace mongo;
 
 extern const luaL_Reg dbclient_methods[];
+extern bool lua_to_write_concern(lua_State *L, int index, WriteConcern &wc);
+extern double monotonic_time();
 
 namespace {
 inline DBClientConnection* userdata_to_connection(lua_State* L, int index) {
-    void *ud = luaL_checkudata(L, index, LUAMONGO_CONNECTION);
-    DBClientConnection *connection = *((DBClientConnection **)ud);
-    return connection;
+    LuaDBClient *db = (LuaDBClient *)luaL_checkudata(L, index, LUAMONGO_CONNECTION);
+    if (!db->client)
+        luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_CONNECTION);
+    return db->connection;
 }
 
 } // anonymous namespace
@@ -20,6 +26,20 @@ inline DBClientConnection* userdata_to_connection(lua_State* L, int index) {
  *    accepts an optional table of features:
  *       auto_reconnect   (default = false)
  *       rw_timeout       (default = 0) (mongo >= v1.5)
+ *       write_concern    (default = {w=1}) {w=n|"majority", j=bool, wtimeout=ms}
+ *       breaker          (default = false) true or {failures=5,
+ *                        cooldown_ms=10000, backoff_ms=100,
+ *                        max_backoff_ms=10000, jitter=0.5}
+ *          replaces auto_reconnect: a failed connection is connected again
+ *          before the next call, after a delay doubled at every failure and
+ *          shortened by a random part (jitter); calls in that delay fail at
+ *          once. After `failures` consecutive failures calls fail at once for
+ *          cooldown_ms, then one call tries again. See db:health().
+ *       compressors      (default = none) {"zlib", "noop"}
+ *       compression_level (default = -1, the zlib default)
+ *          compressors offered to the server when connecting, the first one
+ *          it accepts compresses the messages of pipelines and multiplexers.
+ *          See db:compression_stats().
  */
 static int connection_new(lua_State *L) {
     int resultcount = 1;
@@ -27,27 +47,77 @@ static int connection_new(lua_State *L) {
     try {
         bool auto_reconnect;
         double rw_timeout=0;
+        WriteConcern wc;
+        bool has_wc = false;
+        bool has_breaker = false;
+        BreakerOptions bopts;
+        std::auto_ptr<WireCompression> compression;
         if (lua_type(L,1) == LUA_TTABLE) {
             // extract arguments from table
             lua_getfield(L, 1, "auto_reconnect");
             auto_reconnect = lua_toboolean(L, -1);
             lua_getfield(L, 1, "rw_timeout");
             rw_timeout = luaL_optnumber(L, -1, 0);
-            lua_pop(L, 2);
+            lua_getfield(L, 1, "write_concern");
+            has_wc = lua_to_write_concern(L, lua_gettop(L), wc);
+            lua_pop(L, 3);
+
+            lua_getfield(L, 1, "breaker");
+            has_breaker = lua_toboolean(L, -1);
+            if (lua_type(L, -1) == LUA_TTABLE) {
+                lua_getfield(L, -1, "failures");
+                bopts.threshold = luaL_optint(L, -1, bopts.threshold);
+                lua_getfield(L, -2, "cooldown_ms");
+                bopts.cooldown = luaL_optnumber(L, -1, bopts.cooldown * 1000) / 1000;
+                lua_getfield(L, -3, "backoff_ms");
+                bopts.backoff = luaL_optnumber(L, -1, bopts.backoff * 1000) / 1000;
+                lua_getfield(L, -4, "max_backoff_ms");
+                bopts.maxBackoff = luaL_optnumber(L, -1, bopts.maxBackoff * 1000) / 1000;
+                lua_getfield(L, -5, "jitter");
+                bopts.jitter = luaL_optnumber(L, -1, bopts.jitter);
+                lua_pop(L, 5);
+            }
+            lua_pop(L, 1);
+
+            lua_getfield(L, 1, "compressors");
+            if (lua_type(L, -1) == LUA_TTABLE) {
+                compression.reset(new WireCompression());
+                for (size_t i = 1; i <= lua_rawlen(L, -1); ++i) {
+                    lua_rawgeti(L, -1, i);
+                    const char *name = lua_tostring(L, -1);
+                    if (!name || wire_compressor_id(name) < 0)
+                        throw std::runtime_error(std::string("unsupported compressor ") +
+                                                 (name ? name : "?"));
+                    compression->offered.push_back(name);
+                    lua_pop(L, 1);
+                }
+                lua_getfield(L, 1, "compression_level");
+                compression->level = luaL_optint(L, -1, -1);
+                lua_pop(L, 1);
+            }
+            lua_pop(L, 1);
         } else {
             auto_reconnect = false;
             rw_timeout = 0;
         }
 
-        DBClientConnection **connection = (DBClientConnection **)lua_newuserdata(L, sizeof(DBClientConnection *));
-        *connection = new DBClientConnection(auto_reconnect, 0, rw_timeout);
-
-        luaL_getmetatable(L, LUAMONGO_CONNECTION);
-        lua_setmetatable(L, -2);
+        // the breaker decides when to connect again
+        DBClientConnection *connection = new DBClientConnection(auto_reconnect && !has_breaker,
+                                                                0, rw_timeout);
+        if (has_wc)
+            connection->setWriteConcern(wc);
+        LuaDBClient *db = dbclient_push(L, connection, connection, LUAMONGO_CONNECTION);
+        if (has_breaker)
+            db->breaker = new CircuitBreaker(bopts);
+        db->compression = compression.release();
     } catch (std::exception &e) {
         lua_pushnil(L);
         lua_pushfstring(L, LUAMONGO_ERR_CONNECTION_FAILED, e.what());
         resultcount = 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CONNECTION_FAILED, err);
+        resultcount = 2;
     }
 
     return resultcount;
@@ -60,14 +130,31 @@ static int connection_new(lua_State *L) {
 static int connection_connect(lua_State *L) {
     DBClientConnection *connection = userdata_to_connection(L, 1);
     const char *connectstr = luaL_checkstring(L, 2);
+    LuaDBClient *db = (LuaDBClient *)lua_touserdata(L, 1);
+    CircuitBreaker *breaker = db->breaker;
 
     try {
+        if (breaker)
+            breaker->server = connectstr;
         connection->connect(connectstr);
     } catch (std::exception &e) {
+        // later calls connect again, as after a lost connection
+        if (breaker)
+            breaker->failure(monotonic_time(), e.what());
         lua_pushnil(L);
         lua_pushfstring(L, LUAMONGO_ERR_CONNECT_FAILED, connectstr, e.what());
         return 2;
     }
+    if (breaker)
+        breaker->success(monotonic_time());
+    if (db->compression) {
+        try {
+            wire_negotiate(connection, *db->compression);
+        } catch (std::exception &) {
+            // messages go uncompressed
+            db->compression->compressor = -1;
+        }
+    }
 
     lua_pushboolean(L, 1);
     return 1;
@@ -75,11 +162,11 @@ static int connection_connect(lua_State *L) {
 
 
 /*
- * __gc
+ * __gc, __close
  */
 static int connection_gc(lua_State *L) {
-    DBClientConnection *connection = userdata_to_connection(L, 1);
-    delete connection;
+    LuaDBClient *db = (LuaDBClient *)luaL_checkudata(L, 1, LUAMONGO_CONNECTION);
+    dbclient_release(db);
     return 0;
 }
 
@@ -87,6 +174,11 @@ static int connection_gc(lua_State *L) {
  * __tostring
  */
 static int connection_tostring(lua_State *L) {
+    LuaDBClient *db = (LuaDBClient *)luaL_checkudata(L, 1, LUAMONGO_CONNECTION);
+    if (!db->client) {
+        lua_pushfstring(L, "%s: closed", LUAMONGO_CONNECTION);
+        return 1;
+    }
     DBClientConnection *connection = userdata_to_connection(L, 1);
     lua_pushfstring(L, "%s: %s", LUAMONGO_CONNECTION,  connection->toString().c_str());
     return 1;
@@ -107,6 +199,7 @@ int mongo_connection_register(lua_State *L) {
     luaL_newmetatable(L, LUAMONGO_CONNECTION);
     //luaL_register(L, NULL, dbclient_methods);
     luaL_setfuncs(L, dbclient_methods, 0);
+    dbclient_admit_methods(L, dbclient_methods);
     //luaL_register(L, NULL, connection_methods);
     luaL_setfuncs(L, connection_methods, 0);
     lua_pushvalue(L,-1);
@@ -115,6 +208,11 @@ int mongo_connection_register(lua_State *L) {
     lua_pushcfunction(L, connection_gc);
     lua_setfield(L, -2, "__gc");
 
+#if LUA_VERSION_NUM >= 504
+    lua_pushcfunction(L, connection_gc);
+    lua_setfield(L, -2, "__close");
+#endif
+
     lua_pushcfunction(L, connection_tostring);
     lua_setfield(L, -2, "__tostring");
     
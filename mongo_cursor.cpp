@@ -1,27 +1,191 @@
 #include <iostream>
 #include <client/dbclient.h>
+#include <functional>
+#include <limits.h>
+#include <map>
+#include <queue>
+#include <string>
+#include <vector>
 #include "utils.h"
 #include "common.h"
+#include "mongo_dbclient.h"
 
 using namespace mongo;
 
 extern void bson_to_lua(lua_State *L, const BSONObj &obj);
 
 namespace {
+/*
+ * Cursor userdata. When max_batch_bytes > 0 the batch size of every getMore
+ * is derived from the average size of the documents seen so far, so a batch
+ * buffered in C++ stays close to max_batch_bytes. The next batch is only
+ * requested once the consumer drained the current one. No size is known
+ * before the first batch, which is bounded by its document count only.
+ */
+struct LuaCursor {
+    DBClientCursor *cursor;
+    // DBClient which created the cursor, NULL if it isn't a Lua object
+    LuaDBClient *owner;
+    int max_batch_bytes;
+    double avg_obj_size;
+};
+
+// initial batch size of adaptive cursors, before any document size is known
+const int ADAPTIVE_FIRST_BATCH = 16;
+// weight of the last document in the average document size
+const double ADAPTIVE_SIZE_WEIGHT = 0.125;
+
+inline LuaCursor* userdata_to_luacursor(lua_State* L, int index) {
+    LuaCursor *c = (LuaCursor *)luaL_checkudata(L, index, LUAMONGO_CURSOR);
+    if (!c->cursor)
+        luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_CURSOR);
+    if (c->owner && !c->owner->client)
+        luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_DBCLIENT);
+    if (c->owner && c->owner->multiplexed > 0)
+        luaL_error(L, LUAMONGO_ERR_MULTIPLEXED);
+    return c;
+}
+
 inline DBClientCursor* userdata_to_cursor(lua_State* L, int index) {
-    void *ud = luaL_checkudata(L, index, LUAMONGO_CURSOR);
-    DBClientCursor *cursor = *((DBClientCursor **)ud);
-    return cursor;
+    return userdata_to_luacursor(L, index)->cursor;
+}
+
+/*
+ * DBClientCursor::more() replacement, sets the size of the next batch before
+ * the driver requests it
+ */
+bool cursor_more(LuaCursor *c) {
+    if (c->max_batch_bytes > 0 && c->avg_obj_size > 0 &&
+        !c->cursor->moreInCurrentBatch()) {
+        double batch = c->max_batch_bytes / c->avg_obj_size;
+        c->cursor->setBatchSize(batch < 1.0 ? 1 : (batch > INT_MAX ? INT_MAX : (int)batch));
+    }
+    return c->cursor->more();
+}
+
+/*
+ * DBClientCursor::next() replacement, keeps track of document sizes
+ */
+BSONObj cursor_next_obj(LuaCursor *c) {
+    BSONObj obj = c->cursor->next();
+    if (c->max_batch_bytes > 0) {
+        if (c->avg_obj_size > 0) {
+            c->avg_obj_size += ADAPTIVE_SIZE_WEIGHT * (obj.objsize() - c->avg_obj_size);
+        } else {
+            c->avg_obj_size = obj.objsize();
+        }
+    }
+    return obj;
+}
+
+/*
+ * Orders group keys of cursor:aggregate(), ignoring field names as they
+ * are always the group_by list.
+ */
+struct GroupKeyLess {
+    bool operator()(const BSONObj &a, const BSONObj &b) const {
+        return a.woCompare(b, BSONObj(), false) < 0;
+    }
+};
+
+/*
+ * Accumulated state of one group in cursor:aggregate(), only the fields
+ * listed in the spec are read from every document.
+ */
+struct AggregateGroup {
+    long long count;
+    std::vector<double> sums;
+    std::vector<BSONObj> mins;
+    std::vector<BSONObj> maxs;
+    std::priority_queue<double, std::vector<double>, std::greater<double> > top;
+
+    AggregateGroup() : count(0) { }
+};
+
+/*
+ * Reads spec[key] as a field name or an array of field names.
+ */
+void read_field_list(lua_State *L, int spec, const char *key,
+                     std::vector<std::string> &fields) {
+    lua_getfield(L, spec, key);
+    if (lua_type(L, -1) == LUA_TSTRING) {
+        fields.push_back(lua_tostring(L, -1));
+    } else if (lua_type(L, -1) == LUA_TTABLE) {
+        size_t len = lua_rawlen(L, -1);
+        for (size_t i = 1; i <= len; ++i) {
+            lua_rawgeti(L, -1, i);
+            const char *field = lua_tostring(L, -1);
+            if (field) fields.push_back(field);
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 1);
+}
+
+// keeps in holder a copy of elem if it is lower (sign=-1) or greater (sign=1)
+inline void keep_extreme(BSONObj &holder, const BSONElement &elem, int sign) {
+    if (holder.isEmpty() || sign*elem.woCompare(holder.firstElement(), false) > 0) {
+        holder = elem.wrap();
+    }
+}
+
+void append_extremes(BSONObjBuilder &builder, const char *name,
+                     const std::vector<std::string> &fields,
+                     const std::vector<BSONObj> &values) {
+    BSONObjBuilder sub(builder.subobjStart(name));
+    for (size_t i = 0; i < fields.size(); ++i) {
+        if (values[i].isEmpty()) {
+            sub.appendNull(fields[i]);
+        } else {
+            sub.appendAs(values[i].firstElement(), fields[i]);
+        }
+    }
+    sub.done();
 }
 } // anonymous namespace
 
+/*
+ * pushes a new Cursor userdata owning cursor, owner is the stack index of
+ * the DBClient userdata which created it or 0
+ */
+int cursor_push(lua_State *L, DBClientCursor *cursor, int owner, int maxBatchBytes) {
+    if (owner < 0) owner = lua_gettop(L) + owner + 1;
+
+    LuaCursor *c = (LuaCursor *)lua_newuserdata(L, sizeof(LuaCursor));
+    c->cursor = cursor;
+    c->owner = NULL;
+    c->max_batch_bytes = maxBatchBytes;
+    c->avg_obj_size = 0;
+
+    luaL_getmetatable(L, LUAMONGO_CURSOR);
+    lua_setmetatable(L, -2);
+
+    if (owner) {
+        c->owner = userdata_to_luadbclient(L, owner);
+        lua_set_owner(L, -1, owner);
+    }
+
+    return 1;
+}
+
 /*
  * cursor,err = db:query(ns, query)
+ *    owner is the stack index of the DBClient userdata
+ *    maxBatchBytes > 0 enables adaptive batch sizing (batchSize is then only
+ *    used for the first batch)
  */
-int cursor_create(lua_State *L, DBClientBase *connection, const char *ns,
+int cursor_create(lua_State *L, int owner, const char *ns,
                   const Query &query, int nToReturn, int nToSkip,
-                  const BSONObj *fieldsToReturn, int queryOptions, int batchSize) {
+                  const BSONObj *fieldsToReturn, int queryOptions, int batchSize,
+                  int maxBatchBytes) {
     int resultcount = 1;
+    // raises an error when the DBClient is closed
+    userdata_to_dbclient(L, owner);
+    DBClientBase *connection = dbclient_route(userdata_to_luadbclient(L, owner), query);
+
+    if (maxBatchBytes > 0 && batchSize == 0) {
+        batchSize = ADAPTIVE_FIRST_BATCH;
+    }
 
     try {
         std::auto_ptr<DBClientCursor> autocursor = connection->query(
@@ -34,12 +198,9 @@ int cursor_create(lua_State *L, DBClientBase *connection, const char *ns,
             return 2;
         }
 
-        DBClientCursor **cursor = (DBClientCursor **)lua_newuserdata(L, sizeof(DBClientCursor *));
-        *cursor = autocursor.get();
-        autocursor.release();
-
-        luaL_getmetatable(L, LUAMONGO_CURSOR);
-        lua_setmetatable(L, -2);
+        DBClientCursor *cursor = autocursor.release();
+        cursor_push(L, cursor, owner, maxBatchBytes);
+        dbclient_track_cursor(userdata_to_luadbclient(L, owner), cursor, connection);
     } catch (std::exception &e) {
         lua_pushnil(L);
         lua_pushfstring(L, LUAMONGO_ERR_QUERY_FAILED, e.what());
@@ -53,10 +214,10 @@ int cursor_create(lua_State *L, DBClientBase *connection, const char *ns,
  * res = cursor:next()
  */
 static int cursor_next(lua_State *L) {
-    DBClientCursor *cursor = userdata_to_cursor(L, 1);
+    LuaCursor *cursor = userdata_to_luacursor(L, 1);
 
-    if (cursor->more()) {
-        bson_to_lua(L, cursor->next());
+    if (cursor_more(cursor)) {
+        bson_to_lua(L, cursor_next_obj(cursor));
     } else {
         lua_pushnil(L);
     }
@@ -65,10 +226,10 @@ static int cursor_next(lua_State *L) {
 }
 
 static int result_iterator(lua_State *L) {
-    DBClientCursor *cursor = userdata_to_cursor(L, lua_upvalueindex(1));
+    LuaCursor *cursor = userdata_to_luacursor(L, lua_upvalueindex(1));
 
-    if (cursor->more()) {
-        bson_to_lua(L, cursor->next());
+    if (cursor_more(cursor)) {
+        bson_to_lua(L, cursor_next_obj(cursor));
     } else {
         lua_pushnil(L);
     }
@@ -89,13 +250,13 @@ static int cursor_results(lua_State *L) {
  *    pass true to call moreInCurrentBatch (mongo >=1.5)
  */
 static int cursor_has_more(lua_State *L) {
-    DBClientCursor *cursor = userdata_to_cursor(L, 1);
+    LuaCursor *cursor = userdata_to_luacursor(L, 1);
 
     bool in_current_batch = lua_toboolean(L, 2);
     if (in_current_batch)
-        lua_pushboolean(L, cursor->moreInCurrentBatch());
+        lua_pushboolean(L, cursor->cursor->moreInCurrentBatch());
     else
-        lua_pushboolean(L, cursor->more());
+        lua_pushboolean(L, cursor_more(cursor));
 
     return 1;
 }
@@ -104,8 +265,14 @@ static int cursor_has_more(lua_State *L) {
  * it_count = cursor:itcount()
  */
 static int cursor_itcount(lua_State *L) {
-    DBClientCursor *cursor = userdata_to_cursor(L, 1);
-    lua_pushinteger(L, cursor->itcount());
+    LuaCursor *cursor = userdata_to_luacursor(L, 1);
+    // not DBClientCursor::itcount(), which would skip the adaptive batch size
+    lua_Integer n = 0;
+    while (cursor_more(cursor)) {
+        cursor_next_obj(cursor);
+        ++n;
+    }
+    lua_pushinteger(L, n);
     return 1;
 }
 
@@ -145,12 +312,176 @@ static int cursor_get_id(lua_State *L) {
     lua_pushnumber(L, cursor->getCursorId());
     return 1;
 }
+/*
+ * groups,err = cursor:aggregate{group_by={field1,...}, count=true, sum={field1,...},
+ *                               min={field1,...}, max={field1,...},
+ *                               top_k={field=field, k=number}}
+ *    consumes the remaining documents of the cursor, reading only the listed
+ *    fields, and returns an array with one table per group:
+ *       {_id={group_by values}, count=n, sum={...}, min={...}, max={...},
+ *        top_k={greatest values first}}
+ */
+static int cursor_aggregate(lua_State *L) {
+    LuaCursor *cursor = userdata_to_luacursor(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+
+    try {
+        std::vector<std::string> group_by, sum, min, max;
+        read_field_list(L, 2, "group_by", group_by);
+        read_field_list(L, 2, "sum", sum);
+        read_field_list(L, 2, "min", min);
+        read_field_list(L, 2, "max", max);
+
+        lua_getfield(L, 2, "count");
+        bool count = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        std::string top_field;
+        size_t top_k = 0;
+        lua_getfield(L, 2, "top_k");
+        if (lua_type(L, -1) == LUA_TTABLE) {
+            lua_getfield(L, -1, "field");
+            lua_getfield(L, -2, "k");
+            if (!lua_isstring(L, -2) || lua_tointeger(L, -1) <= 0) {
+                lua_pop(L, 3);
+                throw("top_k requires a field name and k > 0");
+            }
+            top_field = lua_tostring(L, -2);
+            top_k = lua_tointeger(L, -1);
+            lua_pop(L, 2);
+        }
+        lua_pop(L, 1);
+
+        typedef std::map<BSONObj, AggregateGroup, GroupKeyLess> GroupMap;
+        GroupMap groups;
+
+        while (cursor_more(cursor)) {
+            BSONObj obj = cursor_next_obj(cursor);
+
+            BSONObjBuilder key_builder;
+            for (size_t i = 0; i < group_by.size(); ++i) {
+                BSONElement elem = obj.getFieldDotted(group_by[i]);
+                if (elem.eoo()) {
+                    key_builder.appendNull(group_by[i]);
+                } else {
+                    key_builder.appendAs(elem, group_by[i]);
+                }
+            }
+
+            AggregateGroup &group = groups[key_builder.obj()];
+            if (group.count == 0) {
+                group.sums.resize(sum.size(), 0.0);
+                group.mins.resize(min.size());
+                group.maxs.resize(max.size());
+            }
+            ++group.count;
+
+            for (size_t i = 0; i < sum.size(); ++i) {
+                BSONElement elem = obj.getFieldDotted(sum[i]);
+                if (elem.isNumber()) group.sums[i] += elem.number();
+            }
+            for (size_t i = 0; i < min.size(); ++i) {
+                BSONElement elem = obj.getFieldDotted(min[i]);
+                if (!elem.eoo()) keep_extreme(group.mins[i], elem, -1);
+            }
+            for (size_t i = 0; i < max.size(); ++i) {
+                BSONElement elem = obj.getFieldDotted(max[i]);
+                if (!elem.eoo()) keep_extreme(group.maxs[i], elem, 1);
+            }
+            if (top_k > 0) {
+                BSONElement elem = obj.getFieldDotted(top_field);
+                if (elem.isNumber()) {
+                    if (group.top.size() < top_k) {
+                        group.top.push(elem.number());
+                    } else if (elem.number() > group.top.top()) {
+                        group.top.pop();
+                        group.top.push(elem.number());
+                    }
+                }
+            }
+        }
+
+        lua_newtable(L);
+        int n = 1;
+        for (GroupMap::iterator it = groups.begin(); it != groups.end(); ++it, ++n) {
+            AggregateGroup &group = it->second;
+            BSONObjBuilder builder;
+            builder.append("_id", it->first);
+            if (count) {
+                builder.append("count", group.count);
+            }
+            if (!sum.empty()) {
+                BSONObjBuilder sub(builder.subobjStart("sum"));
+                for (size_t i = 0; i < sum.size(); ++i) {
+                    sub.append(sum[i], group.sums[i]);
+                }
+                sub.done();
+            }
+            if (!min.empty()) append_extremes(builder, "min", min, group.mins);
+            if (!max.empty()) append_extremes(builder, "max", max, group.maxs);
+            if (top_k > 0) {
+                std::vector<double> values;
+                for (; !group.top.empty(); group.top.pop()) {
+                    values.push_back(group.top.top());
+                }
+                BSONArrayBuilder sub(builder.subarrayStart("top_k"));
+                for (size_t i = values.size(); i > 0; --i) {
+                    sub.append(values[i-1]);
+                }
+                sub.done();
+            }
+            bson_to_lua(L, builder.obj());
+            lua_rawseti(L, -2, n);
+        }
+        return 1;
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CURSOR, "aggregate", e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CURSOR, "aggregate", err);
+        return 2;
+    }
+}
+
+/*
+ * cursor:close()
+ *    kills the server-side cursor right away
+ * __close
+ */
+static int cursor_close(lua_State *L) {
+    LuaCursor *cursor = (LuaCursor *)luaL_checkudata(L, 1, LUAMONGO_CURSOR);
+    if (cursor->cursor) {
+        if (cursor->owner && !cursor->owner->client) {
+            // the DBClient is closed, the cursor can't talk to it anymore
+            cursor->cursor->decouple();
+        }
+        if (cursor->owner) {
+            dbclient_delete_cursor(cursor->owner, cursor->cursor);
+        } else {
+            delete cursor->cursor;
+        }
+        cursor->cursor = NULL;
+    }
+    return 0;
+}
+
 /*
  * __gc
  */
 static int cursor_gc(lua_State *L) {
-    DBClientCursor *cursor = userdata_to_cursor(L, 1);
-    delete cursor;
+    LuaCursor *cursor = (LuaCursor *)luaL_checkudata(L, 1, LUAMONGO_CURSOR);
+    if (!cursor->cursor) {
+        return 0;
+    }
+    if (cursor->owner) {
+        // killed by the owner out of the garbage collector
+        dbclient_defer_cursor(cursor->owner, cursor->cursor);
+    } else {
+        delete cursor->cursor;
+    }
+    cursor->cursor = NULL;
     return 0;
 }
 
@@ -158,7 +489,7 @@ static int cursor_gc(lua_State *L) {
  * __tostring
  */
 static int cursor_tostring(lua_State *L) {
-    DBClientCursor *cursor = userdata_to_cursor(L, 1);
+    DBClientCursor *cursor = ((LuaCursor *)luaL_checkudata(L, 1, LUAMONGO_CURSOR))->cursor;
     lua_pushfstring(L, "%s: %p", LUAMONGO_CURSOR, cursor);
     return 1;
 }
@@ -173,6 +504,8 @@ int mongo_cursor_register(lua_State *L) {
         {"is_tailable", cursor_is_tailable},
         {"has_result_flag", cursor_has_result_flag},
         {"get_id", cursor_get_id},
+        {"aggregate", cursor_aggregate},
+        {"close", cursor_close},
         {NULL, NULL}
     };
 
@@ -189,6 +522,11 @@ int mongo_cursor_register(lua_State *L) {
     lua_pushcfunction(L, cursor_gc);
     lua_setfield(L, -2, "__gc");
 
+#if LUA_VERSION_NUM >= 504
+    lua_pushcfunction(L, cursor_close);
+    lua_setfield(L, -2, "__close");
+#endif
+
     lua_pushcfunction(L, cursor_tostring);
     lua_setfield(L, -2, "__tostring");
     
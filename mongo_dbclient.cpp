@@ -1,25 +1,85 @@
 #include <client/dbclient.h>
 #include <string>
 #include <list>
+#include <map>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include "utils.h"
 #include "common.h"
+#include "mongo_dbclient.h"
+#include "mongo_cache.h"
+#include "mongo_bulk.h"
+#include "mongo_pool.h"
+#include "mongo_topology.h"
+#include "mongo_breaker.h"
+#include "mongo_wire.h"
 
 using namespace mongo;
 
-extern int cursor_create(lua_State *L, DBClientBase *connection, const char *ns,
+extern int cursor_create(lua_State *L, int owner, const char *ns,
                          const Query &query, int nToReturn, int nToSkip,
-                         const BSONObj *fieldsToReturn, int queryOptions, int batchSize);
+                         const BSONObj *fieldsToReturn, int queryOptions, int batchSize,
+                         int maxBatchBytes);
+extern int cursor_push(lua_State *L, DBClientCursor *cursor, int owner, int maxBatchBytes);
+extern int bulk_create(lua_State *L, int owner, const char *ns, bool ordered);
+extern int insert_buffer_create(lua_State *L, int owner, const char *ns, bool ordered,
+                                size_t maxDocs, size_t maxBytes, double maxDelay);
+extern int pipeline_create(lua_State *L, int owner);
+extern int async_create(lua_State *L, int owner, int nthreads, double timeout);
+extern int multiplexer_create(lua_State *L, int owner);
+extern int prepared_create(lua_State *L, int owner, const std::string &dbname, const BSONObj &command,
+                           const std::vector<std::string> &names, int options,
+                           const std::string &written, const std::string &result);
 
 extern void lua_to_bson(lua_State *L, int stackpos, BSONObj &obj);
 extern void bson_to_lua(lua_State *L, const BSONObj &obj);
 extern void lua_push_value(lua_State *L, const BSONElement &elem);
+extern void lua_append_value(lua_State *L, const char *key, int stackpos, BSONObjBuilder &builder);
 
 extern bool lua_to_bson_ordered(lua_State *L, int index, BSONObj &object);
 extern bool lua_to_bson_ordered_query(lua_State *L, int index, Query &query);
 extern bool lua_to_bson_batched(lua_State *L, int index, std::vector<BSONObj> &objects);
+extern bool lua_to_write_concern(lua_State *L, int index, WriteConcern &wc);
+extern bool lua_to_read_pref(lua_State *L, int index, BSONObj &pref);
+extern void query_set_read_pref(Query &query, const BSONObj &pref);
+extern double monotonic_time();
 
 
-DBClientBase* userdata_to_dbclient(lua_State *L, int stackpos)
+/*
+ * pushes a new userdata of class tname (Connection or ReplicaSet) owning client
+ */
+LuaDBClient* dbclient_push(lua_State *L, DBClientBase *client,
+                           DBClientConnection *connection, const char *tname)
+{
+  LuaDBClient *db = (LuaDBClient *)lua_newuserdata(L, sizeof(LuaDBClient));
+  db->client = client;
+  db->connection = connection;
+  db->dead_cursors = new std::vector<DBClientCursor*>();
+  db->cache = NULL;
+  db->credentials = new std::vector<LuaCredential>();
+  db->read_pref = NULL;
+  db->pool = NULL;
+  db->topology = NULL;
+  db->breaker = NULL;
+  db->compression = NULL;
+  db->multiplexed = 0;
+
+  luaL_getmetatable(L, tname);
+  lua_setmetatable(L, -2);
+  return db;
+}
+
+LuaDBClient* userdata_to_luadbclient(lua_State *L, int stackpos)
 {
   // adapted from http://www.lua.org/source/5.1/lauxlib.c.html#luaL_checkudata
   void *ud = lua_touserdata(L, stackpos);
@@ -32,9 +92,8 @@ DBClientBase* userdata_to_dbclient(lua_State *L, int stackpos)
     {
       if (lua_rawequal(L, -1, -2))
         {
-          DBClientConnection *connection = *((DBClientConnection **)ud);
           lua_pop(L, 2);
-          return connection;
+          return (LuaDBClient *)ud;
         }
       lua_pop(L, 2);
     }
@@ -47,9 +106,8 @@ DBClientBase* userdata_to_dbclient(lua_State *L, int stackpos)
     {
       if (lua_rawequal(L, -1, -2))
         {
-          DBClientReplicaSet *replicaset = *((DBClientReplicaSet **)ud);
           lua_pop(L, 2); // remove both metatables
-          return replicaset;
+          return (LuaDBClient *)ud;
         }
       lua_pop(L, 2);
     }
@@ -60,6 +118,277 @@ DBClientBase* userdata_to_dbclient(lua_State *L, int stackpos)
   return NULL; // should never get here
 }
 
+/*
+ * connects again the Connection of db to the server of its breaker and
+ * replays db:auth(), the breaker records the outcome
+ */
+bool dbclient_reconnect(LuaDBClient *db, std::string &error)
+{
+  CircuitBreaker *breaker = db->breaker;
+  try {
+    if (!db->connection->connect(HostAndPort(breaker->server), error))
+      throw std::runtime_error(error);
+    for (size_t i = 0; i < db->credentials->size(); ++i) {
+      const LuaCredential &c = (*db->credentials)[i];
+      if (!db->connection->auth(c.dbname, c.username, c.password, error, c.digestPassword))
+        throw std::runtime_error(error);
+    }
+    if (db->compression)
+      wire_negotiate(db->connection, *db->compression);
+  } catch (std::exception &e) {
+    error = e.what();
+    if (error.empty()) error = "unknown error";
+    breaker->failure(monotonic_time(), error);
+    return false;
+  }
+  breaker->success(monotonic_time());
+  return true;
+}
+
+/*
+ * A failed Connection with a breaker is connected again before the next
+ * call, unless the breaker rejects the attempt. Pushes the error message
+ * and returns false when the call can't go through.
+ */
+static bool dbclient_admit(lua_State *L, LuaDBClient *db)
+{
+  CircuitBreaker *breaker = db->breaker;
+  double now = monotonic_time();
+  if (!breaker->allow(now)) {
+    lua_pushfstring(L, LUAMONGO_ERR_UNAVAILABLE, breaker->server.c_str(),
+                    CircuitBreaker::state_name(breaker->state),
+                    (int)(breaker->wait(now) * 1000), breaker->lastError.c_str());
+    return false;
+  }
+  std::string error;
+  if (!dbclient_reconnect(db, error)) {
+    lua_pushfstring(L, LUAMONGO_ERR_CONNECT_FAILED, breaker->server.c_str(), error.c_str());
+    return false;
+  }
+  return true;
+}
+
+/*
+ * returns the DBClient at stackpos, first killing the cursors left by the
+ * garbage collector
+ */
+DBClientBase* userdata_to_dbclient(lua_State *L, int stackpos)
+{
+  LuaDBClient *db = userdata_to_luadbclient(L, stackpos);
+  if (!db->client)
+    luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_DBCLIENT);
+  dbclient_flush_cursors(db);
+  return db->client;
+}
+
+/*
+ * the next reply on the socket of db belongs to a Multiplexer, a call
+ * would read it as its own
+ */
+void dbclient_check_multiplexed(LuaDBClient *db)
+{
+  if (db->multiplexed > 0)
+    throw std::runtime_error(LUAMONGO_ERR_MULTIPLEXED);
+}
+
+/*
+ * runs the method in the first upvalue, unless the Connection failed and
+ * its breaker rejects the call or fails to connect again, or requests of a
+ * Multiplexer are in flight: the method then returns nil and the error,
+ * before it allocated anything
+ */
+static int dbclient_admitted(lua_State *L)
+{
+  LuaDBClient *db = userdata_to_luadbclient(L, 1);
+  if (db->multiplexed > 0) {
+    lua_pushnil(L);
+    lua_pushliteral(L, LUAMONGO_ERR_MULTIPLEXED);
+    return 2;
+  }
+  if (db->client && db->breaker && !db->breaker->server.empty() &&
+      db->connection->isFailed() && !dbclient_admit(L, db)) {
+    lua_pushnil(L);
+    lua_insert(L, -2);
+    return 2;
+  }
+  lua_pushvalue(L, lua_upvalueindex(1));
+  lua_insert(L, 1);
+  lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+  return lua_gettop(L);
+}
+
+/*
+ * wraps the methods of the metatable on top of the stack which talk to the
+ * server with dbclient_admitted(), for Connections with a breaker
+ */
+void dbclient_admit_methods(lua_State *L, const luaL_Reg *methods)
+{
+  // these only look at the LuaDBClient
+  static const char *const local[] = {
+    "cache_stats", "close", "compression_stats", "health", "is_failed", NULL
+  };
+  for (; methods->name; ++methods) {
+    bool skip = false;
+    for (int i = 0; local[i]; ++i)
+      skip = skip || strcmp(methods->name, local[i]) == 0;
+    if (skip)
+      continue;
+    lua_pushcfunction(L, methods->func);
+    lua_pushcclosure(L, dbclient_admitted, 1);
+    lua_setfield(L, -2, methods->name);
+  }
+}
+
+/*
+ * deletes the DBClient, or gives it back to its pool, called from __gc and
+ * close(), it can be called several times
+ */
+void dbclient_release(LuaDBClient *db)
+{
+  if (db->client) {
+    dbclient_flush_cursors(db);
+    // replies still expected by a Multiplexer would be read by the next user
+    if (db->pool && db->multiplexed > 0)
+      (*db->pool)->discard(db->client, false);
+    else if (db->pool)
+      (*db->pool)->release(db->client, *db->credentials);
+    else
+      delete db->client;
+    db->multiplexed = 0;
+    db->client = NULL;
+    db->connection = NULL;
+  }
+  delete db->pool;
+  db->pool = NULL;
+  // after the cursors, some may belong to its connections
+  delete db->topology;
+  db->topology = NULL;
+  delete db->breaker;
+  db->breaker = NULL;
+  delete db->compression;
+  db->compression = NULL;
+  delete db->read_pref;
+  db->read_pref = NULL;
+  delete db->dead_cursors;
+  db->dead_cursors = NULL;
+  delete db->cache;
+  db->cache = NULL;
+  delete db->credentials;
+  db->credentials = NULL;
+}
+
+/*
+ * true when a connection authenticated with a is also authenticated with b
+ */
+bool same_credentials(const std::vector<LuaCredential> &a,
+                      const std::vector<LuaCredential> &b)
+{
+  if (a.size() != b.size()) return false;
+  for (size_t i = 0; i < a.size(); ++i) {
+    if (a[i].dbname != b[i].dbname || a[i].username != b[i].username ||
+        a[i].password != b[i].password || a[i].digestPassword != b[i].digestPassword)
+      return false;
+  }
+  return true;
+}
+
+/*
+ * drops the cached results of ns, called before every write to it
+ */
+void dbclient_invalidate(LuaDBClient *db, const std::string &ns)
+{
+  if (db->cache) db->cache->invalidate(ns);
+}
+
+/*
+ * the connection a query is sent to: the member of the replica set selected
+ * by its monitor for the $readPreference of the query, or the DBClient
+ */
+DBClientBase* dbclient_route(LuaDBClient *db, const Query &query)
+{
+  BSONElement pref = query.obj["$readPreference"];
+  std::string host;
+  if (!db->topology || pref.type() != Object || !db->topology->select(pref.Obj(), host))
+    return db->client;
+  try {
+    return db->topology->reader(host, *db->credentials);
+  } catch (std::exception &e) {
+    db->topology->failed(host, e.what());
+    return db->client;
+  }
+}
+
+/*
+ * Cursor finalizers don't delete their DBClientCursor, as it may block the
+ * collector sending OP_KILL_CURSORS. They are queued here instead.
+ */
+void dbclient_defer_cursor(LuaDBClient *db, DBClientCursor *cursor)
+{
+  if (db->dead_cursors) {
+    db->dead_cursors->push_back(cursor);
+  } else {
+    // the DBClient is gone, the cursor can't talk to it anymore
+    cursor->decouple();
+    delete cursor;
+  }
+}
+
+/*
+ * a cursor reading through a member of a replica set keeps its connection
+ * open until it is deleted by dbclient_delete_cursor()
+ */
+void dbclient_track_cursor(LuaDBClient *db, DBClientCursor *cursor, DBClientBase *conn)
+{
+  if (db->topology && conn != db->client) db->topology->track(cursor, conn);
+}
+
+void dbclient_delete_cursor(LuaDBClient *db, DBClientCursor *cursor)
+{
+  if (db->topology)
+    db->topology->delete_cursor(cursor);
+  else
+    delete cursor;
+}
+
+/*
+ * Deletes the queued cursors. For a plain connection all their server-side
+ * cursors are killed with a single OP_KILL_CURSORS message; cursors of a
+ * replica set belong to its member connections and kill themselves.
+ */
+void dbclient_flush_cursors(LuaDBClient *db)
+{
+  if (!db->dead_cursors || db->dead_cursors->empty()) return;
+
+  std::vector<DBClientCursor*> cursors;
+  cursors.swap(*db->dead_cursors);
+
+  std::vector<long long> ids;
+  for (size_t i = 0; i < cursors.size(); ++i) {
+    if (db->connection) {
+      long long id = cursors[i]->getCursorId();
+      if (id) ids.push_back(id);
+      cursors[i]->decouple();
+    }
+    dbclient_delete_cursor(db, cursors[i]);
+  }
+
+  if (!ids.empty()) {
+    BufBuilder b;
+    b.appendNum((int)0); // reserved
+    b.appendNum((int)ids.size());
+    for (size_t i = 0; i < ids.size(); ++i) {
+      b.appendNum(ids[i]);
+    }
+    Message m;
+    m.setData(dbKillCursors, b.buf(), b.len());
+    try {
+      db->connection->say(m);
+    } catch (std::exception &) {
+      // best effort, as in the driver, the server times out idle cursors
+    }
+  }
+}
+
 
 /***********************************************************************/
 // The following methods are common to all DBClients
@@ -126,12 +455,19 @@ static int dbclient_auth(lua_State *L) {
        
      std::string errmsg;
      bool success = dbclient->auth(dbname, username, password, errmsg, digestPassword);
-     lua_pop(L, 4);
      if (!success) {
+       lua_pop(L, 4);
        lua_pushnil(L);
        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "auth", errmsg.c_str());
        return 2;
      }
+     LuaCredential credential;
+     credential.dbname = dbname;
+     credential.username = username;
+     credential.password = password;
+     credential.digestPassword = digestPassword;
+     userdata_to_luadbclient(L, 1)->credentials->push_back(credential);
+     lua_pop(L, 4);
      lua_pushboolean(L, 1);
      return 1;
   } catch (std::exception &e) {
@@ -149,7 +485,11 @@ static int dbclient_auth(lua_State *L) {
  * is_failed = db:is_failed()
  */
 static int dbclient_is_failed(lua_State *L) {
-  DBClientBase *dbclient = userdata_to_dbclient(L, 1);
+  // not wrapped by dbclient_admitted(), a failed connection is not reconnected here
+  LuaDBClient *db = userdata_to_luadbclient(L, 1);
+  if (!db->client)
+    luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_DBCLIENT);
+  DBClientBase *dbclient = db->client;
   try {
     bool is_failed = dbclient->isFailed();
     lua_pushboolean(L, is_failed);
@@ -186,18 +526,41 @@ static int dbclient_get_server_address(lua_State *L) {
 }
 
 /*
- * count,err = db:count(ns, json_str/lua_table/array of lua table(ordered))
+ * count,err = db:count(ns, json_str/lua_table/query_obj/array of lua table(ordered))
+ *    a query_obj with a read preference runs the count command with it
  */
 static int dbclient_count(lua_State *L) {
   DBClientBase *dbclient = userdata_to_dbclient(L, 1);
   try {
-    const char *ns = luaL_checkstring(L, 2);
-    BSONObj query;
-    if (!lua_to_bson_ordered(L, 3, query)) {
+    std::string ns = luaL_checkstring(L, 2);
+    Query query;
+    if (!lua_to_bson_ordered_query(L, 3, query)) {
       throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
     }
-    int count = dbclient->count(ns, query);
-    lua_pushinteger(L, count);
+    int options = apply_read_pref(userdata_to_luadbclient(L, 1), query);
+    if (!query.obj.hasField("$readPreference")) {
+      lua_pushinteger(L, dbclient->count(ns, query.getFilter()));
+      return 1;
+    }
+
+    // commands carry their read preference like queries
+    size_t dot = ns.find('.');
+    if (dot == std::string::npos) {
+      throw "invalid namespace";
+    }
+    BSONObj cmd = BSON("$query" << BSON("count" << ns.substr(dot + 1) << "query" << query.getFilter())
+                       << "$readPreference" << query.obj["$readPreference"].Obj());
+    BSONObj retval;
+    LuaDBClient *db = userdata_to_luadbclient(L, 1);
+    MemberReadPtr read;
+    if (hedging(db, query))
+      read = hedge_read(db, query, MemberReadPtr(new CommandRead(ns.substr(0, dot), cmd, options)));
+    if (read) {
+      retval = static_cast<CommandRead *>(read.get())->result;
+    } else if (!dbclient_route(db, query)->runCommand(ns.substr(0, dot), cmd, retval, options)) {
+      throw std::runtime_error(retval["errmsg"].str());
+    }
+    lua_pushinteger(L, retval["n"].numberLong());
     return 1;
   } catch (std::exception &e) {
     lua_pushnil(L);
@@ -211,7 +574,10 @@ static int dbclient_count(lua_State *L) {
 }
 
 /*
- * ok,err = db:insert(ns, json_str/lua_table/array of lua table(ordered))
+ * ok,err = db:insert(ns, json_str/lua_table/array of lua table(ordered)[, write_concern])
+ *    write_concern = {w=n|"majority", j=bool, wtimeout=ms} overrides the
+ *    fields it sets in the write concern of the connection, w=0 doesn't wait
+ *    for any reply
  */
 static int dbclient_insert(lua_State *L) {
   DBClientBase *dbclient = userdata_to_dbclient(L, 1);
@@ -221,7 +587,10 @@ static int dbclient_insert(lua_State *L) {
     if (!lua_to_bson_ordered(L, 3, data)) {
       throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
     }
-    dbclient->insert(ns, data);
+    WriteConcern wc = dbclient->getWriteConcern();
+    bool has_wc = lua_to_write_concern(L, 4, wc);
+    dbclient_invalidate(userdata_to_luadbclient(L, 1), ns);
+    dbclient->insert(ns, data, 0, has_wc ? &wc : NULL);
     lua_pushboolean(L, 1);
     return 1;
   } catch (std::exception &e) {
@@ -236,7 +605,7 @@ static int dbclient_insert(lua_State *L) {
 }
 
 /*
- * ok,err = db:insert_batch(ns, json_str/lua_table/array of lua table(ordered))
+ * ok,err = db:insert_batch(ns, json_str/lua_table/array of lua table(ordered)[, write_concern])
  */
 static int dbclient_insert_batch(lua_State *L) {
   DBClientBase *dbclient = userdata_to_dbclient(L, 1);
@@ -246,7 +615,10 @@ static int dbclient_insert_batch(lua_State *L) {
     if (!lua_to_bson_batched(L, 3, vdata)) {
       throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
     }    
-    dbclient->insert(ns, vdata);
+    WriteConcern wc = dbclient->getWriteConcern();
+    bool has_wc = lua_to_write_concern(L, 4, wc);
+    dbclient_invalidate(userdata_to_luadbclient(L, 1), ns);
+    dbclient->insert(ns, vdata, 0, has_wc ? &wc : NULL);
     lua_pushboolean(L, 1);
     return 1;
   } catch (std::exception &e) {
@@ -260,11 +632,112 @@ static int dbclient_insert_batch(lua_State *L) {
   }
 }
 
+namespace {
+
+struct FindOneRead : public MemberRead {
+  std::string ns;
+  Query query;
+  BSONObj fields;
+  int options;
+  BSONObj result;
+
+  FindOneRead(const std::string &ns, const Query &query, const BSONObj *fields, int options) :
+    ns(ns), query(query), fields(fields ? *fields : BSONObj()), options(options) { }
+  void run(DBClientBase *client) {
+    result = client->findOne(ns, query, fields.isEmpty() ? NULL : &fields, options).getOwned();
+  }
+  MemberRead* clone() const {
+    return new FindOneRead(ns, query, fields.isEmpty() ? NULL : &fields, options);
+  }
+};
+
+struct CommandRead : public MemberRead {
+  std::string dbname;
+  BSONObj command;
+  int options;
+  BSONObj result;
+
+  CommandRead(const std::string &dbname, const BSONObj &command, int options) :
+    dbname(dbname), command(command), options(options) { }
+  void run(DBClientBase *client) {
+    if (!client->runCommand(dbname, command, result, options))
+      throw std::runtime_error(result["errmsg"].str());
+    result = result.getOwned();
+  }
+  MemberRead* clone() const {
+    return new CommandRead(dbname, command, options);
+  }
+};
+
+// only for single batch queries, their cursor is closed by the server so
+// the connection of the worker is free once the batch is read
+struct QueryRead : public MemberRead {
+  std::string ns;
+  Query query;
+  int nToReturn;
+  int nToSkip;
+  BSONObj fields;
+  int options;
+  DBClientCursor *cursor;
+
+  QueryRead(const std::string &ns, const Query &query, int nToReturn, int nToSkip,
+            const BSONObj *fields, int options) :
+    ns(ns), query(query), nToReturn(nToReturn), nToSkip(nToSkip),
+    fields(fields ? *fields : BSONObj()), options(options), cursor(NULL) { }
+  ~QueryRead() { delete cursor; }
+  void run(DBClientBase *client) {
+    std::auto_ptr<DBClientCursor> result =
+      client->query(ns, query, nToReturn, nToSkip, fields.isEmpty() ? NULL : &fields, options);
+    if (!result.get())
+      throw std::runtime_error(LUAMONGO_ERR_CONNECTION_LOST);
+    cursor = result.release();
+  }
+  MemberRead* clone() const {
+    return new QueryRead(ns, query, nToReturn, nToSkip, fields.isEmpty() ? NULL : &fields, options);
+  }
+  DBClientCursor* release() {
+    DBClientCursor *c = cursor;
+    cursor = NULL;
+    return c;
+  }
+};
+
+inline bool hedging(LuaDBClient *db, const Query &query) {
+  return db->topology && db->topology->options().hedgeDelay > 0 &&
+    query.obj["$readPreference"].type() == Object;
+}
+
+/*
+ * the winning attempt of read, NULL when it has to be run by the DBClient
+ */
+inline MemberReadPtr hedge_read(LuaDBClient *db, const Query &query, const MemberReadPtr &read) {
+  return db->topology->hedged_read(query.obj["$readPreference"].Obj(), read, *db->credentials);
+}
+
+} // anonymous namespace
+
+/*
+ * gives query the default read preference of db if it has none, returns
+ * the SlaveOk option when the query may be run by a secondary
+ */
+static int apply_read_pref(LuaDBClient *db, Query &query) {
+  if (db->read_pref && !query.obj.hasField("$readPreference"))
+    query_set_read_pref(query, *db->read_pref);
+  BSONElement pref = query.obj["$readPreference"];
+  if (pref.type() == Object && pref.Obj().getStringField("mode") != std::string("primary"))
+    return QueryOption_SlaveOk;
+  return 0;
+}
+
 /*
  * cursor,err = db:query(ns, json_str/lua_table/query_obj/array of lua table(ordered), limit, skip, json_str/lua_table/array of lua table(ordered), options, batchsize)
+ *    batchsize can also be a table of cursor options:
+ *       batch_size        size of the first batch
+ *       max_batch_bytes   adapts the size of every batch after the first
+ *                         one to the observed document sizes, keeping it
+ *                         close to this budget
  */
 static int dbclient_query(lua_State *L) {
-  DBClientBase *dbclient = userdata_to_dbclient(L, 1);
   try {
     const char *ns = luaL_checkstring(L, 2);
     Query query;
@@ -277,28 +750,48 @@ static int dbclient_query(lua_State *L) {
     int nToReturn = luaL_optint(L, 4, 0);
     int nToSkip = luaL_optint(L, 5, 0);
 
-    const BSONObj *fieldsToReturn = NULL;
+    std::auto_ptr<BSONObj> fields;
     if (!lua_isnoneornil(L, 6)) {
       BSONObj object;
       if (lua_to_bson_ordered(L, 6, object)) {
-        fieldsToReturn = new BSONObj(object);
+        fields.reset(new BSONObj(object));
       } else {
         throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
       }
     }
+    const BSONObj *fieldsToReturn = fields.get();
 
     int queryOptions = luaL_optint(L, 7, 0);
-    int batchSize = luaL_optint(L, 8, 0);
-
-    //wont throw as handles it internally
-    int res = cursor_create(L, dbclient, ns, query, nToReturn, nToSkip,
-            fieldsToReturn, queryOptions, batchSize);
+    queryOptions |= apply_read_pref(userdata_to_luadbclient(L, 1), query);
+    int batchSize = 0;
+    int maxBatchBytes = 0;
+    if (lua_type(L, 8) == LUA_TTABLE) {
+      lua_getfield(L, 8, "batch_size");
+      batchSize = luaL_optint(L, -1, 0);
+      lua_getfield(L, 8, "max_batch_bytes");
+      double bytes = luaL_optnumber(L, -1, 0);
+      lua_pop(L, 2);
+      if (!(bytes >= 0 && bytes <= INT_MAX))
+        throw ("max_batch_bytes must be between 0 and 2147483647");
+      maxBatchBytes = (int)bytes;
+    } else {
+      batchSize = luaL_optint(L, 8, 0);
+    }
 
-    if (fieldsToReturn) {
-      delete fieldsToReturn;
+    LuaDBClient *db = userdata_to_luadbclient(L, 1);
+    if (nToReturn < 0 && hedging(db, query)) {
+      MemberReadPtr single(new QueryRead(ns, query, nToReturn, nToSkip, fieldsToReturn, queryOptions));
+      MemberReadPtr read = hedge_read(db, query, single);
+      if (read)
+        return cursor_push(L, static_cast<QueryRead *>(read.get())->release(), 1, maxBatchBytes);
+      const BSONObj &fields = static_cast<QueryRead *>(single.get())->fields;
+      return cursor_create(L, 1, ns, query, nToReturn, nToSkip,
+                           fields.isEmpty() ? NULL : &fields, queryOptions, batchSize, maxBatchBytes);
     }
 
-    return res;
+    //wont throw as handles it internally
+    return cursor_create(L, 1, ns, query, nToReturn, nToSkip,
+            fieldsToReturn, queryOptions, batchSize, maxBatchBytes);
   } catch (std::exception &e) {
     lua_pushnil(L);
     lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "query", e.what());
@@ -335,7 +828,26 @@ static int dbclient_find_one(lua_State *L) {
     }
 
     int queryOptions = luaL_optint(L, 5, 0);
-    BSONObj ret = dbclient->findOne(ns, query, fieldsToReturn, queryOptions);
+    queryOptions |= apply_read_pref(userdata_to_luadbclient(L, 1), query);
+    QueryCache *cache = userdata_to_luadbclient(L, 1)->cache;
+    // the result could predate an async write to ns still running
+    if (cache && cache->held(ns)) cache = NULL;
+    std::string key;
+    BSONObj ret;
+    if (cache) {
+      key = QueryCache::key(ns, query.obj, fieldsToReturn, queryOptions);
+    }
+    if (!cache || !cache->get(key, ret)) {
+      LuaDBClient *db = userdata_to_luadbclient(L, 1);
+      MemberReadPtr read;
+      if (hedging(db, query))
+        read = hedge_read(db, query, MemberReadPtr(new FindOneRead(ns, query, fieldsToReturn, queryOptions)));
+      if (read)
+        ret = static_cast<FindOneRead *>(read.get())->result;
+      else
+        ret = dbclient_route(db, query)->findOne(ns, query, fieldsToReturn, queryOptions);
+      if (cache) cache->put(key, ret);
+    }
     bson_to_lua(L, ret);
     if (fieldsToReturn) {
       delete fieldsToReturn;
@@ -352,8 +864,149 @@ static int dbclient_find_one(lua_State *L) {
   }
 }
 
+namespace {
+
+// upper bound of the $in array of one find_many query
+const int FIND_MANY_MAX_KEY_BYTES = BSONObjMaxUserSize / 2;
+
+struct KeyLess {
+  bool operator()(const BSONObj &a, const BSONObj &b) const {
+    return a.woCompare(b, BSONObj(), false) < 0;
+  }
+};
+
+// distinct keys, wrapped as {"": key}, and their positions in the key list
+typedef std::map<BSONObj, std::vector<int>, KeyLess> KeyPositions;
+
+void assign_found(const BSONElement &value, const BSONObj &doc,
+                  const KeyPositions &keys, std::vector<BSONObj> &found) {
+  BSONObjBuilder b;
+  b.appendAs(value, "");
+  KeyPositions::const_iterator it = keys.find(b.obj());
+  if (it == keys.end()) return;
+  for (size_t i = 0; i < it->second.size(); ++i) {
+    BSONObj &slot = found[it->second[i]];
+    if (slot.isEmpty()) slot = doc;
+  }
+}
+
+} // anonymous namespace
+
 /*
- * ok,err = db:remove(ns, json_str/lua_table/query_obj/array of lua table(ordered))
+ * docs,err = db:find_many(ns, field, {key1, key2, ...}[, {projection=..., chunk=1000}])
+ *    fetches the documents whose field is one of the keys with $in queries of
+ *    at most chunk distinct keys. docs[i] is the document of keys[i], or nil
+ *    when it was not found; repeated keys get the same document.
+ */
+static int dbclient_find_many(lua_State *L) {
+  DBClientBase *dbclient = userdata_to_dbclient(L, 1);
+  try {
+    const char *ns = luaL_checkstring(L, 2);
+    const char *field = luaL_checkstring(L, 3);
+    luaL_checktype(L, 4, LUA_TTABLE);
+
+    int chunk = 1000;
+    BSONObj projection;
+    if (lua_type(L, 5) == LUA_TTABLE) {
+      lua_getfield(L, 5, "chunk");
+      chunk = luaL_optint(L, -1, 1000);
+      lua_getfield(L, 5, "projection");
+      if (!lua_isnil(L, -1) && !lua_to_bson_ordered(L, lua_gettop(L), projection)) {
+        lua_pop(L, 2);
+        throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+      }
+      lua_pop(L, 2);
+      if (chunk < 1) {
+        throw ("chunk must be positive");
+      }
+    }
+
+    // the key field is needed to align the documents, unless it is excluded
+    if (!projection.isEmpty() && projection[field].eoo()) {
+      bool exclusion = false;
+      BSONObjIterator it(projection);
+      while (it.more()) {
+        BSONElement e = it.next();
+        if (strcmp(e.fieldName(), "_id") != 0 && !e.trueValue()) exclusion = true;
+      }
+      if (!exclusion) {
+        BSONObjBuilder b;
+        b.appendElements(projection);
+        b.append(field, 1);
+        projection = b.obj();
+      }
+    }
+
+    int n = lua_rawlen(L, 4);
+    KeyPositions keys;
+    for (int i = 1; i <= n; ++i) {
+      lua_rawgeti(L, 4, i);
+      BSONObjBuilder b;
+      lua_append_value(L, "", lua_gettop(L), b);
+      lua_pop(L, 1);
+      BSONObj key = b.obj();
+      if (!key.isEmpty()) keys[key].push_back(i - 1);
+    }
+
+    std::vector<BSONObj> found(n);
+    KeyPositions::const_iterator next = keys.begin();
+    while (next != keys.end()) {
+      BSONObjBuilder query;
+      int count = 0;
+      {
+        BSONObjBuilder cond(query.subobjStart(field));
+        BSONArrayBuilder in(cond.subarrayStart("$in"));
+        int bytes = 0;
+        for (; next != keys.end() && count < chunk; ++next, ++count) {
+          BSONElement key = next->first.firstElement();
+          if (count > 0 && bytes + key.size() > FIND_MANY_MAX_KEY_BYTES) break;
+          in.append(key);
+          bytes += key.size();
+        }
+        in.done();
+        cond.done();
+      }
+
+      std::auto_ptr<DBClientCursor> cursor =
+        dbclient->query(ns, query.obj(), 0, 0, projection.isEmpty() ? NULL : &projection, 0, count);
+      if (!cursor.get()) {
+        throw (LUAMONGO_ERR_CONNECTION_LOST);
+      }
+      while (cursor->more()) {
+        BSONObj doc = cursor->nextSafe().getOwned();
+        BSONElement value = doc.getFieldDotted(field);
+        assign_found(value, doc, keys, found);
+        // $in also matches the elements of array fields
+        if (value.type() == Array) {
+          BSONObjIterator it(value.embeddedObject());
+          while (it.more()) {
+            assign_found(it.next(), doc, keys, found);
+          }
+        }
+      }
+    }
+
+    lua_createtable(L, n, 0);
+    for (int i = 0; i < n; ++i) {
+      if (!found[i].isEmpty()) {
+        bson_to_lua(L, found[i]);
+        lua_rawseti(L, -2, i + 1);
+      }
+    }
+    return 1;
+  } catch (std::exception &e) {
+    lua_pushnil(L);
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "find_many", e.what());
+    return 2;
+  } catch (const char *err) {
+    lua_pushnil(L);
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "find_many", err);
+    return 2;
+  }
+}
+
+/*
+ * ok,err = db:remove(ns, json_str/lua_table/query_obj/array of lua table(ordered)[, justOne[, write_concern]])
  */
 static int dbclient_remove(lua_State *L) {
   DBClientBase *dbclient = userdata_to_dbclient(L, 1);
@@ -364,7 +1017,10 @@ static int dbclient_remove(lua_State *L) {
       throw (LUAMONGO_REQUIRES_QUERY);
     }
     bool justOne = lua_toboolean(L, 4);
-    dbclient->remove(ns, query, justOne);
+    WriteConcern wc = dbclient->getWriteConcern();
+    bool has_wc = lua_to_write_concern(L, 5, wc);
+    dbclient_invalidate(userdata_to_luadbclient(L, 1), ns);
+    dbclient->remove(ns, query, justOne, has_wc ? &wc : NULL);
     lua_pushboolean(L, 1);
     return 1;
   } catch (std::exception &e) {
@@ -380,7 +1036,7 @@ static int dbclient_remove(lua_State *L) {
 
 
 /*
- * ok,err = db:update(ns, json_str/lua_table/query_obj/array of lua table(ordered), json_str/lua_table/array of lua table(ordered), upsert, multi)
+ * ok,err = db:update(ns, json_str/lua_table/query_obj/array of lua table(ordered), json_str/lua_table/array of lua table(ordered), upsert, multi[, write_concern])
  */
 static int dbclient_update(lua_State *L) {
   DBClientBase *dbclient = userdata_to_dbclient(L, 1);
@@ -398,7 +1054,10 @@ static int dbclient_update(lua_State *L) {
     bool upsert = lua_toboolean(L, 5);
     bool multi = lua_toboolean(L, 6);
 
-    dbclient->update(ns, query, obj, upsert, multi);
+    WriteConcern wc = dbclient->getWriteConcern();
+    bool has_wc = lua_to_write_concern(L, 7, wc);
+    dbclient_invalidate(userdata_to_luadbclient(L, 1), ns);
+    dbclient->update(ns, query, obj, upsert, multi, has_wc ? &wc : NULL);
     lua_pushboolean(L, 1);
     return 1;
   } catch (std::exception &e) {
@@ -412,6 +1071,76 @@ static int dbclient_update(lua_State *L) {
   }
 }
 
+/*
+ * result,err = db:update_batch(ns, {{q=query, u=json_str/lua_table, upsert=bool, multi=bool}, ...}[, {ordered=bool, write_concern=...}])
+ *    sends the updates as update write commands, result is the one of
+ *    bulk:execute(), indexes are the positions of the entries. Updates are
+ *    ordered by default.
+ */
+static int dbclient_update_batch(lua_State *L) {
+  LuaDBClient *db = userdata_to_luadbclient(L, 1);
+  DBClientBase *dbclient = userdata_to_dbclient(L, 1);
+  try {
+    const char *ns = luaL_checkstring(L, 2);
+    luaL_checktype(L, 3, LUA_TTABLE);
+
+    bool ordered = true;
+    WriteConcern wc = dbclient->getWriteConcern();
+    if (lua_type(L, 4) == LUA_TTABLE) {
+      lua_getfield(L, 4, "ordered");
+      if (!lua_isnil(L, -1))
+        ordered = lua_toboolean(L, -1);
+      lua_getfield(L, 4, "write_concern");
+      lua_to_write_concern(L, lua_gettop(L), wc);
+      lua_pop(L, 2);
+    }
+
+    std::vector<WriteOp> ops;
+    size_t n = lua_rawlen(L, 3);
+    ops.reserve(n);
+    for (size_t i = 1; i <= n; ++i) {
+      lua_rawgeti(L, 3, i);
+      int entry = lua_gettop(L);
+      if (!lua_istable(L, entry))
+        throw "update_batch entries must be tables";
+
+      BSONObjBuilder b;
+      BSONObj obj;
+      lua_getfield(L, entry, "q");
+      if (!lua_to_bson_ordered(L, entry + 1, obj)) {
+        throw (LUAMONGO_REQUIRES_QUERY);
+      }
+      b.append("q", obj);
+      lua_getfield(L, entry, "u");
+      if (!lua_to_bson_ordered(L, entry + 2, obj)) {
+        throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+      }
+      b.append("u", obj);
+      lua_getfield(L, entry, "upsert");
+      b.append("upsert", (bool)lua_toboolean(L, -1));
+      lua_getfield(L, entry, "multi");
+      b.append("multi", (bool)lua_toboolean(L, -1));
+      lua_pop(L, 5);
+
+      ops.push_back(WriteOp(WriteOp::WRITE_UPDATE, b.obj()));
+    }
+
+    dbclient_invalidate(db, ns);
+    WriteOpsResult result;
+    write_ops_execute(dbclient, ns, ops, ordered, wc, result);
+    write_ops_result_push(L, result);
+    return 1;
+  } catch (std::exception &e) {
+    lua_pushnil(L);
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "update_batch", e.what());
+    return 2;
+  } catch (const char *err) {
+    lua_pushnil(L);
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "update_batch", err);
+    return 2;
+  }
+}
+
 /*
  * ok,err = db:drop_collection(ns)
  */
@@ -419,6 +1148,7 @@ static int dbclient_drop_collection(lua_State *L) {
   DBClientBase *dbclient = userdata_to_dbclient(L, 1);
   try {
     const char *ns = luaL_checkstring(L, 2);
+    dbclient_invalidate(userdata_to_luadbclient(L, 1), ns);
     dbclient->dropCollection(ns);
     lua_pushboolean(L, 1);
     return 1;
@@ -604,15 +1334,7 @@ static int dbclient_enumerate_indexes(lua_State *L) {
        return 2;
      }
    
-     DBClientCursor **cursor =
-       (DBClientCursor **)lua_newuserdata(L, sizeof(DBClientCursor *));
-     *cursor = autocursor.get();
-     autocursor.release();
-   
-     luaL_getmetatable(L, LUAMONGO_CURSOR);
-     lua_setmetatable(L, -2);
-   
-     return 1;     
+     return cursor_push(L, autocursor.release(), 1, 0);
   } catch (std::exception &e) {
     lua_pushnil(L);
     lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "enumerate_indexes", e.what());
@@ -662,6 +1384,81 @@ static int dbclient_mapreduce(lua_State *L) {
   }
 }
 
+/*
+ * cursor,err = db:aggregate(ns, {stage1, stage2, ...}[, {allowDiskUse=bool, batchSize=n, maxTimeMS=ms, hint=index}])
+ *    runs an aggregation pipeline, its results are read through a Cursor
+ *    which gets the following batches with getMore
+ */
+static int dbclient_aggregate(lua_State *L) {
+  DBClientBase *dbclient = userdata_to_dbclient(L, 1);
+  try {
+    const char *ns = luaL_checkstring(L, 2);
+    luaL_checktype(L, 3, LUA_TTABLE);
+
+    BSONArrayBuilder stages;
+    int n = lua_rawlen(L, 3);
+    for (int i = 1; i <= n; ++i) {
+      lua_rawgeti(L, 3, i);
+      BSONObj stage;
+      if (!lua_to_bson_ordered(L, lua_gettop(L), stage)) {
+        lua_pop(L, 1);
+        throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+      }
+      lua_pop(L, 1);
+      stages.append(stage);
+    }
+
+    int batchSize = 0;
+    BSONObjBuilder options;
+    if (lua_type(L, 4) == LUA_TTABLE) {
+      lua_getfield(L, 4, "allowDiskUse");
+      if (!lua_isnil(L, -1)) {
+        options.append("allowDiskUse", (bool)lua_toboolean(L, -1));
+      }
+      lua_getfield(L, 4, "batchSize");
+      batchSize = luaL_optint(L, -1, 0);
+      if (batchSize > 0) {
+        options.append("cursor", BSON("batchSize" << batchSize));
+      }
+      lua_getfield(L, 4, "maxTimeMS");
+      if (!lua_isnil(L, -1)) {
+        options.append("maxTimeMS", (int)luaL_checkinteger(L, -1));
+      }
+      lua_getfield(L, 4, "hint");
+      if (lua_type(L, -1) == LUA_TSTRING) {
+        options.append("hint", lua_tostring(L, -1));
+      } else if (!lua_isnil(L, -1)) {
+        BSONObj hint;
+        if (!lua_to_bson_ordered(L, lua_gettop(L), hint)) {
+          lua_pop(L, 4);
+          throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+        }
+        options.append("hint", hint);
+      }
+      lua_pop(L, 4);
+    }
+    BSONObj aggregateOptions = options.obj();
+
+    std::auto_ptr<DBClientCursor> cursor =
+      dbclient->aggregate(ns, stages.arr(), &aggregateOptions);
+    if (!cursor.get()) {
+      throw (LUAMONGO_ERR_CONNECTION_LOST);
+    }
+    if (batchSize > 0) {
+      cursor->setBatchSize(batchSize);
+    }
+    return cursor_push(L, cursor.release(), 1, 0);
+  } catch (std::exception &e) {
+    lua_pushnil(L);
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "aggregate", e.what());
+    return 2;
+  } catch (const char *err) {
+    lua_pushnil(L);
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "aggregate", err);
+    return 2;
+  }
+}
+
 /*
  * ok,err = db:reindex(ns);
  */
@@ -744,6 +1541,22 @@ static int dbclient_get_last_error_detailed(lua_State *L) {
     return 2;
   }
 }
+/*
+ * moves first the field named by the "cmd" field of command, if any
+ */
+static BSONObj command_reorder(const BSONObj &command) {
+  if (!command.hasElement("cmd"))
+    return command;
+  const char *cmd_key = command.getStringField("cmd");
+  BSONElement cmd = command[cmd_key];
+  command.removeField("cmd");
+  // TODO: it is necessary => command.removeField(cmd_key);
+  BSONObjBuilder b;
+  b.append(cmd);
+  b.appendElementsUnique(command);
+  return b.obj();
+}
+
 /*
  * res,err = db:run_command(dbname, json_str/lua_table/array of lua table(ordered), options)
  */
@@ -761,19 +1574,7 @@ static int dbclient_run_command(lua_State *L) {
     if (!lua_to_bson_ordered(L, 3, command)) {
        throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
     }
-    if (!command.hasElement("cmd")) {
-      success = dbclient->runCommand(ns, command, retval, options);
-    } else {
-      const char *cmd_key = command.getStringField("cmd");
-      BSONElement cmd = command[cmd_key];
-      command.removeField("cmd");
-      // TODO: it is necessary => command.removeField(cmd_key);
-      BSONObjBuilder b;
-      b.append(cmd);
-      b.appendElementsUnique(command);
-      BSONObj command_new = b.obj();
-      success = dbclient->runCommand(ns, command_new, retval, options);
-    }
+    success = dbclient->runCommand(ns, command_reorder(command), retval, options);
 
     if (!success)
       throw retval["errmsg"].str().c_str();
@@ -791,6 +1592,124 @@ static int dbclient_run_command(lua_State *L) {
   }
 }
 
+/*
+ * the findAndModify command of ns for the options table at index
+ */
+static BSONObj find_and_modify_command(lua_State *L, int index, const std::string &ns) {
+  size_t dot = ns.find('.');
+  if (dot == std::string::npos) {
+    throw "invalid namespace";
+  }
+
+  BSONObjBuilder cmd;
+  cmd.append("findAndModify", ns.substr(dot + 1));
+
+  static const char *object_options[] = { "query", "sort", "update", "fields" };
+  for (size_t i = 0; i < sizeof(object_options) / sizeof(object_options[0]); ++i) {
+    lua_getfield(L, index, object_options[i]);
+    if (!lua_isnil(L, -1)) {
+      BSONObj obj;
+      if (!lua_to_bson_ordered(L, lua_gettop(L), obj)) {
+        throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+      }
+      cmd.append(object_options[i], obj);
+    }
+    lua_pop(L, 1);
+  }
+
+  static const char *bool_options[] = { "remove", "new", "upsert" };
+  for (size_t i = 0; i < sizeof(bool_options) / sizeof(bool_options[0]); ++i) {
+    lua_getfield(L, index, bool_options[i]);
+    if (lua_toboolean(L, -1)) {
+      cmd.append(bool_options[i], true);
+    }
+    lua_pop(L, 1);
+  }
+
+  return cmd.obj();
+}
+
+/*
+ * the placeholder names of the array at index, none if it is nil
+ */
+static void lua_to_placeholders(lua_State *L, int index, std::vector<std::string> &names) {
+  if (lua_isnoneornil(L, index))
+    return;
+
+  luaL_checktype(L, index, LUA_TTABLE);
+  for (size_t i = 1; i <= lua_rawlen(L, index); ++i) {
+    lua_rawgeti(L, index, i);
+    if (!lua_isstring(L, -1))
+      throw "placeholders must be strings";
+    names.push_back(lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
+}
+
+/*
+ * doc,err = db:find_and_modify(ns, {query=..., update=... | remove=true, sort=..., new=bool, upsert=bool, fields=...})
+ *    returns the document before the update, or after it with new=true,
+ *    or nil when no document matched. Only that document of the reply is
+ *    converted to Lua.
+ */
+static int dbclient_find_and_modify(lua_State *L) {
+  DBClientBase *dbclient = userdata_to_dbclient(L, 1);
+  try {
+    std::string ns = luaL_checkstring(L, 2);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    BSONObj cmd = find_and_modify_command(L, 3, ns);
+
+    dbclient_invalidate(userdata_to_luadbclient(L, 1), ns);
+    BSONObj retval;
+    if (!dbclient->runCommand(ns.substr(0, ns.find('.')), cmd, retval))
+      throw std::runtime_error(retval["errmsg"].str());
+
+    BSONElement value = retval["value"];
+    if (value.type() == Object) {
+      bson_to_lua(L, value.embeddedObject());
+    } else {
+      lua_pushnil(L);
+    }
+    return 1;
+  } catch (std::exception &e) {
+    lua_pushnil(L);
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "find_and_modify", e.what());
+    return 2;
+  } catch (const char *err) {
+    lua_pushnil(L);
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "find_and_modify", err);
+    return 2;
+  }
+}
+
+/*
+ * prepared,err = db:prepare_find_and_modify(ns, {query=..., update=..., ...}, {"$1", ...})
+ *    encodes the command of db:find_and_modify() once, prepared:run(v1, ...)
+ *    replaces its placeholders like a db:prepare() one and returns the
+ *    document like db:find_and_modify()
+ */
+static int dbclient_prepare_find_and_modify(lua_State *L) {
+  userdata_to_dbclient(L, 1);
+  try {
+    std::string ns = luaL_checkstring(L, 2);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    BSONObj cmd = find_and_modify_command(L, 3, ns);
+
+    std::vector<std::string> names;
+    lua_to_placeholders(L, 4, names);
+
+    return prepared_create(L, 1, ns.substr(0, ns.find('.')), cmd, names, 0, ns, "value");
+  } catch (std::exception &e) {
+    lua_pushnil(L);
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "prepare_find_and_modify", e.what());
+    return 2;
+  } catch (const char *err) {
+    lua_pushnil(L);
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "prepare_find_and_modify", err);
+    return 2;
+  }
+}
+
 /*
  * res,err = db:get_dbnames()
  */
@@ -844,33 +1763,493 @@ static int dbclient_get_collections(lua_State *L) {
   }
 }
 
+namespace {
+/*
+ * Gathers the documents of one cursor batch and writes them to a file
+ * descriptor with a single writev() call (split at IOV_MAX entries).
+ * Added buffers must stay valid until flush() is called.
+ */
+class ExportWriter {
+public:
+  explicit ExportWriter(int fd) : fd(fd) { }
+
+  void add(const char *data, size_t len) {
+    struct iovec v;
+    v.iov_base = const_cast<char*>(data);
+    v.iov_len = len;
+    iov.push_back(v);
+  }
+
+  void flush() {
+    size_t first = 0;
+    while (first < iov.size()) {
+      int count = static_cast<int>(std::min<size_t>(iov.size() - first, IOV_MAX));
+      ssize_t written = writev(fd, &iov[first], count);
+      if (written < 0) {
+        if (errno == EINTR) continue;
+        throw static_cast<const char*>(strerror(errno));
+      }
+      // skip fully written buffers and adjust a partially written one
+      while (first < iov.size() && written >= (ssize_t)iov[first].iov_len) {
+        written -= iov[first].iov_len;
+        ++first;
+      }
+      if (written > 0) {
+        iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + written;
+        iov[first].iov_len -= written;
+      }
+    }
+    iov.clear();
+  }
+
+private:
+  int fd;
+  std::vector<struct iovec> iov;
+};
+} // anonymous namespace
+
+/*
+ * n,err = db:export(ns, query, path[, {format="bson"|"jsonl", fields=..., batch_size=n}])
+ *    writes every document matching query to path without converting them to
+ *    Lua tables. "bson" (default) concatenates the raw documents, like
+ *    mongodump does; "jsonl" writes one MongoDB extended JSON (strict mode)
+ *    document per line. Returns the number of exported documents.
+ *    Documents are written to a temporary file renamed to path once they are
+ *    all written, on errors it is removed and path is left untouched.
+ */
+static int dbclient_export(lua_State *L) {
+  DBClientBase *dbclient = userdata_to_dbclient(L, 1);
+  int fd = -1;
+  std::string tmp;
+  try {
+    const char *ns = luaL_checkstring(L, 2);
+    Query query;
+    if (!lua_isnoneornil(L, 3)) {
+      if (!lua_to_bson_ordered_query(L, 3, query)) {
+        throw (LUAMONGO_REQUIRES_QUERY);
+      }
+    }
+    const char *path = luaL_checkstring(L, 4);
+
+    bool jsonl = false;
+    int batchSize = 0;
+    BSONObj fields;
+    if (lua_type(L, 5) == LUA_TTABLE) {
+      lua_getfield(L, 5, "format");
+      const char *format = luaL_optstring(L, -1, "bson");
+      if (strcmp(format, "jsonl") == 0) {
+        jsonl = true;
+      } else if (strcmp(format, "bson") != 0) {
+        lua_pop(L, 1);
+        throw ("format must be \"bson\" or \"jsonl\"");
+      }
+      lua_pop(L, 1);
+      lua_getfield(L, 5, "batch_size");
+      batchSize = luaL_optint(L, -1, 0);
+      lua_pop(L, 1);
+      lua_getfield(L, 5, "fields");
+      if (!lua_isnil(L, -1) && !lua_to_bson_ordered(L, lua_gettop(L), fields)) {
+        lua_pop(L, 1);
+        throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+      }
+      lua_pop(L, 1);
+    }
+
+    std::auto_ptr<DBClientCursor> cursor =
+      dbclient->query(ns, query, 0, 0, fields.isEmpty() ? NULL : &fields, 0, batchSize);
+    if (!cursor.get()) {
+      throw (LUAMONGO_ERR_CONNECTION_LOST);
+    }
+
+    // in the directory of path, so that rename() doesn't copy it
+    std::vector<char> name(path, path + strlen(path));
+    const char suffix[] = ".XXXXXX";
+    name.insert(name.end(), suffix, suffix + sizeof(suffix));
+    fd = mkstemp(&name[0]);
+    if (fd < 0) {
+      throw static_cast<const char*>(strerror(errno));
+    }
+    tmp = &name[0];
+    fchmod(fd, 0644);
+
+    ExportWriter writer(fd);
+    std::string lines;
+    long long n = 0;
+    while (cursor->more()) {
+      // documents returned by next() live in the current batch buffer, so
+      // everything is written before more() asks for the next batch
+      while (cursor->moreInCurrentBatch()) {
+        BSONObj obj = cursor->nextSafe();
+        if (jsonl) {
+          lines += obj.jsonString(Strict);
+          lines += '\n';
+        } else {
+          writer.add(obj.objdata(), obj.objsize());
+        }
+        ++n;
+      }
+      if (jsonl) {
+        writer.add(lines.data(), lines.size());
+        writer.flush();
+        lines.clear();
+      } else {
+        writer.flush();
+      }
+    }
+
+    int closed = close(fd);
+    fd = -1;
+    if (closed != 0 || rename(tmp.c_str(), path) != 0) {
+      throw static_cast<const char*>(strerror(errno));
+    }
+    lua_pushnumber(L, n);
+    return 1;
+  } catch (std::exception &e) {
+    if (fd >= 0) close(fd);
+    if (!tmp.empty()) unlink(tmp.c_str());
+    lua_pushnil(L);
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "export", e.what());
+    return 2;
+  } catch (const char *err) {
+    if (fd >= 0) close(fd);
+    if (!tmp.empty()) unlink(tmp.c_str());
+    lua_pushnil(L);
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "export", err);
+    return 2;
+  }
+}
+
+/*
+ * bulk = db:bulk(ns[, {ordered=bool}])
+ *    queues inserts, updates and removes which are sent by bulk:execute()
+ *    in as few write commands as possible. Operations are ordered by
+ *    default, an ordered bulk stops at the first write error.
+ */
+static int dbclient_bulk(lua_State *L) {
+  userdata_to_dbclient(L, 1);
+  const char *ns = luaL_checkstring(L, 2);
+  bool ordered = true;
+  if (lua_type(L, 3) == LUA_TTABLE) {
+    lua_getfield(L, 3, "ordered");
+    if (!lua_isnil(L, -1)) {
+      ordered = lua_toboolean(L, -1);
+    }
+    lua_pop(L, 1);
+  }
+  return bulk_create(L, 1, ns, ordered);
+}
+
+/*
+ * buffer = db:insert_buffer(ns[, {max_docs=1000, max_bytes=4e6, max_delay_ms=0, ordered=bool}])
+ *    buffer:add(doc) encodes documents which are sent in insert write
+ *    commands when max_docs documents or max_bytes bytes are pending, or
+ *    when the first pending document is older than max_delay_ms; a limit
+ *    of 0 disables it
+ */
+static int dbclient_insert_buffer(lua_State *L) {
+  userdata_to_dbclient(L, 1);
+  const char *ns = luaL_checkstring(L, 2);
+  bool ordered = true;
+  lua_Number maxDocs = 1000;
+  lua_Number maxBytes = 4e6;
+  lua_Number maxDelay = 0;
+  if (lua_type(L, 3) == LUA_TTABLE) {
+    lua_getfield(L, 3, "ordered");
+    if (!lua_isnil(L, -1)) {
+      ordered = lua_toboolean(L, -1);
+    }
+    lua_getfield(L, 3, "max_docs");
+    maxDocs = luaL_optnumber(L, -1, maxDocs);
+    lua_getfield(L, 3, "max_bytes");
+    maxBytes = luaL_optnumber(L, -1, maxBytes);
+    lua_getfield(L, 3, "max_delay_ms");
+    maxDelay = luaL_optnumber(L, -1, maxDelay);
+    lua_pop(L, 4);
+  }
+  luaL_argcheck(L, maxDocs >= 0 && maxBytes >= 0 && maxDelay >= 0, 3, "limits must be positive");
+  return insert_buffer_create(L, 1, ns, ordered, (size_t)maxDocs, (size_t)maxBytes, maxDelay / 1000.0);
+}
+
+/*
+ * pipeline = db:pipeline()
+ *    queues find_one, count and run_command operations which are written
+ *    back-to-back by pipeline:execute(), waiting for all the replies at once
+ */
+static int dbclient_pipeline(lua_State *L) {
+  userdata_to_dbclient(L, 1);
+  return pipeline_create(L, 1);
+}
+
+/*
+ * prepared,err = db:prepare(dbname, json_str/lua_table/array of lua table(ordered), {"$1", ...}, options)
+ *    encodes the command once, prepared:run(v1, ...) replaces the string
+ *    values equal to the i-th placeholder by the i-th argument
+ */
+static int dbclient_prepare(lua_State *L) {
+  userdata_to_dbclient(L, 1);
+  try {
+    const char *dbname = luaL_checkstring(L, 2);
+    int options = lua_tointeger(L, 5); // if it is invalid it returns 0
+
+    BSONObj command; // arg 3
+    if (!lua_to_bson_ordered(L, 3, command)) {
+      throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+    }
+
+    std::vector<std::string> names;
+    lua_to_placeholders(L, 4, names);
+
+    return prepared_create(L, 1, dbname, command_reorder(command), names, options, "", "");
+  } catch (std::exception &e) {
+    lua_pushnil(L);
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "prepare", e.what());
+    return 2;
+  } catch (const char *err) {
+    lua_pushnil(L);
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "prepare", err);
+    return 2;
+  }
+}
+
+/*
+ * ok,err = db:set_read_pref([{read_pref=mode, tags={{tag=value, ...}, ...}, max_staleness_s=n}])
+ *    read preference of query, find_one and count when their query has
+ *    none, nil for the primary
+ */
+static int dbclient_set_read_pref(lua_State *L) {
+  LuaDBClient *db = userdata_to_luadbclient(L, 1);
+  userdata_to_dbclient(L, 1);
+  try {
+    BSONObj pref;
+    bool has_pref = lua_to_read_pref(L, 2, pref);
+    delete db->read_pref;
+    db->read_pref = has_pref ? new BSONObj(pref) : NULL;
+  } catch (std::exception &e) {
+    lua_pushnil(L);
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "set_read_pref", e.what());
+    return 2;
+  } catch (const char *err) {
+    lua_pushnil(L);
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "set_read_pref", err);
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/*
+ * mux,err = connection:mux()
+ *    Multiplexer sending requests of several coroutines on this connection
+ *    and dispatching the replies by request id. The connection must not be
+ *    used directly while requests of the Multiplexer are in flight.
+ */
+static int dbclient_mux(lua_State *L) {
+  userdata_to_dbclient(L, 1);
+  if (!userdata_to_luadbclient(L, 1)->connection) {
+    lua_pushnil(L);
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_REPLICASET, "mux",
+                    "multiplexing requires a " LUAMONGO_CONNECTION);
+    return 2;
+  }
+  return multiplexer_create(L, 1);
+}
+
+/*
+ * async,err = db:async([{threads=4, timeout=seconds}])
+ *    AsyncClient running operations on worker threads with their own
+ *    connections, its methods return futures. The same object is returned
+ *    while it is in use and not closed. timeout is the socket timeout of
+ *    the workers, by default the one of db or 30 seconds.
+ */
+static int dbclient_async(lua_State *L) {
+  userdata_to_dbclient(L, 1);
+  int threads = 4;
+  double timeout = 0;
+  if (lua_type(L, 2) == LUA_TTABLE) {
+    lua_getfield(L, 2, "threads");
+    threads = luaL_optint(L, -1, threads);
+    lua_getfield(L, 2, "timeout");
+    timeout = luaL_optnumber(L, -1, 0);
+    lua_pop(L, 2);
+  }
+  luaL_argcheck(L, threads > 0, 2, "threads must be positive");
+  luaL_argcheck(L, timeout >= 0, 2, "timeout must be positive");
+  return async_create(L, 1, threads, timeout);
+}
+
+/*
+ * ok,err = db:enable_cache{max_bytes=bytes, ttl=seconds}
+ *    caches find_one results for ttl seconds (default 60), evicting the least
+ *    recently used ones beyond max_bytes (default 16MB). insert, insert_batch,
+ *    update, update_batch, remove, find_and_modify, drop_collection, bulk,
+ *    insert_buffer and async writes made with this object drop the entries
+ *    of their namespace; writes made by run_command, eval or other clients
+ *    are only seen when the entries expire.
+ *    db:enable_cache(false) disables and empties the cache.
+ */
+static int dbclient_enable_cache(lua_State *L) {
+  LuaDBClient *db = userdata_to_luadbclient(L, 1);
+  userdata_to_dbclient(L, 1);
+
+  double maxBytes = 16 * 1024 * 1024;
+  double ttl = 60;
+  if (lua_type(L, 2) == LUA_TTABLE) {
+    lua_getfield(L, 2, "max_bytes");
+    maxBytes = luaL_optnumber(L, -1, maxBytes);
+    lua_getfield(L, 2, "ttl");
+    ttl = luaL_optnumber(L, -1, ttl);
+    lua_pop(L, 2);
+  } else if (!lua_isnoneornil(L, 2) && !lua_toboolean(L, 2)) {
+    delete db->cache;
+    db->cache = NULL;
+    lua_pushboolean(L, 1);
+    return 1;
+  }
+  if (maxBytes <= 0 || ttl <= 0) {
+    lua_pushnil(L);
+    lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_CONNECTION, "enable_cache",
+                    "max_bytes and ttl must be positive");
+    return 2;
+  }
+
+  QueryCache *cache = new QueryCache((size_t)maxBytes, ttl);
+  if (db->cache) cache->adopt_holds(*db->cache);
+  delete db->cache;
+  db->cache = cache;
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/*
+ * stats = db:cache_stats()
+ *    {hits=n, misses=n, entries=n, bytes=n}, nil when the cache is disabled
+ */
+static int dbclient_cache_stats(lua_State *L) {
+  QueryCache *cache = userdata_to_luadbclient(L, 1)->cache;
+  if (!cache) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_newtable(L);
+  LUA_PUSH_ATTRIB_FLOAT("hits", cache->hits);
+  LUA_PUSH_ATTRIB_FLOAT("misses", cache->misses);
+  LUA_PUSH_ATTRIB_FLOAT("entries", cache->size());
+  LUA_PUSH_ATTRIB_FLOAT("bytes", cache->bytes());
+  return 1;
+}
+
+/*
+ * stats = db:compression_stats()
+ *    {compressor=name, bytes_out=n, bytes_out_compressed=n, bytes_in=n,
+ *    bytes_in_compressed=n} for the messages of pipelines and multiplexers,
+ *    the sizes before and after compression; compressor is nil when the
+ *    server accepted none. nil unless compressors were given to
+ *    Connection.New.
+ */
+static int dbclient_compression_stats(lua_State *L) {
+  WireCompression *compression = userdata_to_luadbclient(L, 1)->compression;
+  if (!compression) {
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_newtable(L);
+  const char *name = wire_compressor_name(compression->compressor);
+  if (name) {
+    LUA_PUSH_ATTRIB_STRING("compressor", name);
+  }
+  LUA_PUSH_ATTRIB_FLOAT("bytes_out", compression->bytesOut);
+  LUA_PUSH_ATTRIB_FLOAT("bytes_out_compressed", compression->bytesOutCompressed);
+  LUA_PUSH_ATTRIB_FLOAT("bytes_in", compression->bytesIn);
+  LUA_PUSH_ATTRIB_FLOAT("bytes_in_compressed", compression->bytesInCompressed);
+  return 1;
+}
+
+/*
+ * health = db:health()
+ *    {connected=bool, state="closed"|"open"|"half_open", failures=n,
+ *    total_failures=n, rejected=n, opened=n, retry_in_ms=ms, since_s=s,
+ *    last_error=str}, only connected without a breaker. failures counts the
+ *    consecutive connection failures, rejected the calls failed at once
+ *    and opened the times the circuit opened.
+ */
+static int dbclient_health(lua_State *L) {
+  LuaDBClient *db = userdata_to_luadbclient(L, 1);
+  lua_newtable(L);
+  LUA_PUSH_ATTRIB_BOOL("connected", db->client && !db->client->isFailed());
+  CircuitBreaker *breaker = db->breaker;
+  if (!breaker)
+    return 1;
+  double now = monotonic_time();
+  LUA_PUSH_ATTRIB_STRING("state", CircuitBreaker::state_name(breaker->state));
+  LUA_PUSH_ATTRIB_INT("failures", breaker->failures);
+  LUA_PUSH_ATTRIB_FLOAT("total_failures", breaker->totalFailures);
+  LUA_PUSH_ATTRIB_FLOAT("rejected", breaker->rejected);
+  LUA_PUSH_ATTRIB_FLOAT("opened", breaker->opened);
+  LUA_PUSH_ATTRIB_FLOAT("retry_in_ms", breaker->wait(now) * 1000);
+  if (breaker->since > 0) {
+    LUA_PUSH_ATTRIB_FLOAT("since_s", now - breaker->since);
+  }
+  if (!breaker->lastError.empty()) {
+    LUA_PUSH_ATTRIB_STRING("last_error", breaker->lastError.c_str());
+  }
+  return 1;
+}
+
+/*
+ * db:close()
+ *    closes the connection right away, cursors created by it can't be used
+ *    anymore
+ */
+static int dbclient_close(lua_State *L) {
+  dbclient_release(userdata_to_luadbclient(L, 1));
+  return 0;
+}
+
 // Method registration table for DBClients
 extern const luaL_Reg dbclient_methods[] = {
+  {"aggregate", dbclient_aggregate},
+  {"async", dbclient_async},
   {"auth", dbclient_auth},
+  {"bulk", dbclient_bulk},
+  {"cache_stats", dbclient_cache_stats},
+  {"close", dbclient_close},
+  {"compression_stats", dbclient_compression_stats},
   {"count", dbclient_count},
   {"drop_collection", dbclient_drop_collection},
   {"drop_index_by_fields", dbclient_drop_index_by_fields},
   {"drop_index_by_name", dbclient_drop_index_by_name},
   {"drop_indexes", dbclient_drop_indexes},
   {"create_index", dbclient_create_index},
+  {"enable_cache", dbclient_enable_cache},
   {"eval", dbclient_eval},
   {"exists", dbclient_exists},
+  {"export", dbclient_export},
+  {"find_and_modify", dbclient_find_and_modify},
+  {"find_many", dbclient_find_many},
   {"find_one", dbclient_find_one},
   {"gen_index_name", dbclient_gen_index_name},
   {"enumerate_indexes", dbclient_enumerate_indexes},
   {"get_last_error", dbclient_get_last_error},
   {"get_last_error_detailed", dbclient_get_last_error_detailed},
   {"get_server_address", dbclient_get_server_address},
+  {"health", dbclient_health},
   {"insert", dbclient_insert},
   {"insert_batch", dbclient_insert_batch},
+  {"insert_buffer", dbclient_insert_buffer},
   {"is_failed", dbclient_is_failed},
   {"mapreduce", dbclient_mapreduce},
+  {"mux", dbclient_mux},
+  {"pipeline", dbclient_pipeline},
+  {"prepare", dbclient_prepare},
+  {"prepare_find_and_modify", dbclient_prepare_find_and_modify},
   {"query", dbclient_query},
   {"reindex", dbclient_reindex},
   {"remove", dbclient_remove},
   // {"reset_index_cache", dbclient_reset_index_cache},
   {"run_command", dbclient_run_command},
+  {"set_read_pref", dbclient_set_read_pref},
   {"update", dbclient_update},
+  {"update_batch", dbclient_update_batch},
   {"get_dbnames", dbclient_get_dbnames},
   {"get_collections", dbclient_get_collections},
   {NULL, NULL}
@@ -0,0 +1,80 @@
+#ifndef LUAMONGO_DBCLIENT_H
+#define LUAMONGO_DBCLIENT_H
+
+#include <client/dbclient.h>
+#include <boost/shared_ptr.hpp>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+}
+
+class QueryCache;
+class ConnectionPool;
+class TopologyMonitor;
+class CircuitBreaker;
+struct WireCompression;
+
+/*
+ * arguments of a successful db:auth(), replayed by connections opened on
+ * behalf of a DBClient
+ */
+struct LuaCredential {
+    std::string dbname;
+    std::string username;
+    std::string password;
+    bool digestPassword;
+};
+
+bool same_credentials(const std::vector<LuaCredential> &a,
+                      const std::vector<LuaCredential> &b);
+
+/*
+ * Userdata of Connection and ReplicaSet objects. Finalizers of objects
+ * created from a DBClient (cursors) keep a pointer to it and the DBClient
+ * userdata is kept alive by them, so all its members are released explicitly
+ * by dbclient_release() instead of a destructor.
+ */
+struct LuaDBClient {
+    mongo::DBClientBase *client;
+    // NULL for replica sets
+    mongo::DBClientConnection *connection;
+    // cursors collected by __gc, killed on the next operation
+    std::vector<mongo::DBClientCursor*> *dead_cursors;
+    // find_one results, NULL unless enabled by db:enable_cache()
+    QueryCache *cache;
+    std::vector<LuaCredential> *credentials;
+    // $readPreference of the queries without one, NULL for the primary
+    mongo::BSONObj *read_pref;
+    // pool the client is given back to, NULL unless acquired from a Pool
+    boost::shared_ptr<ConnectionPool> *pool;
+    // member latencies of a replica set, NULL unless its monitor is enabled
+    TopologyMonitor *topology;
+    // reconnection policy of a Connection, NULL unless enabled
+    CircuitBreaker *breaker;
+    // compressors offered by a Connection, NULL unless enabled
+    WireCompression *compression;
+    // requests sent by Multiplexers whose reply has not been read yet
+    int multiplexed;
+};
+
+LuaDBClient* dbclient_push(lua_State *L, mongo::DBClientBase *client,
+                           mongo::DBClientConnection *connection, const char *tname);
+LuaDBClient* userdata_to_luadbclient(lua_State *L, int stackpos);
+mongo::DBClientBase* userdata_to_dbclient(lua_State *L, int stackpos);
+void dbclient_release(LuaDBClient *db);
+void dbclient_admit_methods(lua_State *L, const luaL_Reg *methods);
+
+void dbclient_defer_cursor(LuaDBClient *db, mongo::DBClientCursor *cursor);
+void dbclient_flush_cursors(LuaDBClient *db);
+void dbclient_track_cursor(LuaDBClient *db, mongo::DBClientCursor *cursor,
+                           mongo::DBClientBase *conn);
+void dbclient_delete_cursor(LuaDBClient *db, mongo::DBClientCursor *cursor);
+void dbclient_check_multiplexed(LuaDBClient *db);
+void dbclient_invalidate(LuaDBClient *db, const std::string &ns);
+mongo::DBClientBase* dbclient_route(LuaDBClient *db, const mongo::Query &query);
+bool dbclient_reconnect(LuaDBClient *db, std::string &error);
+
+#endif
@@ -3,32 +3,49 @@
 #include <client/gridfs.h>
 #include "utils.h"
 #include "common.h"
+#include "mongo_dbclient.h"
 
 using namespace mongo;
 
 extern void bson_to_lua(lua_State *L, const BSONObj &obj);
 extern void push_bsontype_table(lua_State* L, mongo::BSONType bsontype);
 extern void lua_push_value(lua_State *L, const BSONElement &elem);
+extern LuaDBClient* gridfs_owner(lua_State* L, int index);
 
 namespace {
-    inline GridFile* userdata_to_gridfile(lua_State* L, int index) {
-        void *ud = 0;
+    // GridFile userdata, owned by its GridFS
+    struct LuaGridFile {
+        GridFile *gridfile;
+        LuaDBClient *owner;
+    };
 
-        ud = luaL_checkudata(L, index, LUAMONGO_GRIDFILE);
-        GridFile *gridfile = *((GridFile **)ud);
+    inline GridFile* userdata_to_gridfile(lua_State* L, int index) {
+        LuaGridFile *ud = (LuaGridFile *)luaL_checkudata(L, index, LUAMONGO_GRIDFILE);
+        if (!ud->gridfile)
+            luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_GRIDFILE);
+        if (!ud->owner->client)
+            luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_DBCLIENT);
 
-        return gridfile;
+        return ud->gridfile;
     }
 }
 
-int gridfile_create(lua_State *L, GridFile gf) {
-    GridFile **gridfile = (GridFile **)lua_newuserdata(L, sizeof(GridFile **));
+/*
+ * pushes a GridFile userdata, owner is the stack index of its GridFS
+ */
+int gridfile_create(lua_State *L, GridFile gf, int owner) {
+    if (owner < 0) owner = lua_gettop(L) + owner + 1;
 
-    *gridfile = new GridFile(gf);
+    LuaGridFile *gridfile = (LuaGridFile *)lua_newuserdata(L, sizeof(LuaGridFile));
+    gridfile->gridfile = NULL;
+    gridfile->owner = gridfs_owner(L, owner);
 
     luaL_getmetatable(L, LUAMONGO_GRIDFILE);
     lua_setmetatable(L, -2);
 
+    gridfile->gridfile = new GridFile(gf);
+    lua_set_owner(L, -1, owner);
+
     return 1;
 }
 
@@ -206,12 +223,14 @@ static int gridfile_data(lua_State *L) {
 }
 
 /*
- * __gc
+ * gridfile:close()
+ * __gc, __close
  */
-static int gridfile_gc(lua_State *L) {
-    GridFile *gridfile = userdata_to_gridfile(L, 1);
+static int gridfile_close(lua_State *L) {
+    LuaGridFile *gridfile = (LuaGridFile *)luaL_checkudata(L, 1, LUAMONGO_GRIDFILE);
 
-    delete gridfile;
+    delete gridfile->gridfile;
+    gridfile->gridfile = NULL;
 
     return 0;
 }
@@ -220,7 +239,7 @@ static int gridfile_gc(lua_State *L) {
  * __tostring
  */
 static int gridfile_tostring(lua_State *L) {
-    GridFile *gridfile = userdata_to_gridfile(L, 1);
+    GridFile *gridfile = ((LuaGridFile *)luaL_checkudata(L, 1, LUAMONGO_GRIDFILE))->gridfile;
 
     lua_pushfstring(L, "%s: %p", LUAMONGO_GRIDFILE, gridfile);
 
@@ -241,6 +260,7 @@ int mongo_gridfile_register(lua_State *L) {
         {"upload_date", gridfile_upload_date},
         {"write", gridfile_write},
         {"data", gridfile_data},
+        {"close", gridfile_close},
         {NULL, NULL}
     };
 
@@ -254,9 +274,14 @@ int mongo_gridfile_register(lua_State *L) {
     lua_pushvalue(L,-1);
     lua_setfield(L, -2, "__index");
 
-    lua_pushcfunction(L, gridfile_gc);
+    lua_pushcfunction(L, gridfile_close);
     lua_setfield(L, -2, "__gc");
 
+#if LUA_VERSION_NUM >= 504
+    lua_pushcfunction(L, gridfile_close);
+    lua_setfield(L, -2, "__close");
+#endif
+
     lua_pushcfunction(L, gridfile_tostring);
     lua_setfield(L, -2, "__tostring");
 
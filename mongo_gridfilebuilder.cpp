@@ -2,28 +2,32 @@
 #include <client/dbclient.h>
 #include "utils.h"
 #include "common.h"
-
-// FIXME: client pointer is keep, review Lua binding in order to avoid
-// unexpected garbage collection of DBClientBase
+#include "mongo_dbclient.h"
 
 using namespace mongo;
 
 extern void lua_to_bson(lua_State *L, int stackpos, BSONObj &obj);
 extern void bson_to_lua(lua_State *L, const BSONObj &obj);
-extern int gridfile_create(lua_State *L, GridFile gf);
-extern DBClientBase* userdata_to_dbclient(lua_State *L, int stackpos);
 extern GridFS* userdata_to_gridfs(lua_State* L, int index);
+extern LuaDBClient* gridfs_owner(lua_State* L, int index);
 
 namespace {
+    // GridFileBuilder userdata, owned by its GridFS
+    struct LuaGridFileBuilder {
+	GridFileBuilder *builder;
+	LuaDBClient *owner;
+    };
+
     inline GridFileBuilder* userdata_to_gridfilebuilder(lua_State* L,
 							int index) {
-	void *ud = 0;
+	LuaGridFileBuilder *ud;
+	ud = (LuaGridFileBuilder *)luaL_checkudata(L, index, LUAMONGO_GRIDFILEBUILDER);
+	if (!ud->builder)
+	    luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_GRIDFILEBUILDER);
+	if (!ud->owner->client)
+	    luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_DBCLIENT);
     
-	ud = luaL_checkudata(L, index, LUAMONGO_GRIDFILEBUILDER);
-	GridFileBuilder *gridfilebuilder;
-	gridfilebuilder = *((GridFileBuilder **)ud);
-    
-	return gridfilebuilder;
+	return ud->builder;
     }
 } // anonymous namespace
 
@@ -35,11 +39,14 @@ static int gridfilebuilder_new(lua_State *L) {
     GridFS *gridfs = userdata_to_gridfs(L, 1);
   
     try {
-	GridFileBuilder **builder;
-	builder = (GridFileBuilder **)lua_newuserdata(L, sizeof(GridFileBuilder *));
-	*builder = new GridFileBuilder(gridfs);
+	LuaGridFileBuilder *builder;
+	builder = (LuaGridFileBuilder *)lua_newuserdata(L, sizeof(LuaGridFileBuilder));
+	builder->builder = NULL;
+	builder->owner = gridfs_owner(L, 1);
 	luaL_getmetatable(L, LUAMONGO_GRIDFILEBUILDER);
 	lua_setmetatable(L, -2);
+	builder->builder = new GridFileBuilder(gridfs);
+	lua_set_owner(L, -1, 1);
     } catch (std::exception &e) {
 	lua_pushnil(L);
 	lua_pushfstring(L, LUAMONGO_ERR_CONNECTION_FAILED, e.what());
@@ -92,13 +99,16 @@ static int gridfilebuilder_build(lua_State *L) {
 }
 
 /*
- * __gc
+ * builder:close()
+ *    discards the chunks not yet built into a file
+ * __gc, __close
  */
-static int gridfilebuilder_gc(lua_State *L) {
-    GridFileBuilder *builder;
-    builder = userdata_to_gridfilebuilder(L, 1);
+static int gridfilebuilder_close(lua_State *L) {
+    LuaGridFileBuilder *builder;
+    builder = (LuaGridFileBuilder *)luaL_checkudata(L, 1, LUAMONGO_GRIDFILEBUILDER);
   
-    delete builder;
+    delete builder->builder;
+    builder->builder = NULL;
 
     return 0;
 }
@@ -108,7 +118,7 @@ static int gridfilebuilder_gc(lua_State *L) {
  */
 static int gridfilebuilder_tostring(lua_State *L) {
     GridFileBuilder *builder;
-    builder = userdata_to_gridfilebuilder(L, 1);
+    builder = ((LuaGridFileBuilder *)luaL_checkudata(L, 1, LUAMONGO_GRIDFILEBUILDER))->builder;
     
     lua_pushfstring(L, "%s: %p", LUAMONGO_GRIDFILEBUILDER, builder);
     
@@ -120,6 +130,7 @@ int mongo_gridfilebuilder_register(lua_State *L) {
 	{"append", gridfilebuilder_append},
 	{"write", gridfilebuilder_append},
 	{"build", gridfilebuilder_build},
+	{"close", gridfilebuilder_close},
 	{NULL, NULL}
     };
 
@@ -134,9 +145,14 @@ int mongo_gridfilebuilder_register(lua_State *L) {
     lua_pushvalue(L,-1);
     lua_setfield(L, -2, "__index");
 
-    lua_pushcfunction(L, gridfilebuilder_gc);
+    lua_pushcfunction(L, gridfilebuilder_close);
     lua_setfield(L, -2, "__gc");
 
+#if LUA_VERSION_NUM >= 504
+    lua_pushcfunction(L, gridfilebuilder_close);
+    lua_setfield(L, -2, "__close");
+#endif
+
     lua_pushcfunction(L, gridfilebuilder_tostring);
     lua_setfield(L, -2, "__tostring");
     
@@ -3,24 +3,40 @@
 #include <client/gridfs.h>
 #include "utils.h"
 #include "common.h"
-
-// FIXME: GridFS pointer is keep in GridFile objects, review Lua binding in
-// order to avoid unexpected garbage collection of GridFS pointer
+#include "mongo_dbclient.h"
 
 using namespace mongo;
 
 extern void lua_to_bson(lua_State *L, int stackpos, BSONObj &obj);
 extern void bson_to_lua(lua_State *L, const BSONObj &obj);
-extern int gridfile_create(lua_State *L, GridFile gf);
-extern DBClientBase* userdata_to_dbclient(lua_State *L, int stackpos);
+extern int gridfile_create(lua_State *L, GridFile gf, int owner);
+extern int cursor_push(lua_State *L, DBClientCursor *cursor, int owner, int maxBatchBytes);
+
+namespace {
+/*
+ * GridFS userdata. The GridFS keeps a reference to the client of its
+ * DBClient, which is its owner; GridFile and GridFileBuilder objects are in
+ * turn owned by the GridFS.
+ */
+struct LuaGridFS {
+    GridFS *gridfs;
+    LuaDBClient *owner;
+};
+}
 
 GridFS* userdata_to_gridfs(lua_State* L, int index) {
-    void *ud = 0;
-    
-    ud = luaL_checkudata(L, index, LUAMONGO_GRIDFS);
-    GridFS *gridfs = *((GridFS **)ud);
-    
-    return gridfs;
+    LuaGridFS *ud = (LuaGridFS *)luaL_checkudata(L, index, LUAMONGO_GRIDFS);
+    if (!ud->owner->client)
+        luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_DBCLIENT);
+
+    return ud->gridfs;
+}
+
+/*
+ * the DBClient of the GridFS at index, for the objects created from it
+ */
+LuaDBClient* gridfs_owner(lua_State* L, int index) {
+    return ((LuaGridFS *)luaL_checkudata(L, index, LUAMONGO_GRIDFS))->owner;
 }
 
 /*
@@ -34,18 +50,22 @@ static int gridfs_new(lua_State *L) {
         DBClientBase *connection = userdata_to_dbclient(L, 1);
         const char *dbname = lua_tostring(L, 2);
 
-        GridFS **gridfs = (GridFS **)lua_newuserdata(L, sizeof(GridFS *));
+        LuaGridFS *gridfs = (LuaGridFS *)lua_newuserdata(L, sizeof(LuaGridFS));
+        gridfs->gridfs = NULL;
+        gridfs->owner = userdata_to_luadbclient(L, 1);
 
         if (n >= 3) {
             const char *prefix = luaL_checkstring(L, 3);
 
-            *gridfs = new GridFS(*connection, dbname, prefix);
+            gridfs->gridfs = new GridFS(*connection, dbname, prefix);
         } else {
-            *gridfs = new GridFS(*connection, dbname);
+            gridfs->gridfs = new GridFS(*connection, dbname);
         }
 
         luaL_getmetatable(L, LUAMONGO_GRIDFS);
         lua_setmetatable(L, -2);
+
+        lua_set_owner(L, -1, 1);
     } catch (std::exception &e) {
         lua_pushnil(L);
         lua_pushfstring(L, LUAMONGO_ERR_GRIDFS_FAILED, e.what());
@@ -58,7 +78,9 @@ static int gridfs_new(lua_State *L) {
 
 
 /*
- * gridfile, err = gridfs:find_file(query)
+ * gridfile, err = gridfs:find_file(lua_table/query_obj/filename)
+ *    the read preference of a query_obj applies to the files collection,
+ *    chunks are read by the driver from the primary
  */
 static int gridfs_find_file(lua_State *L) {
     GridFS *gridfs = userdata_to_gridfs(L, 1);
@@ -71,10 +93,14 @@ static int gridfs_find_file(lua_State *L) {
                 BSONObj obj;
                 lua_to_bson(L, 2, obj);
                 GridFile gridfile = gridfs->findFile(obj);
-                resultcount = gridfile_create(L, gridfile);
+                resultcount = gridfile_create(L, gridfile, 1);
+            } else if (type == LUA_TUSERDATA) {
+                Query *query = *((Query **)luaL_checkudata(L, 2, LUAMONGO_QUERY));
+                GridFile gridfile = gridfs->findFile(*query);
+                resultcount = gridfile_create(L, gridfile, 1);
             } else {
                 GridFile gridfile = gridfs->findFile(luaL_checkstring(L, 2));
-                resultcount = gridfile_create(L, gridfile);
+                resultcount = gridfile_create(L, gridfile, 1);
             }
 
         } catch (std::exception &e) {
@@ -98,7 +124,7 @@ static int gridfs_find_file_by_name(lua_State *L) {
     if (!lua_isnoneornil(L, 2)) {
 	try {
 	    GridFile gridfile = gridfs->findFileByName(luaL_checkstring(L, 2));
-	    resultcount = gridfile_create(L, gridfile);
+	    resultcount = gridfile_create(L, gridfile, 1);
 	    
         } catch (std::exception &e) {
             lua_pushnil(L);
@@ -133,14 +159,9 @@ static int gridfs_list(lua_State *L) {
         return 2;
     }
 
-    DBClientCursor **cursor = (DBClientCursor **)lua_newuserdata(L, sizeof(DBClientCursor *));
-    *cursor = autocursor.get();
-    autocursor.release();
-
-    luaL_getmetatable(L, LUAMONGO_CURSOR);
-    lua_setmetatable(L, -2);
-
-    return 1;
+    // its connection, so the cursor is killed out of the garbage collector
+    lua_push_owner(L, 1);
+    return cursor_push(L, autocursor.release(), -1, 0);
 }
 
 /*
@@ -220,9 +241,10 @@ static int gridfs_store_data(lua_State *L) {
  * __gc
  */
 static int gridfs_gc(lua_State *L) {
-    GridFS *gridfs = userdata_to_gridfs(L, 1);
+    LuaGridFS *gridfs = (LuaGridFS *)luaL_checkudata(L, 1, LUAMONGO_GRIDFS);
 
-    delete gridfs;
+    delete gridfs->gridfs;
+    gridfs->gridfs = NULL;
 
     return 0;
 }
@@ -231,7 +253,7 @@ static int gridfs_gc(lua_State *L) {
  * __tostring
  */
 static int gridfs_tostring(lua_State *L) {
-    GridFS *gridfs = userdata_to_gridfs(L, 1);
+    GridFS *gridfs = ((LuaGridFS *)luaL_checkudata(L, 1, LUAMONGO_GRIDFS))->gridfs;
 
     lua_pushfstring(L, "%s: %p", LUAMONGO_GRIDFS, gridfs);
 
@@ -12,6 +12,8 @@ namespace {
 
         ud = luaL_checkudata(L, index, LUAMONGO_GRIDFSCHUNK);
         GridFSChunk *chunk = *((GridFSChunk **)ud);
+        if (!chunk)
+            luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_GRIDFSCHUNK);
 
         return chunk;
     }
@@ -47,12 +49,14 @@ static int gridfschunk_len(lua_State *L) {
 
 
 /*
- * __gc
+ * chunk:close()
+ * __gc, __close
  */
-static int gridfschunk_gc(lua_State *L) {
-    GridFSChunk *chunk = userdata_to_gridfschunk(L, 1);
+static int gridfschunk_close(lua_State *L) {
+    GridFSChunk **chunk = (GridFSChunk **)luaL_checkudata(L, 1, LUAMONGO_GRIDFSCHUNK);
 
-    delete chunk;
+    delete *chunk;
+    *chunk = NULL;
 
     return 0;
 }
@@ -61,7 +65,7 @@ static int gridfschunk_gc(lua_State *L) {
  * __tostring
  */
 static int gridfschunk_tostring(lua_State *L) {
-    GridFSChunk *chunk = userdata_to_gridfschunk(L, 1);
+    GridFSChunk *chunk = *((GridFSChunk **)luaL_checkudata(L, 1, LUAMONGO_GRIDFSCHUNK));
 
     lua_pushfstring(L, "%s: %p", LUAMONGO_GRIDFSCHUNK, chunk);
 
@@ -72,6 +76,7 @@ int mongo_gridfschunk_register(lua_State *L) {
     static const luaL_Reg gridfschunk_methods[] = {
         {"data", gridfschunk_data},
         {"len", gridfschunk_len},
+        {"close", gridfschunk_close},
         {NULL, NULL}
     };
 
@@ -85,9 +90,14 @@ int mongo_gridfschunk_register(lua_State *L) {
     lua_pushvalue(L,-1);
     lua_setfield(L, -2, "__index");
 
-    lua_pushcfunction(L, gridfschunk_gc);
+    lua_pushcfunction(L, gridfschunk_close);
     lua_setfield(L, -2, "__gc");
 
+#if LUA_VERSION_NUM >= 504
+    lua_pushcfunction(L, gridfschunk_close);
+    lua_setfield(L, -2, "__close");
+#endif
+
     lua_pushcfunction(L, gridfschunk_tostring);
     lua_setfield(L, -2, "__tostring");
 
@@ -0,0 +1,319 @@
+#include <client/dbclient.h>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "utils.h"
+#include "common.h"
+#include "mongo_dbclient.h"
+#include "mongo_bulk.h"
+
+using namespace mongo;
+
+extern double monotonic_time();
+extern bool lua_to_bson_ordered(lua_State *L, int index, BSONObj &object);
+
+namespace {
+    /*
+     * Documents encoded by add() and not sent yet, flushed when one of the
+     * limits is reached. A limit of 0 is disabled.
+     */
+    struct InsertBuffer {
+        LuaDBClient *owner;
+        std::string ns;
+        bool ordered;
+        size_t maxDocs;
+        size_t maxBytes;
+        double maxDelay; // seconds
+        std::vector<WriteOp> docs;
+        size_t bytes;
+        // time of the first pending document
+        double since;
+
+        InsertBuffer(LuaDBClient *owner, const std::string &ns, bool ordered,
+                     size_t maxDocs, size_t maxBytes, double maxDelay) :
+            owner(owner), ns(ns), ordered(ordered), maxDocs(maxDocs),
+            maxBytes(maxBytes), maxDelay(maxDelay), bytes(0), since(0) { }
+
+        bool due() const {
+            if (docs.empty())
+                return false;
+            return (maxDocs && docs.size() >= maxDocs) ||
+                (maxBytes && bytes >= maxBytes) ||
+                (maxDelay > 0 && monotonic_time() - since >= maxDelay);
+        }
+
+        /*
+         * sends the pending documents, the ones which got a write error or
+         * were not sent stay pending for the next flush
+         */
+        void flush(WriteOpsResult &result) {
+            std::vector<WriteOp> pending;
+            pending.swap(docs);
+            bytes = 0;
+            if (pending.empty())
+                return;
+
+            try {
+                dbclient_check_multiplexed(owner);
+                dbclient_flush_cursors(owner);
+                dbclient_invalidate(owner, ns);
+                write_ops_execute(owner->client, ns, pending, ordered,
+                                  owner->client->getWriteConcern(), result);
+            } catch (...) {
+                // the documents after the acknowledged ones are unknown
+                keep_failed(pending, result, result.nInserted + result.writeErrors.size());
+                throw;
+            }
+            keep_failed(pending, result, pending.size());
+        }
+
+        /*
+         * puts back the documents of pending with a write error and the
+         * ones from index unsent, which is also the first error of an
+         * ordered flush
+         */
+        void keep_failed(const std::vector<WriteOp> &pending, const WriteOpsResult &result,
+                         size_t unsent) {
+            std::vector<bool> failed(pending.size(), false);
+            for (size_t i = 0; i < result.writeErrors.size(); ++i) {
+                size_t index = result.writeErrors[i]["index"].numberLong() - 1;
+                if (index < pending.size()) {
+                    failed[index] = true;
+                    if (ordered && index < unsent)
+                        unsent = index;
+                }
+            }
+            for (size_t i = 0; i < pending.size(); ++i) {
+                if (failed[i] || i >= unsent) {
+                    docs.push_back(pending[i]);
+                    bytes += pending[i].entry.objsize();
+                }
+            }
+            if (!docs.empty())
+                since = monotonic_time();
+        }
+    };
+
+    inline InsertBuffer* userdata_to_insert_buffer(lua_State *L, int index) {
+        void *ud = 0;
+
+        ud = luaL_checkudata(L, index, LUAMONGO_INSERTBUFFER);
+        InsertBuffer *buffer = *((InsertBuffer **)ud);
+        if (!buffer)
+            luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_INSERTBUFFER);
+        if (!buffer->owner->client)
+            luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_DBCLIENT);
+
+        return buffer;
+    }
+
+    int push_flush(lua_State *L, InsertBuffer *buffer, const char *name) {
+        try {
+            WriteOpsResult result;
+            buffer->flush(result);
+            write_ops_result_push(L, result);
+            return 1;
+        } catch (std::exception &e) {
+            lua_pushnil(L);
+            lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_INSERTBUFFER, name, e.what());
+            return 2;
+        }
+    }
+}
+
+/*
+ * creates an InsertBuffer for the DBClient at index owner, keeping it alive
+ */
+int insert_buffer_create(lua_State *L, int owner, const char *ns, bool ordered,
+                         size_t maxDocs, size_t maxBytes, double maxDelay) {
+    LuaDBClient *db = userdata_to_luadbclient(L, owner);
+
+    InsertBuffer **buffer = (InsertBuffer **)lua_newuserdata(L, sizeof(InsertBuffer *));
+    *buffer = new InsertBuffer(db, ns, ordered, maxDocs, maxBytes, maxDelay);
+
+    luaL_getmetatable(L, LUAMONGO_INSERTBUFFER);
+    lua_setmetatable(L, -2);
+
+    lua_set_owner(L, lua_gettop(L), owner);
+
+    return 1;
+}
+
+/*
+ * result,err = buffer:add(json_str/lua_table)
+ *    encodes the document and queues it; true if no limit was reached,
+ *    otherwise the result of the flush that followed, as buffer:flush()
+ */
+static int insert_buffer_add(lua_State *L) {
+    InsertBuffer *buffer = userdata_to_insert_buffer(L, 1);
+
+    try {
+        BSONObj doc;
+        if (!lua_to_bson_ordered(L, 2, doc)) {
+            throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+        }
+        if (!doc.hasField("_id")) {
+            // a document sent again after a failed flush keeps its _id
+            BSONObjBuilder b;
+            b.genOID();
+            b.appendElements(doc);
+            doc = b.obj();
+        }
+        if (buffer->docs.empty())
+            buffer->since = monotonic_time();
+        buffer->docs.push_back(WriteOp(WriteOp::WRITE_INSERT, doc));
+        buffer->bytes += doc.objsize();
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_INSERTBUFFER, "add", e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_INSERTBUFFER, "add", err);
+        return 2;
+    }
+
+    if (buffer->due())
+        return push_flush(L, buffer, "add");
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * result,err = buffer:flush()
+ *    sends the pending documents, result is the one of bulk:execute();
+ *    documents in writeErrors, the ones an ordered flush did not reach and
+ *    the ones not acknowledged when an error is returned stay pending
+ */
+static int insert_buffer_flush(lua_State *L) {
+    InsertBuffer *buffer = userdata_to_insert_buffer(L, 1);
+
+    return push_flush(L, buffer, "flush");
+}
+
+/*
+ * result,err = buffer:poll()
+ *    flushes if a limit was reached, nothing is sent between calls, so idle
+ *    writers should call it from their event loop to honour max_delay_ms;
+ *    false if nothing was sent
+ */
+static int insert_buffer_poll(lua_State *L) {
+    InsertBuffer *buffer = userdata_to_insert_buffer(L, 1);
+
+    if (buffer->due())
+        return push_flush(L, buffer, "poll");
+
+    lua_pushboolean(L, 0);
+    return 1;
+}
+
+/*
+ * n = buffer:count()
+ *    number of pending documents
+ */
+static int insert_buffer_count(lua_State *L) {
+    InsertBuffer *buffer = userdata_to_insert_buffer(L, 1);
+
+    lua_pushinteger(L, buffer->docs.size());
+
+    return 1;
+}
+
+/*
+ * n = buffer:clear()
+ *    drops the pending documents, returns their number
+ */
+static int insert_buffer_clear(lua_State *L) {
+    InsertBuffer *buffer = userdata_to_insert_buffer(L, 1);
+
+    lua_pushinteger(L, buffer->docs.size());
+    buffer->docs.clear();
+    buffer->bytes = 0;
+
+    return 1;
+}
+
+/*
+ * __gc
+ *    pending documents are not sent, a write from the collector would
+ *    stall it and lose its errors; check buffer:count() before dropping it
+ */
+static int insert_buffer_gc(lua_State *L) {
+    InsertBuffer **buffer = (InsertBuffer **)luaL_checkudata(L, 1, LUAMONGO_INSERTBUFFER);
+
+    delete *buffer;
+    *buffer = NULL;
+
+    return 0;
+}
+
+#if LUA_VERSION_NUM >= 504
+/*
+ * __close
+ *    flushes the pending documents, raising the error of a failed flush
+ */
+static int insert_buffer_close(lua_State *L) {
+    InsertBuffer *buffer = *((InsertBuffer **)luaL_checkudata(L, 1, LUAMONGO_INSERTBUFFER));
+
+    if (buffer && buffer->owner->client && push_flush(L, buffer, "close") == 2)
+        lua_error(L);
+
+    return 0;
+}
+#endif
+
+/*
+ * __tostring
+ */
+static int insert_buffer_tostring(lua_State *L) {
+    InsertBuffer *buffer = *((InsertBuffer **)luaL_checkudata(L, 1, LUAMONGO_INSERTBUFFER));
+
+    lua_pushfstring(L, "%s: %p", LUAMONGO_INSERTBUFFER, buffer);
+
+    return 1;
+}
+
+int mongo_insert_buffer_register(lua_State *L) {
+    static const luaL_Reg insert_buffer_methods[] = {
+        {"add", insert_buffer_add},
+        {"clear", insert_buffer_clear},
+        {"count", insert_buffer_count},
+        {"flush", insert_buffer_flush},
+        {"poll", insert_buffer_poll},
+        {NULL, NULL}
+    };
+
+    static const luaL_Reg insert_buffer_class_methods[] = {
+        {NULL, NULL}
+    };
+
+    luaL_newmetatable(L, LUAMONGO_INSERTBUFFER);
+    luaL_setfuncs(L, insert_buffer_methods, 0);
+    lua_pushvalue(L,-1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, insert_buffer_gc);
+    lua_setfield(L, -2, "__gc");
+
+#if LUA_VERSION_NUM >= 504
+    lua_pushcfunction(L, insert_buffer_close);
+    lua_setfield(L, -2, "__close");
+#endif
+
+    lua_pushcfunction(L, insert_buffer_tostring);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pushcfunction(L, insert_buffer_count);
+    lua_setfield(L, -2, "__len");
+
+    lua_pop(L,1);
+
+    #if LUA_VERSION_NUM < 502
+    luaL_register(L, LUAMONGO_INSERTBUFFER, insert_buffer_class_methods);
+    #else
+    luaL_newlib(L, insert_buffer_class_methods);
+    #endif
+
+    return 1;
+}
@@ -0,0 +1,771 @@
+#include <client/dbclient.h>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "utils.h"
+#include "common.h"
+#include "mongo_dbclient.h"
+#include "mongo_wire.h"
+
+using namespace mongo;
+
+extern void bson_to_lua(lua_State *L, const BSONObj &obj);
+extern bool lua_to_bson_ordered(lua_State *L, int index, BSONObj &object);
+extern bool lua_to_bson_ordered_query(lua_State *L, int index, Query &query);
+
+namespace {
+    /*
+     * every pipelined operation is a single batch query, commands are
+     * queries on the $cmd collection of their database
+     */
+    struct PipelineOp {
+        enum Type { FIND_ONE, COUNT, COMMAND };
+
+        Type type;
+        std::string ns;
+        BSONObj query;
+        BSONObj fields;
+        int options;
+
+        PipelineOp(Type type, const std::string &ns, const BSONObj &query,
+                   const BSONObj &fields, int options) :
+            type(type), ns(ns), query(query), fields(fields), options(options) { }
+    };
+
+    struct Pipeline {
+        LuaDBClient *owner;
+        std::vector<PipelineOp> ops;
+
+        Pipeline(LuaDBClient *owner) : owner(owner) { }
+    };
+
+    inline Pipeline* userdata_to_pipeline(lua_State *L, int index) {
+        void *ud = 0;
+
+        ud = luaL_checkudata(L, index, LUAMONGO_PIPELINE);
+        Pipeline *pipeline = *((Pipeline **)ud);
+        if (!pipeline->owner->client)
+            luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_DBCLIENT);
+
+        return pipeline;
+    }
+
+    /*
+     * requests sent by a Multiplexer and not consumed yet, by requestID
+     */
+    struct PendingOp {
+        PipelineOp op;
+        bool done;
+        WireReply reply;
+        // set instead of reply when the connection failed
+        std::string error;
+
+        PendingOp(const PipelineOp &op) : op(op), done(false) { }
+    };
+
+    struct Multiplexer {
+        LuaDBClient *owner;
+        std::map<int, PendingOp> pending;
+
+        Multiplexer(LuaDBClient *owner) : owner(owner) { }
+    };
+
+    inline Multiplexer* userdata_to_multiplexer(lua_State *L, int index) {
+        void *ud = 0;
+
+        ud = luaL_checkudata(L, index, LUAMONGO_MULTIPLEXER);
+        Multiplexer *mux = *((Multiplexer **)ud);
+        if (!mux)
+            luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_MULTIPLEXER);
+        if (!mux->owner->client)
+            luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_CONNECTION);
+
+        return mux;
+    }
+
+    /*
+     * waits for a reply in a coroutine by yielding once, letting the other
+     * coroutines send their requests before the socket is read
+     */
+    const char *multiplexer_await_chunk =
+        "local running, yield = coroutine.running, coroutine.yield\n"
+        "return function(self, id)\n"
+        "    local co, main = running()\n"
+        "    if co and not main and not self:ready(id) then yield(self, id) end\n"
+        "    return self:wait(id)\n"
+        "end\n";
+
+    std::string command_ns(const std::string &ns) {
+        return ns.substr(0, ns.find('.')) + ".$cmd";
+    }
+
+    // the compressor agreed with the server applies to the current socket
+    bool compressing(LuaDBClient *db) {
+        WireCompression *c = db->compression;
+        return c && c->compressor >= 0 &&
+               c->socket == db->connection->getSockCreationMicroSec();
+    }
+
+    // writes the query of op, compressed when agreed with the server,
+    // returns its requestID
+    int send_op(LuaDBClient *db, const PipelineOp &op) {
+        WireCompression *c = db->compression;
+        const BSONObj *fields = op.fields.isEmpty() ? NULL : &op.fields;
+        Message toSend;
+        if (compressing(db)) {
+            std::string msg = wire_encode_query(nextMessageId(), op.ns, op.query, 0, -1,
+                                                fields, op.options);
+            std::string compressed = wire_compress(msg.data(), (int)msg.size(),
+                                                   c->compressor, c->level);
+            // say() assigns the requestID of the OP_COMPRESSED header
+            toSend.setData(WIRE_OP_COMPRESSED, compressed.data() + WIRE_HEADER_SIZE,
+                           compressed.size() - WIRE_HEADER_SIZE);
+            c->bytesOut += msg.size();
+            c->bytesOutCompressed += compressed.size();
+        } else {
+            assembleQueryRequest(op.ns, op.query, -1, 0, fields, op.options, toSend);
+            if (c) {
+                c->bytesOut += wire_read_int32(toSend.buf());
+                c->bytesOutCompressed += wire_read_int32(toSend.buf());
+            }
+        }
+        db->connection->say(toSend);
+        return wire_request_id(toSend);
+    }
+
+    // the whole message of response, decompressed if it is an OP_COMPRESSED one
+    std::string open_message(LuaDBClient *db, Message &response) {
+        int len = wire_read_int32(response.buf());
+        std::string msg = wire_decompress(response.buf(), len);
+        if (db->compression) {
+            db->compression->bytesIn += msg.size();
+            db->compression->bytesInCompressed += len;
+        }
+        return msg;
+    }
+
+    void receive_reply(LuaDBClient *db, WireReply &reply) {
+        Message response;
+        if (!db->connection->recv(response)) {
+            throw std::runtime_error(LUAMONGO_ERR_CONNECTION_LOST);
+        }
+        std::string msg = open_message(db, response);
+        wire_decode_reply(msg.data(), (int)msg.size(), reply);
+    }
+
+    /*
+     * reads the next reply and keeps it for its request. Once a reply can't
+     * be read or decoded the following ones can't be trusted: every pending
+     * request fails and the socket is shut down, so the driver marks the
+     * connection failed when it is used next.
+     */
+    int multiplexer_read(Multiplexer *mux) {
+        WireReply reply;
+        try {
+            receive_reply(mux->owner, reply);
+        } catch (std::exception &e) {
+            std::map<int, PendingOp>::iterator it;
+            for (it = mux->pending.begin(); it != mux->pending.end(); ++it) {
+                if (!it->second.done) {
+                    it->second.error = e.what();
+                    it->second.done = true;
+                    --mux->owner->multiplexed;
+                }
+            }
+            mux->owner->connection->port().shutdown();
+            throw;
+        }
+
+        std::map<int, PendingOp>::iterator it = mux->pending.find(reply.responseTo);
+        if (it != mux->pending.end() && !it->second.done) {
+            it->second.reply = reply;
+            it->second.done = true;
+            --mux->owner->multiplexed;
+        }
+        return reply.responseTo;
+    }
+
+    /*
+     * forgets the requests of mux. Their replies can't be told apart from
+     * the ones of the next calls on the connection, so its socket is shut
+     * down when some are still expected: the connection fails on its next
+     * use instead of reading them.
+     */
+    void multiplexer_abandon(Multiplexer *mux) {
+        LuaDBClient *db = mux->owner;
+        int inFlight = 0;
+        std::map<int, PendingOp>::iterator it;
+        for (it = mux->pending.begin(); it != mux->pending.end(); ++it) {
+            if (!it->second.done) ++inFlight;
+        }
+        mux->pending.clear();
+        if (inFlight > 0 && db->client) {
+            db->multiplexed -= inFlight;
+            db->connection->port().shutdown();
+        }
+    }
+
+    /*
+     * writes all the queries before reading any reply, replies are matched
+     * to their query by responseTo. Every reply is read even after an error,
+     * so the next request doesn't get the reply of this one; a failed say()
+     * or recv() leaves the connection failed in the driver instead.
+     */
+    void execute_pipelined(LuaDBClient *db,
+                           const std::vector<PipelineOp> &ops,
+                           std::vector<WireReply> &replies) {
+        std::vector<int> ids(ops.size());
+        std::vector<bool> answered(ops.size(), false);
+
+        for (size_t i = 0; i < ops.size(); ++i) {
+            ids[i] = send_op(db, ops[i]);
+        }
+
+        std::string error;
+        size_t received = 0;
+        while (received < ops.size()) {
+            Message response;
+            if (!db->connection->recv(response)) {
+                throw std::runtime_error(LUAMONGO_ERR_CONNECTION_LOST);
+            }
+
+            // copied to the header of compressed replies
+            int responseTo = wire_read_int32(response.buf() + 8);
+            size_t i = 0;
+            while (i < ids.size() && (answered[i] || ids[i] != responseTo)) ++i;
+            if (i == ids.size()) {
+                // left over by another request, skipped
+                if (error.empty()) error = "reply to an unknown request";
+                continue;
+            }
+            answered[i] = true;
+            ++received;
+
+            try {
+                std::string msg = open_message(db, response);
+                wire_decode_reply(msg.data(), (int)msg.size(), replies[i]);
+            } catch (std::exception &e) {
+                if (error.empty()) error = e.what();
+            }
+        }
+
+        if (!error.empty()) {
+            throw std::runtime_error(error);
+        }
+    }
+
+    /*
+     * replica sets choose a member per operation, so their operations are
+     * sent one by one
+     */
+    void execute_sequential(DBClientBase *client,
+                            const std::vector<PipelineOp> &ops,
+                            std::vector<WireReply> &replies) {
+        for (size_t i = 0; i < ops.size(); ++i) {
+            const PipelineOp &op = ops[i];
+            BSONObj doc = client->findOne(op.ns, Query(op.query),
+                                          op.fields.isEmpty() ? NULL : &op.fields,
+                                          op.options);
+            if (!doc.isEmpty()) {
+                replies[i].documents.push_back(doc.getOwned());
+                replies[i].nReturned = 1;
+            }
+        }
+    }
+
+    void push_result(lua_State *L, const PipelineOp &op, const WireReply &reply) {
+        wire_check_reply(reply);
+
+        if (op.type == PipelineOp::FIND_ONE) {
+            if (reply.documents.empty()) {
+                lua_pushnil(L);
+            } else {
+                bson_to_lua(L, reply.documents[0]);
+            }
+            return;
+        }
+
+        if (reply.documents.empty()) {
+            throw std::runtime_error("empty command reply");
+        }
+        const BSONObj &result = reply.documents[0];
+        if (!result["ok"].trueValue()) {
+            throw std::runtime_error(result["errmsg"].str());
+        }
+        if (op.type == PipelineOp::COUNT) {
+            lua_pushinteger(L, (lua_Integer)result["n"].numberLong());
+        } else {
+            bson_to_lua(L, result);
+        }
+    }
+
+    /*
+     * readers of the arguments, after the object at index 1, of the
+     * operations shared by Pipeline and Multiplexer
+     */
+    PipelineOp read_find_one(lua_State *L) {
+        const char *ns = luaL_checkstring(L, 2);
+        Query query;
+        if (!lua_isnoneornil(L, 3)) {
+            if (!lua_to_bson_ordered_query(L, 3, query)) {
+                throw (LUAMONGO_REQUIRES_QUERY);
+            }
+        }
+        BSONObj fields;
+        if (!lua_isnoneornil(L, 4)) {
+            if (!lua_to_bson_ordered(L, 4, fields)) {
+                throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+            }
+        }
+        int queryOptions = luaL_optint(L, 5, 0);
+
+        return PipelineOp(PipelineOp::FIND_ONE, ns, query.obj, fields, queryOptions);
+    }
+
+    PipelineOp read_count(lua_State *L) {
+        std::string ns = luaL_checkstring(L, 2);
+        BSONObj query;
+        if (!lua_isnoneornil(L, 3)) {
+            if (!lua_to_bson_ordered(L, 3, query)) {
+                throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+            }
+        }
+        size_t dot = ns.find('.');
+        if (dot == std::string::npos) {
+            throw ("invalid namespace");
+        }
+
+        BSONObjBuilder cmd;
+        cmd.append("count", ns.substr(dot + 1));
+        if (!query.isEmpty()) {
+            cmd.append("query", query);
+        }
+        return PipelineOp(PipelineOp::COUNT, command_ns(ns), cmd.obj(), BSONObj(), 0);
+    }
+
+    PipelineOp read_run_command(lua_State *L) {
+        std::string dbname = luaL_checkstring(L, 2);
+        BSONObj command;
+        if (!lua_to_bson_ordered(L, 3, command)) {
+            throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+        }
+        int options = luaL_optint(L, 4, 0);
+
+        return PipelineOp(PipelineOp::COMMAND, dbname + ".$cmd", command, BSONObj(), options);
+    }
+}
+
+/*
+ * creates an empty Pipeline for the DBClient at index owner, keeping it alive
+ */
+int pipeline_create(lua_State *L, int owner) {
+    LuaDBClient *db = userdata_to_luadbclient(L, owner);
+
+    Pipeline **pipeline = (Pipeline **)lua_newuserdata(L, sizeof(Pipeline *));
+    *pipeline = new Pipeline(db);
+
+    luaL_getmetatable(L, LUAMONGO_PIPELINE);
+    lua_setmetatable(L, -2);
+
+    lua_set_owner(L, lua_gettop(L), owner);
+
+    return 1;
+}
+
+/*
+ * ok,err = pipeline:find_one(ns, json_str/lua_table/query_obj, json_str/lua_table, options)
+ */
+static int pipeline_find_one(lua_State *L) {
+    Pipeline *pipeline = userdata_to_pipeline(L, 1);
+
+    try {
+        pipeline->ops.push_back(read_find_one(L));
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_PIPELINE, "find_one", e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_PIPELINE, "find_one", err);
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * ok,err = pipeline:count(ns, json_str/lua_table)
+ */
+static int pipeline_count(lua_State *L) {
+    Pipeline *pipeline = userdata_to_pipeline(L, 1);
+
+    try {
+        pipeline->ops.push_back(read_count(L));
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_PIPELINE, "count", e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_PIPELINE, "count", err);
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * ok,err = pipeline:run_command(dbname, json_str/lua_table(ordered), options)
+ */
+static int pipeline_run_command(lua_State *L) {
+    Pipeline *pipeline = userdata_to_pipeline(L, 1);
+
+    try {
+        pipeline->ops.push_back(read_run_command(L));
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_PIPELINE, "run_command", e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_PIPELINE, "run_command", err);
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+/*
+ * r1,r2,...,rn = pipeline:execute()
+ * nil,err      = pipeline:execute()
+ *    sends all the queued operations at once on a Connection and returns
+ *    their results in order: a table or nil for find_one, a number for count
+ *    and the reply table for run_command. Replica sets send them one by one.
+ *    The queue is emptied, so the object can be reused.
+ */
+static int pipeline_execute(lua_State *L) {
+    Pipeline *pipeline = userdata_to_pipeline(L, 1);
+
+    std::vector<PipelineOp> ops;
+    ops.swap(pipeline->ops);
+
+    try {
+        dbclient_check_multiplexed(pipeline->owner);
+        dbclient_flush_cursors(pipeline->owner);
+
+        std::vector<WireReply> replies(ops.size());
+        if (pipeline->owner->connection) {
+            execute_pipelined(pipeline->owner, ops, replies);
+        } else {
+            execute_sequential(pipeline->owner->client, ops, replies);
+        }
+
+        luaL_checkstack(L, ops.size(), "too many pipelined results");
+        for (size_t i = 0; i < ops.size(); ++i) {
+            push_result(L, ops[i], replies[i]);
+        }
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_PIPELINE, "execute", e.what());
+        return 2;
+    }
+
+    return ops.size();
+}
+
+/*
+ * __len, number of queued operations
+ */
+static int pipeline_len(lua_State *L) {
+    Pipeline *pipeline = userdata_to_pipeline(L, 1);
+
+    lua_pushinteger(L, pipeline->ops.size());
+
+    return 1;
+}
+
+/*
+ * __gc
+ */
+static int pipeline_gc(lua_State *L) {
+    Pipeline **pipeline = (Pipeline **)luaL_checkudata(L, 1, LUAMONGO_PIPELINE);
+
+    delete *pipeline;
+    *pipeline = NULL;
+
+    return 0;
+}
+
+/*
+ * __tostring
+ */
+static int pipeline_tostring(lua_State *L) {
+    Pipeline *pipeline = *((Pipeline **)luaL_checkudata(L, 1, LUAMONGO_PIPELINE));
+
+    lua_pushfstring(L, "%s: %p", LUAMONGO_PIPELINE, pipeline);
+
+    return 1;
+}
+
+/*
+ * creates a Multiplexer for the Connection at index owner, keeping it alive
+ */
+int multiplexer_create(lua_State *L, int owner) {
+    LuaDBClient *db = userdata_to_luadbclient(L, owner);
+
+    Multiplexer **mux = (Multiplexer **)lua_newuserdata(L, sizeof(Multiplexer *));
+    *mux = new Multiplexer(db);
+
+    luaL_getmetatable(L, LUAMONGO_MULTIPLEXER);
+    lua_setmetatable(L, -2);
+
+    lua_set_owner(L, lua_gettop(L), owner);
+
+    return 1;
+}
+
+static int multiplexer_send(lua_State *L, PipelineOp (*read)(lua_State *), const char *name) {
+    Multiplexer *mux = userdata_to_multiplexer(L, 1);
+
+    try {
+        PipelineOp op = read(L);
+        dbclient_flush_cursors(mux->owner);
+        int id = send_op(mux->owner, op);
+        mux->pending.insert(std::make_pair(id, PendingOp(op)));
+        ++mux->owner->multiplexed;
+        lua_pushinteger(L, id);
+        return 1;
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_MULTIPLEXER, name, e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_MULTIPLEXER, name, err);
+        return 2;
+    }
+}
+
+/*
+ * id,err = mux:find_one(ns, json_str/lua_table/query_obj, json_str/lua_table, options)
+ *    sends the query right away and returns its request id
+ */
+static int multiplexer_find_one(lua_State *L) {
+    return multiplexer_send(L, read_find_one, "find_one");
+}
+
+/*
+ * id,err = mux:count(ns, json_str/lua_table)
+ */
+static int multiplexer_count(lua_State *L) {
+    return multiplexer_send(L, read_count, "count");
+}
+
+/*
+ * id,err = mux:run_command(dbname, json_str/lua_table(ordered), options)
+ */
+static int multiplexer_run_command(lua_State *L) {
+    return multiplexer_send(L, read_run_command, "run_command");
+}
+
+/*
+ * id,err = mux:receive()
+ *    reads the next reply from the socket, keeping it for its request, and
+ *    returns the id of that request
+ */
+static int multiplexer_receive(lua_State *L) {
+    Multiplexer *mux = userdata_to_multiplexer(L, 1);
+
+    try {
+        lua_pushinteger(L, multiplexer_read(mux));
+        return 1;
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_MULTIPLEXER, "receive", e.what());
+        return 2;
+    }
+}
+
+/*
+ * ok = mux:ready(id)
+ *    true when the reply of request id has been received
+ */
+static int multiplexer_ready(lua_State *L) {
+    Multiplexer *mux = userdata_to_multiplexer(L, 1);
+    int id = luaL_checkint(L, 2);
+
+    std::map<int, PendingOp>::iterator it = mux->pending.find(id);
+    luaL_argcheck(L, it != mux->pending.end(), 2, "unknown request id");
+    lua_pushboolean(L, it->second.done);
+
+    return 1;
+}
+
+/*
+ * result,err = mux:wait(id)
+ *    reads replies, keeping the ones of other requests, until the one of
+ *    request id arrives and returns its result, like pipeline:execute().
+ *    After a receive error all the pending requests fail.
+ */
+static int multiplexer_wait(lua_State *L) {
+    Multiplexer *mux = userdata_to_multiplexer(L, 1);
+    int id = luaL_checkint(L, 2);
+
+    std::map<int, PendingOp>::iterator it = mux->pending.find(id);
+    luaL_argcheck(L, it != mux->pending.end(), 2, "unknown request id");
+
+    try {
+        while (!it->second.done) {
+            multiplexer_read(mux);
+        }
+        PendingOp op = it->second;
+        mux->pending.erase(it);
+        if (!op.error.empty()) {
+            throw std::runtime_error(op.error);
+        }
+        push_result(L, op.op, op.reply);
+        return 1;
+    } catch (std::exception &e) {
+        mux->pending.erase(id);
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_MULTIPLEXER, "wait", e.what());
+        return 2;
+    } catch (const char *err) {
+        mux->pending.erase(id);
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_MULTIPLEXER, "wait", err);
+        return 2;
+    }
+}
+
+/*
+ * n = mux:pending()
+ *    number of requests whose result has not been consumed
+ */
+static int multiplexer_pending(lua_State *L) {
+    Multiplexer *mux = userdata_to_multiplexer(L, 1);
+
+    lua_pushinteger(L, mux->pending.size());
+
+    return 1;
+}
+
+/*
+ * mux:close()
+ *    forgets the pending requests; when replies are still expected the
+ *    socket of the Connection is shut down, it fails on its next use
+ * __gc, __close
+ */
+static int multiplexer_close(lua_State *L) {
+    Multiplexer **mux = (Multiplexer **)luaL_checkudata(L, 1, LUAMONGO_MULTIPLEXER);
+
+    if (*mux) {
+        multiplexer_abandon(*mux);
+        delete *mux;
+        *mux = NULL;
+    }
+
+    return 0;
+}
+
+/*
+ * __tostring
+ */
+static int multiplexer_tostring(lua_State *L) {
+    Multiplexer *mux = *((Multiplexer **)luaL_checkudata(L, 1, LUAMONGO_MULTIPLEXER));
+
+    lua_pushfstring(L, "%s: %p", LUAMONGO_MULTIPLEXER, mux);
+
+    return 1;
+}
+
+int mongo_multiplexer_register(lua_State *L) {
+    static const luaL_Reg multiplexer_methods[] = {
+        {"close", multiplexer_close},
+        {"count", multiplexer_count},
+        {"find_one", multiplexer_find_one},
+        {"pending", multiplexer_pending},
+        {"ready", multiplexer_ready},
+        {"receive", multiplexer_receive},
+        {"run_command", multiplexer_run_command},
+        {"wait", multiplexer_wait},
+        {NULL, NULL}
+    };
+
+    static const luaL_Reg multiplexer_class_methods[] = {
+        {NULL, NULL}
+    };
+
+    luaL_newmetatable(L, LUAMONGO_MULTIPLEXER);
+    luaL_setfuncs(L, multiplexer_methods, 0);
+    if (luaL_loadstring(L, multiplexer_await_chunk) != 0) {
+        lua_error(L);
+    }
+    lua_call(L, 0, 1);
+    lua_setfield(L, -2, "await");
+    lua_pushvalue(L,-1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, multiplexer_close);
+    lua_setfield(L, -2, "__gc");
+
+#if LUA_VERSION_NUM >= 504
+    lua_pushcfunction(L, multiplexer_close);
+    lua_setfield(L, -2, "__close");
+#endif
+
+    lua_pushcfunction(L, multiplexer_tostring);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pop(L,1);
+
+    #if LUA_VERSION_NUM < 502
+    luaL_register(L, LUAMONGO_MULTIPLEXER, multiplexer_class_methods);
+    #else
+    luaL_newlib(L, multiplexer_class_methods);
+    #endif
+
+    return 1;
+}
+
+int mongo_pipeline_register(lua_State *L) {
+    static const luaL_Reg pipeline_methods[] = {
+        {"count", pipeline_count},
+        {"execute", pipeline_execute},
+        {"find_one", pipeline_find_one},
+        {"run_command", pipeline_run_command},
+        {NULL, NULL}
+    };
+
+    static const luaL_Reg pipeline_class_methods[] = {
+        {NULL, NULL}
+    };
+
+    luaL_newmetatable(L, LUAMONGO_PIPELINE);
+    luaL_setfuncs(L, pipeline_methods, 0);
+    lua_pushvalue(L,-1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, pipeline_gc);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pushcfunction(L, pipeline_tostring);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pushcfunction(L, pipeline_len);
+    lua_setfield(L, -2, "__len");
+
+    lua_pop(L,1);
+
+    #if LUA_VERSION_NUM < 502
+    luaL_register(L, LUAMONGO_PIPELINE, pipeline_class_methods);
+    #else
+    luaL_newlib(L, pipeline_class_methods);
+    #endif
+
+    return 1;
+}
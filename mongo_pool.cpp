@@ -0,0 +1,700 @@
+#include <client/dbclient.h>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/thread_time.hpp>
+#include <boost/thread/tss.hpp>
+#include <algorithm>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "utils.h"
+#include "common.h"
+#include "mongo_dbclient.h"
+#include "mongo_pool.h"
+
+using namespace mongo;
+
+extern double monotonic_time();
+extern bool lua_to_write_concern(lua_State *L, int index, WriteConcern &wc);
+extern void background_thread_start(const boost::function<void ()> &body);
+
+namespace {
+    // period of the maintenance thread, in milliseconds
+    const long MAINTENANCE_INTERVAL = 1000;
+    // longest wait of acquire() between two looks at the idle lists, a
+    // bound on the delay of a wakeup missed by release()
+    const long WAIT_SLICE = 10;
+
+    // each thread gets a number, the index of its home shard in every pool
+    boost::thread_specific_ptr<long> thread_number;
+    boost::detail::atomic_count thread_count(0);
+
+    bool ping(DBClientBase *client) {
+        try {
+            BSONObj info;
+            return client->simpleCommand("admin", &info, "ping");
+        } catch (std::exception &) {
+            return false;
+        }
+    }
+}
+
+ConnectionPool::ConnectionPool(const std::string &uri, const PoolOptions &options) :
+    address(uri), opts(options), wakeup(new Wakeup()), open(0), waiters(0),
+    closed(false), created(0), failed(0), reaped(0) {
+    std::string errmsg;
+    cs = ConnectionString::parse(uri, errmsg);
+    if (!cs.isValid()) {
+        throw std::runtime_error(errmsg);
+    }
+    if (cs.type() != ConnectionString::MASTER && cs.type() != ConnectionString::SET) {
+        throw std::runtime_error("a server or a replica set connection string is required");
+    }
+    if (opts.shards < 1) {
+        opts.shards = 1;
+    }
+    for (size_t i = 0; i < opts.shards; ++i) {
+        shards.push_back(new Shard());
+    }
+}
+
+ConnectionPoolPtr ConnectionPool::create(const std::string &uri, const PoolOptions &options) {
+    ConnectionPoolPtr pool(new ConnectionPool(uri, options));
+    background_thread_start(boost::bind(&ConnectionPool::maintain,
+                                        boost::weak_ptr<ConnectionPool>(pool), pool->wakeup));
+    return pool;
+}
+
+ConnectionPool::~ConnectionPool() {
+    close();
+    for (size_t i = 0; i < shards.size(); ++i) {
+        delete shards[i];
+    }
+}
+
+ConnectionPool::Shard& ConnectionPool::home() {
+    if (!thread_number.get()) {
+        thread_number.reset(new long(++thread_count));
+    }
+    return *shards[*thread_number % shards.size()];
+}
+
+DBClientBase* ConnectionPool::connect() {
+    std::string errmsg;
+    std::auto_ptr<DBClientBase> client(cs.connect(errmsg, opts.rwTimeout));
+    if (!client.get()) {
+        throw std::runtime_error(errmsg);
+    }
+    for (size_t i = 0; i < opts.credentials.size(); ++i) {
+        const LuaCredential &c = opts.credentials[i];
+        if (!client->auth(c.dbname, c.username, c.password, errmsg, c.digestPassword)) {
+            throw std::runtime_error(errmsg);
+        }
+    }
+    if (opts.hasWriteConcern) {
+        client->setWriteConcern(opts.wc);
+    }
+    return client.release();
+}
+
+/*
+ * takes an idle connection from the home shard of the thread, then from the
+ * other shards which are not locked, and opens a new one when there is none
+ * and less than maxSize are open
+ */
+DBClientBase* ConnectionPool::acquire(double timeout) {
+    boost::system_time deadline = boost::get_system_time() +
+        boost::posix_time::milliseconds((long)(timeout * 1000));
+    Shard &first = home();
+    size_t start = std::find(shards.begin(), shards.end(), &first) - shards.begin();
+
+    for (;;) {
+        DBClientBase *client = NULL;
+        double checked = 0;
+        for (size_t i = 0; i < shards.size() && !client; ++i) {
+            Shard &shard = *shards[(start + i) % shards.size()];
+            boost::mutex::scoped_try_lock lock(shard.mutex, boost::defer_lock);
+            if (i == 0) lock.lock(); else lock.try_lock();
+            if (lock.owns_lock() && !shard.idle.empty()) {
+                client = shard.idle.back().client;
+                checked = shard.idle.back().checked;
+                shard.idle.pop_back();
+                ++shard.inUse;
+            }
+        }
+
+        if (client) {
+            if (!client->isFailed() &&
+                (opts.validateAfterIdle <= 0 ||
+                 monotonic_time() - checked < opts.validateAfterIdle ||
+                 ping(client))) {
+                return client;
+            }
+            discard(client, true);
+            continue;
+        }
+
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            if (closed) {
+                throw std::runtime_error("pool closed");
+            }
+            if (open >= opts.maxSize) {
+                boost::system_time now = boost::get_system_time();
+                if (now >= deadline) {
+                    return NULL;
+                }
+                ++waiters;
+                available.timed_wait(lock, std::min(deadline, now +
+                                     boost::posix_time::milliseconds(WAIT_SLICE)));
+                --waiters;
+                continue;
+            }
+            ++open;
+        }
+
+        try {
+            client = connect();
+        } catch (...) {
+            boost::mutex::scoped_lock lock(mutex);
+            --open;
+            throw;
+        }
+        {
+            boost::mutex::scoped_lock lock(first.mutex);
+            ++first.inUse;
+        }
+        boost::mutex::scoped_lock lock(mutex);
+        ++created;
+        return client;
+    }
+}
+
+void ConnectionPool::release(DBClientBase *client, const std::vector<LuaCredential> &credentials) {
+    if (client->isFailed()) {
+        discard(client, true);
+        return;
+    }
+    // another user could read through it
+    if (!same_credentials(credentials, opts.credentials)) {
+        discard(client, false);
+        return;
+    }
+    client->setWriteConcern(opts.wc);
+    double now = monotonic_time();
+    give_back(home(), Idle(client, now, now));
+}
+
+/*
+ * puts back a connection in the idle list of shard, it is closed if the
+ * pool was closed
+ */
+void ConnectionPool::give_back(Shard &shard, const Idle &entry) {
+    {
+        boost::mutex::scoped_lock lock(shard.mutex);
+        --shard.inUse;
+        if (!shard.closed) {
+            shard.idle.push_back(entry);
+            lock.unlock();
+            if (waiters) {
+                boost::mutex::scoped_lock pool_lock(mutex);
+                available.notify_one();
+            }
+            return;
+        }
+    }
+    delete entry.client;
+    boost::mutex::scoped_lock lock(mutex);
+    --open;
+}
+
+/*
+ * closes an acquired connection, counted in failed on a failure
+ */
+void ConnectionPool::discard(DBClientBase *client, bool failure) {
+    delete client;
+    {
+        boost::mutex::scoped_lock lock(home().mutex);
+        --home().inUse;
+    }
+    boost::mutex::scoped_lock lock(mutex);
+    --open;
+    if (failure) ++failed;
+    available.notify_one();
+}
+
+void ConnectionPool::close() {
+    std::vector<DBClientBase *> closing;
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        closed = true;
+        for (size_t i = 0; i < shards.size(); ++i) {
+            boost::mutex::scoped_lock shard_lock(shards[i]->mutex);
+            shards[i]->closed = true;
+            for (size_t j = 0; j < shards[i]->idle.size(); ++j) {
+                closing.push_back(shards[i]->idle[j].client);
+            }
+            open -= shards[i]->idle.size();
+            shards[i]->idle.clear();
+        }
+    }
+    available.notify_all();
+    {
+        boost::mutex::scoped_lock lock(wakeup->mutex);
+        wakeup->stopped = true;
+    }
+    wakeup->stopping.notify_all();
+    for (size_t i = 0; i < closing.size(); ++i) {
+        delete closing[i];
+    }
+}
+
+PoolStats ConnectionPool::stats() {
+    PoolStats s;
+    s.idle = 0;
+    s.inUse = 0;
+    boost::mutex::scoped_lock lock(mutex);
+    for (size_t i = 0; i < shards.size(); ++i) {
+        boost::mutex::scoped_lock shard_lock(shards[i]->mutex);
+        s.idle += shards[i]->idle.size();
+        s.inUse += shards[i]->inUse;
+    }
+    s.open = open;
+    s.created = created;
+    s.failed = failed;
+    s.reaped = reaped;
+    return s;
+}
+
+/*
+ * body of the maintenance thread, a round every MAINTENANCE_INTERVAL until
+ * the pool is closed or destroyed
+ */
+void ConnectionPool::maintain(const boost::weak_ptr<ConnectionPool> &pool,
+                              const boost::shared_ptr<Wakeup> &wakeup) {
+    for (;;) {
+        {
+            boost::mutex::scoped_lock lock(wakeup->mutex);
+            boost::system_time next = boost::get_system_time() +
+                boost::posix_time::milliseconds(MAINTENANCE_INTERVAL);
+            while (!wakeup->stopped && wakeup->stopping.timed_wait(lock, next)) {
+            }
+            if (wakeup->stopped) return;
+        }
+        ConnectionPoolPtr current = pool.lock();
+        if (!current || !current->maintain_once()) return;
+    }
+}
+
+/*
+ * one round of maintenance, false once the pool is closed
+ */
+bool ConnectionPool::maintain_once() {
+    std::vector<DBClientBase *> expired;
+    std::vector<std::pair<Shard *, Idle> > checking;
+    size_t missing = 0;
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        if (closed) return false;
+
+        double now = monotonic_time();
+        for (size_t i = 0; i < shards.size(); ++i) {
+            Shard &shard = *shards[i];
+            boost::mutex::scoped_lock shard_lock(shard.mutex);
+            // the least recently released come first
+            while (opts.maxIdle > 0 && !shard.idle.empty() && open > opts.minSize &&
+                   now - shard.idle.front().since >= opts.maxIdle) {
+                expired.push_back(shard.idle.front().client);
+                shard.idle.pop_front();
+                --open;
+                ++reaped;
+            }
+            if (opts.validateAfterIdle > 0) {
+                std::deque<Idle> fresh;
+                for (size_t j = 0; j < shard.idle.size(); ++j) {
+                    if (now - shard.idle[j].checked >= opts.validateAfterIdle) {
+                        checking.push_back(std::make_pair(&shard, shard.idle[j]));
+                    } else {
+                        fresh.push_back(shard.idle[j]);
+                    }
+                }
+                shard.idle.swap(fresh);
+            }
+        }
+        if (open < opts.minSize) {
+            missing = opts.minSize - open;
+            open += missing;
+        }
+    }
+
+    for (size_t i = 0; i < expired.size(); ++i) {
+        delete expired[i];
+    }
+
+    for (size_t i = 0; i < checking.size(); ++i) {
+        Shard &shard = *checking[i].first;
+        Idle &entry = checking[i].second;
+        bool alive = ping(entry.client);
+        if (alive) {
+            boost::mutex::scoped_lock lock(shard.mutex);
+            if (!shard.closed) {
+                entry.checked = monotonic_time();
+                // keeps the idle connections sorted by release time
+                std::deque<Idle>::iterator it = shard.idle.begin();
+                while (it != shard.idle.end() && it->since <= entry.since) ++it;
+                shard.idle.insert(it, entry);
+                continue;
+            }
+        }
+        delete entry.client;
+        boost::mutex::scoped_lock lock(mutex);
+        --open;
+        if (!alive) ++failed;
+    }
+
+    for (size_t i = 0; i < missing; ++i) {
+        DBClientBase *client = NULL;
+        try {
+            client = connect();
+        } catch (std::exception &) {
+        }
+        if (client) {
+            Shard &shard = *shards[i % shards.size()];
+            double now = monotonic_time();
+            // counted in use, give_back() decrements it
+            {
+                boost::mutex::scoped_lock lock(shard.mutex);
+                ++shard.inUse;
+            }
+            give_back(shard, Idle(client, now, now));
+            boost::mutex::scoped_lock lock(mutex);
+            ++created;
+        } else {
+            boost::mutex::scoped_lock lock(mutex);
+            --open;
+        }
+    }
+    return true;
+}
+
+/***********************************************************************/
+// mongo.Pool
+/***********************************************************************/
+
+namespace {
+    inline ConnectionPoolPtr& userdata_to_pool(lua_State *L, int index) {
+        return **((ConnectionPoolPtr **)luaL_checkudata(L, index, LUAMONGO_POOL));
+    }
+
+    /*
+     * releases the connection after fn returned, raising its error again
+     */
+    const char *pool_with_chunk =
+        "local error, pcall = error, pcall\n"
+        "local function finish(self, conn, ok, ...)\n"
+        "    self:release(conn)\n"
+        "    if not ok then error((...), 0) end\n"
+        "    return ...\n"
+        "end\n"
+        "return function(self, fn, timeout)\n"
+        "    local conn, err = self:acquire(timeout)\n"
+        "    if not conn then return nil, err end\n"
+        "    return finish(self, conn, pcall(fn, conn))\n"
+        "end\n";
+}
+
+/*
+ * pushes a Connection or ReplicaSet object for a connection of pool,
+ * closing it gives the connection back to pool
+ */
+void pool_push_client(lua_State *L, const ConnectionPoolPtr &pool, DBClientBase *client) {
+    DBClientConnection *connection = dynamic_cast<DBClientConnection *>(client);
+    LuaDBClient *db = dbclient_push(L, client, connection,
+                                    connection ? LUAMONGO_CONNECTION : LUAMONGO_REPLICASET);
+    *db->credentials = pool->options().credentials;
+    db->pool = new ConnectionPoolPtr(pool);
+}
+
+namespace {
+    /*
+     * reads the options of mongo.Pool.New() from the table at index
+     */
+    void read_pool_options(lua_State *L, int index, std::string &uri, PoolOptions &options) {
+        lua_getfield(L, index, "uri");
+        uri = luaL_checkstring(L, -1);
+        lua_getfield(L, index, "min");
+        options.minSize = luaL_optint(L, -1, options.minSize);
+        lua_getfield(L, index, "max");
+        options.maxSize = luaL_optint(L, -1, options.maxSize);
+        lua_getfield(L, index, "max_idle_ms");
+        options.maxIdle = luaL_optnumber(L, -1, options.maxIdle * 1000) / 1000;
+        lua_getfield(L, index, "validate_after_idle_ms");
+        options.validateAfterIdle = luaL_optnumber(L, -1, options.validateAfterIdle * 1000) / 1000;
+        lua_getfield(L, index, "rw_timeout");
+        options.rwTimeout = luaL_optnumber(L, -1, 0);
+        lua_getfield(L, index, "shards");
+        options.shards = luaL_optint(L, -1, options.shards);
+        lua_getfield(L, index, "write_concern");
+        options.hasWriteConcern = lua_to_write_concern(L, lua_gettop(L), options.wc);
+        lua_getfield(L, index, "auth");
+        if (lua_istable(L, -1)) {
+            int auth = lua_gettop(L);
+            LuaCredential c;
+            lua_getfield(L, auth, "dbname");
+            c.dbname = luaL_checkstring(L, -1);
+            lua_getfield(L, auth, "username");
+            c.username = luaL_checkstring(L, -1);
+            lua_getfield(L, auth, "password");
+            c.password = luaL_checkstring(L, -1);
+            lua_getfield(L, auth, "digest");
+            c.digestPassword = lua_isnil(L, -1) || lua_toboolean(L, -1);
+            lua_pop(L, 4);
+            options.credentials.push_back(c);
+        }
+        lua_pop(L, 9);
+        if (options.maxSize < 1 || options.minSize > options.maxSize) {
+            throw "invalid min or max";
+        }
+    }
+
+    void push_pool(lua_State *L, const ConnectionPoolPtr &pool) {
+        ConnectionPoolPtr **ud = (ConnectionPoolPtr **)lua_newuserdata(L, sizeof(ConnectionPoolPtr *));
+        *ud = NULL;
+        luaL_getmetatable(L, LUAMONGO_POOL);
+        lua_setmetatable(L, -2);
+        *ud = new ConnectionPoolPtr(pool);
+    }
+}
+
+/*
+ * pool,err = mongo.Pool.New{uri=connection_str, ...}
+ *    accepts a table of options:
+ *       uri                     a server "host:port" or a replica set
+ *                               "name/host1,host2" connection string
+ *       min                     (default = 0) connections kept open
+ *       max                     (default = 16) connections open at once
+ *       max_idle_ms             (default = 60000) idle connections beyond min
+ *                               are closed after this delay, 0 keeps them
+ *       validate_after_idle_ms  (default = 5000) idle connections are pinged
+ *                               in the background and on acquire after it
+ *       rw_timeout              (default = 0) socket timeout in seconds
+ *       shards                  (default = 1) idle lists, each with its own
+ *                               lock, for pools used by many threads
+ *       write_concern           (default = {w=1}) {w=n|"majority", j=bool, wtimeout=ms}
+ *       auth                    {dbname=, username=, password=, digest=true}
+ *                               used by every new connection
+ */
+static int pool_new(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+
+    try {
+        std::string uri;
+        PoolOptions options;
+        read_pool_options(L, 1, uri, options);
+        push_pool(L, ConnectionPool::create(uri, options));
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_POOL_FAILED, e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_POOL_FAILED, err);
+        return 2;
+    }
+
+    return 1;
+}
+
+/*
+ * pool,err = mongo.Pool.shared(name[, options])
+ *    the pool registered as name for the whole process, created with the
+ *    options of mongo.Pool.New() by the first call, from any Lua state and
+ *    thread. shards defaults to the number of cores. It stays open until
+ *    mongo.Pool.drop(name).
+ */
+static int pool_shared(lua_State *L) {
+    std::string name = luaL_checkstring(L, 1);
+
+    try {
+        ConnectionPoolPtr pool = shared_pool_find(name);
+        if (!pool) {
+            if (!lua_istable(L, 2)) {
+                throw "no shared pool with this name";
+            }
+            std::string uri;
+            PoolOptions options;
+            options.shards = std::max(1u, boost::thread::hardware_concurrency());
+            read_pool_options(L, 2, uri, options);
+            // another thread may have registered one meanwhile
+            pool = shared_pool_insert(name, ConnectionPool::create(uri, options));
+        } else if (lua_istable(L, 2)) {
+            lua_getfield(L, 2, "uri");
+            const char *uri = lua_tostring(L, -1);
+            if (uri && pool->uri() != uri) {
+                throw "shared pool already registered with another uri";
+            }
+            lua_pop(L, 1);
+        }
+        push_pool(L, pool);
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_POOL_FAILED, e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_POOL_FAILED, err);
+        return 2;
+    }
+
+    return 1;
+}
+
+/*
+ * ok = mongo.Pool.drop(name)
+ *    unregisters a shared pool, it is closed once no Lua state uses it
+ */
+static int pool_drop(lua_State *L) {
+    lua_pushboolean(L, shared_pool_drop(luaL_checkstring(L, 1)));
+
+    return 1;
+}
+
+/*
+ * db,err = pool:acquire([timeout])
+ *    an idle connection or a new one, waiting up to timeout seconds
+ *    (default = 0) when max connections are in use. The Connection or
+ *    ReplicaSet goes back to the pool on pool:release(db), db:close() or
+ *    when it is collected.
+ */
+static int pool_acquire(lua_State *L) {
+    ConnectionPoolPtr &pool = userdata_to_pool(L, 1);
+    double timeout = luaL_optnumber(L, 2, 0);
+
+    try {
+        DBClientBase *client = pool->acquire(timeout);
+        if (!client) {
+            lua_pushnil(L);
+            lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_POOL, "acquire", "timeout");
+            return 2;
+        }
+        pool_push_client(L, pool, client);
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_POOL, "acquire", e.what());
+        return 2;
+    }
+
+    return 1;
+}
+
+/*
+ * pool:release(db)
+ *    gives back a connection of the pool, db is closed
+ */
+static int pool_release(lua_State *L) {
+    ConnectionPoolPtr &pool = userdata_to_pool(L, 1);
+    LuaDBClient *db = userdata_to_luadbclient(L, 2);
+    luaL_argcheck(L, db->pool && db->pool->get() == pool.get(), 2,
+                  "connection not acquired from this pool");
+
+    dbclient_release(db);
+
+    return 0;
+}
+
+/*
+ * stats = pool:stats()
+ *    {open=n, idle=n, in_use=n, created=n, failed=n, reaped=n}
+ */
+static int pool_stats(lua_State *L) {
+    PoolStats stats = userdata_to_pool(L, 1)->stats();
+
+    lua_newtable(L);
+    LUA_PUSH_ATTRIB_INT("open", stats.open);
+    LUA_PUSH_ATTRIB_INT("idle", stats.idle);
+    LUA_PUSH_ATTRIB_INT("in_use", stats.inUse);
+    LUA_PUSH_ATTRIB_FLOAT("created", stats.created);
+    LUA_PUSH_ATTRIB_FLOAT("failed", stats.failed);
+    LUA_PUSH_ATTRIB_FLOAT("reaped", stats.reaped);
+
+    return 1;
+}
+
+/*
+ * pool:close()
+ *    closes the idle connections, the acquired ones are closed when they
+ *    are released
+ */
+static int pool_close(lua_State *L) {
+    userdata_to_pool(L, 1)->close();
+
+    return 0;
+}
+
+/*
+ * __gc
+ */
+static int pool_gc(lua_State *L) {
+    ConnectionPoolPtr **pool = (ConnectionPoolPtr **)luaL_checkudata(L, 1, LUAMONGO_POOL);
+
+    delete *pool;
+    *pool = NULL;
+
+    return 0;
+}
+
+/*
+ * __tostring
+ */
+static int pool_tostring(lua_State *L) {
+    ConnectionPoolPtr &pool = userdata_to_pool(L, 1);
+
+    lua_pushfstring(L, "%s: %s", LUAMONGO_POOL, pool->uri().c_str());
+
+    return 1;
+}
+
+int mongo_pool_register(lua_State *L) {
+    static const luaL_Reg pool_methods[] = {
+        {"acquire", pool_acquire},
+        {"close", pool_close},
+        {"release", pool_release},
+        {"stats", pool_stats},
+        {NULL, NULL}
+    };
+
+    static const luaL_Reg pool_class_methods[] = {
+        {"New", pool_new},
+        {"drop", pool_drop},
+        {"shared", pool_shared},
+        {NULL, NULL}
+    };
+
+    luaL_newmetatable(L, LUAMONGO_POOL);
+    luaL_setfuncs(L, pool_methods, 0);
+    if (luaL_loadstring(L, pool_with_chunk) != 0) {
+        lua_error(L);
+    }
+    lua_call(L, 0, 1);
+    lua_setfield(L, -2, "with");
+    lua_pushvalue(L,-1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, pool_gc);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pushcfunction(L, pool_tostring);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pop(L,1);
+
+    #if LUA_VERSION_NUM < 502
+    luaL_register(L, LUAMONGO_POOL, pool_class_methods);
+    #else
+    luaL_newlib(L, pool_class_methods);
+    #endif
+
+    return 1;
+}
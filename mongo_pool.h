@@ -0,0 +1,142 @@
+#ifndef LUAMONGO_POOL_H
+#define LUAMONGO_POOL_H
+
+#include <client/dbclient.h>
+#include <boost/detail/atomic_count.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <deque>
+#include <string>
+#include <vector>
+#include "mongo_dbclient.h"
+
+struct PoolOptions {
+    size_t minSize;
+    size_t maxSize;
+    // seconds, idle connections beyond minSize are closed after maxIdle,
+    // they are pinged when unused for validateAfterIdle; 0 disables them
+    double maxIdle;
+    double validateAfterIdle;
+    double rwTimeout;
+    // number of idle lists, each thread uses its own one first
+    size_t shards;
+    std::vector<LuaCredential> credentials;
+    bool hasWriteConcern;
+    mongo::WriteConcern wc;
+
+    PoolOptions() : minSize(0), maxSize(16), maxIdle(60), validateAfterIdle(5),
+                    rwTimeout(0), shards(1), hasWriteConcern(false) { }
+};
+
+class ConnectionPool;
+typedef boost::shared_ptr<ConnectionPool> ConnectionPoolPtr;
+
+struct PoolStats {
+    size_t open;
+    size_t idle;
+    long inUse;
+    unsigned long long created;
+    unsigned long long failed;
+    unsigned long long reaped;
+};
+
+/*
+ * Connections to one server or replica set shared by Lua objects, Lua
+ * states and threads. Idle connections are kept in several lists, each one
+ * with its own lock, so that threads only contend on the pool lock to open
+ * or close connections. A maintenance thread closes the connections idle
+ * for too long, pings the idle ones and opens new ones to keep minSize
+ * connections. It only holds the pool during a round, so the last owner
+ * never waits for it; closing the pool wakes it up and it is joined once
+ * it returned or when the module is unloaded.
+ */
+class ConnectionPool {
+public:
+    static ConnectionPoolPtr create(const std::string &uri, const PoolOptions &options);
+    ~ConnectionPool();
+
+    // an idle or a new connection, NULL if maxSize connections are still in
+    // use after timeout seconds
+    mongo::DBClientBase* acquire(double timeout);
+    // takes back a connection from acquire() authenticated with
+    // credentials, it is closed if it failed or if they are not the ones
+    // of the pool; its write concern is reset to the one of the pool
+    void release(mongo::DBClientBase *client, const std::vector<LuaCredential> &credentials);
+    // closes a connection from acquire() which can't be reused, counted in
+    // failed on a failure
+    void discard(mongo::DBClientBase *client, bool failure);
+    // closes the idle connections, the ones in use are closed when released
+    void close();
+
+    PoolStats stats();
+    const std::string& uri() const { return address; }
+    const PoolOptions& options() const { return opts; }
+
+private:
+    struct Idle {
+        mongo::DBClientBase *client;
+        // last release and last successful check
+        double since;
+        double checked;
+
+        Idle(mongo::DBClientBase *client, double since, double checked) :
+            client(client), since(since), checked(checked) { }
+    };
+
+    // shared with the maintenance thread, which outlives the pool
+    struct Wakeup {
+        boost::mutex mutex;
+        boost::condition_variable stopping;
+        bool stopped;
+
+        Wakeup() : stopped(false) { }
+    };
+
+    struct Shard {
+        boost::mutex mutex;
+        // most recently released last
+        std::deque<Idle> idle;
+        // acquired minus released here, the sum over shards is the number of
+        // connections in use
+        long inUse;
+        bool closed;
+
+        Shard() : inUse(0), closed(false) { }
+    };
+
+    std::string address;
+    mongo::ConnectionString cs;
+    PoolOptions opts;
+    std::vector<Shard *> shards;
+    boost::shared_ptr<Wakeup> wakeup;
+
+    // guards the members below, taken after a Shard mutex is released or
+    // before it is taken
+    boost::mutex mutex;
+    boost::condition_variable available;
+    // connections idle, in use, being opened or being checked
+    size_t open;
+    // threads waiting for a connection, read by release() without the lock
+    boost::detail::atomic_count waiters;
+    bool closed;
+    unsigned long long created;
+    unsigned long long failed;
+    unsigned long long reaped;
+
+    ConnectionPool(const std::string &uri, const PoolOptions &options);
+    Shard& home();
+    mongo::DBClientBase* connect();
+    void give_back(Shard &shard, const Idle &entry);
+    static void maintain(const boost::weak_ptr<ConnectionPool> &pool,
+                         const boost::shared_ptr<Wakeup> &wakeup);
+    bool maintain_once();
+};
+
+// pools shared by all the Lua states of the process, by name
+ConnectionPoolPtr shared_pool_find(const std::string &name);
+ConnectionPoolPtr shared_pool_insert(const std::string &name, const ConnectionPoolPtr &pool);
+bool shared_pool_drop(const std::string &name);
+
+#endif
@@ -0,0 +1,293 @@
+#include <client/dbclient.h>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "utils.h"
+#include "common.h"
+#include "mongo_dbclient.h"
+
+using namespace mongo;
+
+extern void bson_to_lua(lua_State *L, const BSONObj &obj);
+extern void lua_append_value(lua_State *L, const char *key, int stackpos, BSONObjBuilder &builder);
+
+namespace {
+    /*
+     * Part of an object of the skeleton: consecutive elements without
+     * placeholders, copied as they were encoded, a placeholder, or an
+     * embedded object or array containing placeholders
+     */
+    struct Segment {
+        enum Kind { COPY, SLOT, OBJECT, ARRAY };
+
+        Kind kind;
+        // bytes of the skeleton copied by a COPY segment
+        int offset;
+        int length;
+        // field name of the others
+        std::string name;
+        // stack position of the argument of a SLOT
+        int arg;
+        // segments of an OBJECT or an ARRAY
+        std::vector<Segment> children;
+
+        Segment(Kind kind) : kind(kind), offset(0), length(0), arg(0) { }
+    };
+
+    /*
+     * A command encoded once, whose placeholder values are replaced by the
+     * arguments of run(). The segments of the skeleton are computed once
+     * too, so run() only encodes the arguments and copies the bytes around
+     * them.
+     */
+    struct PreparedCommand {
+        LuaDBClient *owner;
+        std::string dbname;
+        BSONObj skeleton;
+        int options;
+        // namespace whose cached queries run() invalidates, empty for reads
+        std::string written;
+        // field of the reply returned by run(), the whole reply if empty
+        std::string result;
+        // number of placeholders, run() needs as many arguments
+        int nargs;
+        std::vector<Segment> segments;
+
+        PreparedCommand(LuaDBClient *owner, const std::string &dbname, int options) :
+            owner(owner), dbname(dbname), options(options), nargs(0) { }
+    };
+
+    inline PreparedCommand* userdata_to_prepared(lua_State *L, int index) {
+        void *ud = 0;
+
+        ud = luaL_checkudata(L, index, LUAMONGO_PREPARED);
+        PreparedCommand *prepared = *((PreparedCommand **)ud);
+        if (!prepared->owner->client)
+            luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_DBCLIENT);
+
+        return prepared;
+    }
+
+    /*
+     * the segments of obj, an object of skeleton; used receives the
+     * positions of the arguments of its placeholders. Returns true if it
+     * has any placeholder.
+     */
+    bool split(const BSONObj &skeleton, const BSONObj &obj, const std::map<std::string, int> &names,
+               std::vector<Segment> &segments, std::set<int> &used) {
+        bool found = false;
+
+        BSONObjIterator it(obj);
+        while (it.more()) {
+            BSONElement elem = it.next();
+
+            if (elem.type() == String) {
+                std::map<std::string, int>::const_iterator name = names.find(elem.str());
+                if (name != names.end()) {
+                    Segment slot(Segment::SLOT);
+                    slot.name = elem.fieldName();
+                    slot.arg = name->second;
+                    segments.push_back(slot);
+                    used.insert(name->second);
+                    found = true;
+                    continue;
+                }
+            } else if (elem.type() == Object || elem.type() == Array) {
+                Segment sub(elem.type() == Array ? Segment::ARRAY : Segment::OBJECT);
+                if (split(skeleton, elem.embeddedObject(), names, sub.children, used)) {
+                    sub.name = elem.fieldName();
+                    segments.push_back(sub);
+                    found = true;
+                    continue;
+                }
+            }
+
+            // extends the previous copy when it ends right before elem
+            int offset = elem.rawdata() - skeleton.objdata();
+            if (segments.empty() || segments.back().kind != Segment::COPY ||
+                segments.back().offset + segments.back().length != offset) {
+                Segment copy(Segment::COPY);
+                copy.offset = offset;
+                segments.push_back(copy);
+            }
+            segments.back().length += elem.size();
+        }
+
+        return found;
+    }
+
+    /*
+     * appends segments to builder, encoding only the arguments of the slots
+     */
+    void splice(lua_State *L, const PreparedCommand *prepared, const std::vector<Segment> &segments,
+                BSONObjBuilder &builder) {
+        for (size_t i = 0; i < segments.size(); ++i) {
+            const Segment &segment = segments[i];
+            switch (segment.kind) {
+            case Segment::COPY:
+                builder.bb().appendBuf(prepared->skeleton.objdata() + segment.offset, segment.length);
+                break;
+            case Segment::SLOT:
+                lua_append_value(L, segment.name.c_str(), segment.arg, builder);
+                break;
+            case Segment::OBJECT:
+            case Segment::ARRAY: {
+                BSONObjBuilder sub(segment.kind == Segment::ARRAY ?
+                                   builder.subarrayStart(segment.name) :
+                                   builder.subobjStart(segment.name));
+                splice(L, prepared, segment.children, sub);
+                sub.done();
+                break;
+            }
+            }
+        }
+    }
+}
+
+/*
+ * creates a PreparedCommand for the DBClient at index owner, placeholders
+ * are string values of command equal to one of names, replaced by the
+ * argument i of run() for names[i]. Every name must appear in command.
+ * run() invalidates the cached queries of written unless it is empty, and
+ * returns the result field of the reply (nil if it is not a document), or
+ * the whole reply if result is empty.
+ */
+int prepared_create(lua_State *L, int owner, const std::string &dbname, const BSONObj &command,
+                    const std::vector<std::string> &names, int options,
+                    const std::string &written, const std::string &result) {
+    LuaDBClient *db = userdata_to_luadbclient(L, owner);
+
+    std::map<std::string, int> positions;
+    for (size_t i = 0; i < names.size(); ++i) {
+        positions[names[i]] = i + 2;
+    }
+
+    std::auto_ptr<PreparedCommand> prepared(new PreparedCommand(db, dbname, options));
+    prepared->skeleton = command.getOwned();
+    prepared->written = written;
+    prepared->result = result;
+    prepared->nargs = names.size();
+    std::set<int> used;
+    split(prepared->skeleton, prepared->skeleton, positions, prepared->segments, used);
+
+    for (size_t i = 0; i < names.size(); ++i) {
+        if (!used.count(i + 2)) {
+            throw std::runtime_error("placeholder " + names[i] + " does not appear in the command");
+        }
+    }
+
+    PreparedCommand **ud = (PreparedCommand **)lua_newuserdata(L, sizeof(PreparedCommand *));
+    *ud = prepared.release();
+
+    luaL_getmetatable(L, LUAMONGO_PREPARED);
+    lua_setmetatable(L, -2);
+
+    lua_set_owner(L, lua_gettop(L), owner);
+
+    return 1;
+}
+
+/*
+ * res,err = prepared:run(...)
+ *    runs the command with its placeholders replaced by the arguments, one
+ *    per placeholder
+ */
+static int prepared_run(lua_State *L) {
+    PreparedCommand *prepared = userdata_to_prepared(L, 1);
+    int nargs = lua_gettop(L) - 1;
+    if (nargs < prepared->nargs) {
+        luaL_argerror(L, nargs + 2, "value expected for every placeholder");
+    }
+
+    try {
+        BSONObjBuilder builder(prepared->skeleton.objsize() + 64);
+        splice(L, prepared, prepared->segments, builder);
+        BSONObj command = builder.obj();
+
+        dbclient_check_multiplexed(prepared->owner);
+        dbclient_flush_cursors(prepared->owner);
+        if (!prepared->written.empty()) {
+            dbclient_invalidate(prepared->owner, prepared->written);
+        }
+        BSONObj retval;
+        if (!prepared->owner->client->runCommand(prepared->dbname, command, retval, prepared->options))
+            throw std::runtime_error(retval["errmsg"].str());
+
+        if (prepared->result.empty()) {
+            bson_to_lua(L, retval);
+        } else {
+            BSONElement value = retval[prepared->result];
+            if (value.type() == Object) {
+                bson_to_lua(L, value.embeddedObject());
+            } else {
+                lua_pushnil(L);
+            }
+        }
+        return 1;
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_PREPARED, "run", e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_PREPARED, "run", err);
+        return 2;
+    }
+}
+
+/*
+ * __gc
+ */
+static int prepared_gc(lua_State *L) {
+    PreparedCommand **prepared = (PreparedCommand **)luaL_checkudata(L, 1, LUAMONGO_PREPARED);
+
+    delete *prepared;
+    *prepared = NULL;
+
+    return 0;
+}
+
+/*
+ * __tostring
+ */
+static int prepared_tostring(lua_State *L) {
+    PreparedCommand *prepared = *((PreparedCommand **)luaL_checkudata(L, 1, LUAMONGO_PREPARED));
+
+    lua_pushfstring(L, "%s: %s", LUAMONGO_PREPARED, prepared->skeleton.toString().c_str());
+
+    return 1;
+}
+
+int mongo_prepared_register(lua_State *L) {
+    static const luaL_Reg prepared_methods[] = {
+        {"run", prepared_run},
+        {NULL, NULL}
+    };
+
+    static const luaL_Reg prepared_class_methods[] = {
+        {NULL, NULL}
+    };
+
+    luaL_newmetatable(L, LUAMONGO_PREPARED);
+    luaL_setfuncs(L, prepared_methods, 0);
+    lua_pushvalue(L,-1);
+    lua_setfield(L, -2, "__index");
+
+    lua_pushcfunction(L, prepared_gc);
+    lua_setfield(L, -2, "__gc");
+
+    lua_pushcfunction(L, prepared_tostring);
+    lua_setfield(L, -2, "__tostring");
+
+    lua_pop(L,1);
+
+    #if LUA_VERSION_NUM < 502
+    luaL_register(L, LUAMONGO_PREPARED, prepared_class_methods);
+    #else
+    luaL_newlib(L, prepared_class_methods);
+    #endif
+
+    return 1;
+}
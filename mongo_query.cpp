@@ -7,6 +7,8 @@ using namespace mongo;
 
 extern void lua_to_bson(lua_State *L, int stackpos, BSONObj &obj);
 extern void bson_to_lua(lua_State *L, const BSONObj &obj);
+extern BSONObj read_pref_document(lua_State *L, const char *mode, int tags, double maxStaleness);
+extern void query_set_read_pref(Query &query, const BSONObj &pref);
 
 namespace {
 inline Query* userdata_to_query(lua_State* L, int index) {
@@ -181,6 +183,31 @@ static int query_min_key(lua_State *L) {
     return 1;
 }
 
+/*
+ * ok,err = query:read_pref(mode[, {{tag=value, ...}, ...}[, max_staleness_s]])
+ *    mode is primary, primaryPreferred, secondary, secondaryPreferred or
+ *    nearest, the tag sets are tried in order
+ */
+static int query_read_pref(lua_State *L) {
+    Query *query = userdata_to_query(L, 1);
+    const char *mode = luaL_checkstring(L, 2);
+
+    try {
+        query_set_read_pref(*query, read_pref_document(L, mode, 3, luaL_optnumber(L, 4, 0)));
+    } catch (std::exception &e) {
+        lua_pushboolean(L, 0);
+        lua_pushfstring(L, LUAMONGO_ERR_QUERY_FAILED, e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushboolean(L, 0);
+        lua_pushstring(L, err);
+        return 2;
+    }
+
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
 /*
  * ok,err = query:snapshot()
  */
@@ -321,6 +348,7 @@ int mongo_query_register(lua_State *L) {
         {"is_explain", query_is_explain},
         {"max_key", query_max_key},
         {"min_key", query_min_key},
+        {"read_pref", query_read_pref},
         {"snapshot", query_snapshot},
         {"sort", query_sort},
         {"where", query_where},
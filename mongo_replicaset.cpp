@@ -1,23 +1,47 @@
 #include <client/dbclient.h>
 #include "utils.h"
 #include "common.h"
+#include "mongo_dbclient.h"
+#include "mongo_topology.h"
 
 using namespace mongo;
 
 extern const luaL_Reg dbclient_methods[];
+extern bool lua_to_write_concern(lua_State *L, int index, WriteConcern &wc);
+extern bool lua_to_read_pref(lua_State *L, int index, BSONObj &pref);
+extern void bson_to_lua(lua_State *L, const BSONObj &obj);
+extern double monotonic_time();
 
 namespace {
 inline DBClientReplicaSet* userdata_to_replicaset(lua_State* L, int index) {
-    void *ud = luaL_checkudata(L, index, LUAMONGO_REPLICASET);
-    DBClientReplicaSet *replicaset = *((DBClientReplicaSet **)ud);
-    return replicaset;
+    LuaDBClient *db = (LuaDBClient *)luaL_checkudata(L, index, LUAMONGO_REPLICASET);
+    if (!db->client)
+        luaL_error(L, LUAMONGO_ERR_CLOSED, LUAMONGO_REPLICASET);
+    return static_cast<DBClientReplicaSet *>(db->client);
 }
 
 } // anonymous namespace
 
 
 /*
- * db,err = mongo.ReplicaSet.New(name, {hostAndPort1, ...)
+ * db,err = mongo.ReplicaSet.New(name, {hostAndPort1, ...}[, {write_concern=..., read_pref=...}])
+ *    write_concern   (default = {w=1}) {w=n|"majority", j=bool, wtimeout=ms}
+ *    read_pref       (default = "primary") primary, primaryPreferred,
+ *                    secondary, secondaryPreferred or nearest
+ *    tags            {{tag=value, ...}, ...} tag sets tried in order
+ *    max_staleness_s passed to the servers with the read preference
+ *    monitor         (default = false) measures the round trip times of the
+ *                    members, reads not going to the primary are then sent
+ *                    to the members within latency_window_ms of the fastest
+ *    heartbeat_ms    (default = 10000) interval of the measures
+ *    latency_window_ms (default = 15)
+ *    rtt_alpha       (default = 0.2) weight of a new measure in the average
+ *    read_timeout    (default = 30) socket timeout in seconds of the
+ *                    connections reading from the members
+ *    hedge_ms        (default = 0, enables the monitor) find_one, count and
+ *                    single batch queries (negative limit) not answered
+ *                    after hedge_ms are also sent to another eligible member,
+ *                    the first reply is used and the other one is discarded
  */
 static int replicaset_new(lua_State *L) {
     int resultcount = 1;
@@ -40,15 +64,50 @@ static int replicaset_new(lua_State *L) {
             rs_servers.push_back(hp);
         }
 
-        DBClientReplicaSet **replicaset = (DBClientReplicaSet **)lua_newuserdata(L, sizeof(DBClientReplicaSet *));
-        *replicaset = new DBClientReplicaSet(rs_name, rs_servers);
+        WriteConcern wc;
+        bool has_wc = false;
+        BSONObj pref;
+        bool has_pref = false;
+        bool monitored = false;
+        TopologyOptions topts;
+        if (lua_type(L, 3) == LUA_TTABLE) {
+            lua_getfield(L, 3, "write_concern");
+            has_wc = lua_to_write_concern(L, lua_gettop(L), wc);
+            lua_pop(L, 1);
+            has_pref = lua_to_read_pref(L, 3, pref);
+
+            lua_getfield(L, 3, "monitor");
+            monitored = lua_toboolean(L, -1);
+            lua_getfield(L, 3, "heartbeat_ms");
+            topts.heartbeatInterval = luaL_optnumber(L, -1, topts.heartbeatInterval);
+            lua_getfield(L, 3, "latency_window_ms");
+            topts.latencyWindow = luaL_optnumber(L, -1, topts.latencyWindow);
+            lua_getfield(L, 3, "rtt_alpha");
+            topts.alpha = luaL_optnumber(L, -1, topts.alpha);
+            lua_getfield(L, 3, "read_timeout");
+            topts.readTimeout = luaL_optnumber(L, -1, topts.readTimeout);
+            lua_getfield(L, 3, "hedge_ms");
+            topts.hedgeDelay = luaL_optnumber(L, -1, 0);
+            lua_pop(L, 6);
+            monitored = monitored || topts.hedgeDelay > 0;
+        }
 
-        luaL_getmetatable(L, LUAMONGO_REPLICASET);
-        lua_setmetatable(L, -2);
+        DBClientReplicaSet *replicaset = new DBClientReplicaSet(rs_name, rs_servers);
+        if (has_wc)
+            replicaset->setWriteConcern(wc);
+        LuaDBClient *db = dbclient_push(L, replicaset, NULL, LUAMONGO_REPLICASET);
+        if (has_pref)
+            db->read_pref = new BSONObj(pref);
+        if (monitored)
+            db->topology = new TopologyMonitor(rs_name, rs_servers, topts);
     } catch (std::exception &e) {
         lua_pushnil(L);
         lua_pushfstring(L, LUAMONGO_ERR_REPLICASET_FAILED, e.what());
         resultcount = 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_REPLICASET_FAILED, err);
+        resultcount = 2;
     }
 
     return resultcount;
@@ -72,13 +131,83 @@ static int replicaset_connect(lua_State *L) {
     return 1;
 }
 
+/*
+ * topology,err = replicaset:topology()
+ *    {set=name, latency_window_ms=ms, members={{host=, state=, rtt_ms=,
+ *    last_rtt_ms=, checked_s_ago=, nearest=, tags=, error=}, ...},
+ *    hedging={delay_ms=, reads=, sent=, won=, skipped=}}
+ *    state is PRIMARY, SECONDARY, ARBITER, OTHER or DOWN, rtt_ms the moving
+ *    average of the round trip times and nearest whether it is within the
+ *    latency window of the fastest member
+ */
+static int replicaset_topology(lua_State *L) {
+    userdata_to_replicaset(L, 1);
+    LuaDBClient *db = userdata_to_luadbclient(L, 1);
+    if (!db->topology) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_REPLICASET, "topology",
+                        "the monitor option of ReplicaSet.New is not enabled");
+        return 2;
+    }
+
+    std::vector<MemberInfo> members;
+    db->topology->members(members);
+    double fastest = -1;
+    for (size_t i = 0; i < members.size(); ++i) {
+        if (members[i].ok && members[i].rtt >= 0 && (fastest < 0 || members[i].rtt < fastest))
+            fastest = members[i].rtt;
+    }
+    double now = monotonic_time();
+
+    lua_newtable(L);
+    LUA_PUSH_ATTRIB_STRING("set", db->topology->name().c_str());
+    LUA_PUSH_ATTRIB_FLOAT("latency_window_ms", db->topology->options().latencyWindow);
+    lua_newtable(L);
+    for (size_t i = 0; i < members.size(); ++i) {
+        const MemberInfo &m = members[i];
+        const char *state = !m.ok ? "DOWN" : m.primary ? "PRIMARY" : m.secondary ? "SECONDARY" :
+            m.arbiter ? "ARBITER" : "OTHER";
+        lua_newtable(L);
+        LUA_PUSH_ATTRIB_STRING("host", m.host.c_str());
+        LUA_PUSH_ATTRIB_STRING("state", state);
+        if (m.rtt >= 0) {
+            LUA_PUSH_ATTRIB_FLOAT("rtt_ms", m.rtt);
+            LUA_PUSH_ATTRIB_FLOAT("last_rtt_ms", m.lastRtt);
+        }
+        if (m.checked > 0) {
+            LUA_PUSH_ATTRIB_FLOAT("checked_s_ago", now - m.checked);
+        }
+        LUA_PUSH_ATTRIB_BOOL("nearest", m.ok && m.rtt >= 0 &&
+                             m.rtt <= fastest + db->topology->options().latencyWindow);
+        lua_pushstring(L, "tags");
+        bson_to_lua(L, m.tags);
+        lua_rawset(L, -3);
+        if (!m.error.empty()) {
+            LUA_PUSH_ATTRIB_STRING("error", m.error.c_str());
+        }
+        lua_rawseti(L, -2, i + 1);
+    }
+    lua_setfield(L, -2, "members");
+
+    // reads sent to a member, copies sent to a second member after delay_ms,
+    // copies answering first, and slow reads without another member
+    HedgeStats hedges = db->topology->hedge_stats();
+    lua_newtable(L);
+    LUA_PUSH_ATTRIB_FLOAT("delay_ms", db->topology->options().hedgeDelay);
+    LUA_PUSH_ATTRIB_FLOAT("reads", hedges.reads);
+    LUA_PUSH_ATTRIB_FLOAT("sent", hedges.sent);
+    LUA_PUSH_ATTRIB_FLOAT("won", hedges.won);
+    LUA_PUSH_ATTRIB_FLOAT("skipped", hedges.skipped);
+    lua_setfield(L, -2, "hedging");
+    return 1;
+}
 
 /*
- * __gc
+ * __gc, __close
  */
 static int replicaset_gc(lua_State *L) {
-    DBClientReplicaSet *replicaset = userdata_to_replicaset(L, 1);
-    delete replicaset;
+    LuaDBClient *db = (LuaDBClient *)luaL_checkudata(L, 1, LUAMONGO_REPLICASET);
+    dbclient_release(db);
     return 0;
 }
 
@@ -86,6 +215,11 @@ static int replicaset_gc(lua_State *L) {
  * __tostring
  */
 static int replicaset_tostring(lua_State *L) {
+    LuaDBClient *db = (LuaDBClient *)luaL_checkudata(L, 1, LUAMONGO_REPLICASET);
+    if (!db->client) {
+        lua_pushfstring(L, "%s: closed", LUAMONGO_REPLICASET);
+        return 1;
+    }
     DBClientReplicaSet *replicaset = userdata_to_replicaset(L, 1);
     lua_pushfstring(L, "%s: %s", LUAMONGO_REPLICASET, replicaset->toString().c_str());
     return 1;
@@ -95,6 +229,7 @@ static int replicaset_tostring(lua_State *L) {
 int mongo_replicaset_register(lua_State *L) {
     static const luaL_Reg replicaset_methods[] = {
         {"connect", replicaset_connect},
+        {"topology", replicaset_topology},
         {NULL, NULL}
     };
 
@@ -114,6 +249,11 @@ int mongo_replicaset_register(lua_State *L) {
     lua_pushcfunction(L, replicaset_gc);
     lua_setfield(L, -2, "__gc");
 
+#if LUA_VERSION_NUM >= 504
+    lua_pushcfunction(L, replicaset_gc);
+    lua_setfield(L, -2, "__close");
+#endif
+
     lua_pushcfunction(L, replicaset_tostring);
     lua_setfield(L, -2, "__tostring");
     
@@ -0,0 +1,614 @@
+#include <client/dbclient.h>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/thread_time.hpp>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "utils.h"
+#include "common.h"
+#include "mongo_dbclient.h"
+#include "mongo_topology.h"
+
+using namespace mongo;
+
+extern double monotonic_time();
+extern void background_thread_start(const boost::function<void ()> &body);
+
+namespace {
+    // most threads running the reads of hedged_read(), including the losing
+    // attempts still waiting for their member
+    const size_t MAX_HEDGE_WORKERS = 8;
+
+    DBClientConnection* connect_member(const std::string &host,
+                                       const std::vector<LuaCredential> &credentials,
+                                       double timeout) {
+        std::auto_ptr<DBClientConnection> conn(new DBClientConnection(false, 0, timeout));
+        std::string errmsg;
+        if (!conn->connect(HostAndPort(host), errmsg)) {
+            throw std::runtime_error(errmsg);
+        }
+        for (size_t i = 0; i < credentials.size(); ++i) {
+            const LuaCredential &c = credentials[i];
+            if (!conn->auth(c.dbname, c.username, c.password, errmsg, c.digestPassword)) {
+                throw std::runtime_error(errmsg);
+            }
+        }
+        return conn.release();
+    }
+
+    void append_hosts(const BSONObj &reply, const char *field, std::vector<std::string> &hosts) {
+        BSONElement list = reply[field];
+        if (list.type() != Array) return;
+        BSONObjIterator it(list.Obj());
+        while (it.more()) {
+            BSONElement host = it.next();
+            if (host.type() == String) hosts.push_back(host.str());
+        }
+    }
+
+    // every tag of the set has the same value in the tags of the member
+    bool tags_match(const BSONObj &tags, const BSONObj &tagSet) {
+        BSONObjIterator it(tagSet);
+        while (it.more()) {
+            BSONElement tag = it.next();
+            BSONElement value = tags[tag.fieldName()];
+            if (value.eoo() || value.woCompare(tag, false) != 0) return false;
+        }
+        return true;
+    }
+}
+
+/*
+ * Members, heartbeat connections and hedged reads of a TopologyMonitor,
+ * shared with its monitor and worker threads which hold it until they see
+ * stopped.
+ */
+class TopologyState : public boost::enable_shared_from_this<TopologyState> {
+public:
+    TopologyState(const std::vector<HostAndPort> &seeds, const std::string &setName,
+                  const TopologyOptions &options);
+    ~TopologyState();
+
+    void stop();
+
+    bool select(const BSONObj &pref, std::string &host);
+    void failed(const std::string &host, const std::string &error);
+    MemberReadPtr hedged_read(const BSONObj &pref, const MemberReadPtr &read,
+                              const std::vector<LuaCredential> &credentials);
+    void members(std::vector<MemberInfo> &result);
+    HedgeStats hedge_stats();
+    void run();
+
+private:
+    std::string setName;
+    TopologyOptions opts;
+
+    // guards the members below
+    boost::mutex mutex;
+    boost::condition_variable stopping;
+    std::map<std::string, MemberInfo> known;
+    unsigned long selections;
+    bool stopped;
+
+    struct Job {
+        MemberReadPtr read;
+        std::vector<LuaCredential> credentials;
+    };
+
+    // reads of hedged_read(), run by workers started on demand
+    std::deque<Job> jobs;
+    boost::condition_variable jobsAvailable;
+    boost::condition_variable readDone;
+    size_t nworkers;
+    size_t idleWorkers;
+    struct Pooled {
+        std::vector<LuaCredential> credentials;
+        DBClientConnection *conn;
+    };
+
+    // connections of the workers not running a read, by member
+    std::multimap<std::string, Pooled> pooled;
+    HedgeStats hedges;
+
+    // only used by the monitor thread
+    std::map<std::string, DBClientConnection *> heartbeats;
+
+    bool select_locked(const BSONObj &pref, std::string &host, const std::string &exclude);
+    void failed_locked(const std::string &host, const std::string &error);
+    void submit(const MemberReadPtr &read, const std::vector<LuaCredential> &credentials);
+    void check(const std::string &host, MemberInfo &info, std::vector<std::string> &hosts);
+    void work();
+};
+
+TopologyMonitor::TopologyMonitor(const std::string &setName, const std::vector<HostAndPort> &seeds,
+                                 const TopologyOptions &options) :
+    setName(setName), opts(options) {
+    if (opts.heartbeatInterval <= 0) {
+        throw std::runtime_error("heartbeat_ms must be positive");
+    }
+    if (opts.latencyWindow <= 0) {
+        throw std::runtime_error("latency_window_ms must be positive");
+    }
+    if (opts.alpha <= 0 || opts.alpha > 1) {
+        throw std::runtime_error("rtt_alpha must be in (0, 1]");
+    }
+    state.reset(new TopologyState(seeds, setName, opts));
+    monitor = boost::thread(boost::bind(&TopologyState::run, state));
+}
+
+TopologyMonitor::~TopologyMonitor() {
+    state->stop();
+    monitor.join();
+    // the cursors are closed or decoupled by now
+    std::map<std::string, DBClientConnection *>::iterator it;
+    for (it = readers.begin(); it != readers.end(); ++it) {
+        delete it->second;
+    }
+    for (size_t i = 0; i < retired.size(); ++i) {
+        delete retired[i];
+    }
+}
+
+bool TopologyMonitor::select(const BSONObj &pref, std::string &host) {
+    return state->select(pref, host);
+}
+
+DBClientBase* TopologyMonitor::reader(const std::string &host,
+                                      const std::vector<LuaCredential> &credentials) {
+    if (!same_credentials(credentials, readerCredentials)) {
+        std::map<std::string, DBClientConnection *>::iterator it;
+        for (it = readers.begin(); it != readers.end(); ++it) {
+            retire(it->second);
+        }
+        readers.clear();
+        readerCredentials = credentials;
+    }
+    DBClientConnection *&conn = readers[host];
+    if (conn && conn->isFailed()) {
+        retire(conn);
+        conn = NULL;
+    }
+    if (!conn) {
+        conn = connect_member(host, credentials, opts.readTimeout);
+    }
+    return conn;
+}
+
+/*
+ * closes a reader taken out of readers, or keeps it until its last cursor
+ * is deleted
+ */
+void TopologyMonitor::retire(DBClientConnection *conn) {
+    std::map<DBClientCursor *, DBClientConnection *>::iterator it;
+    for (it = cursors.begin(); it != cursors.end(); ++it) {
+        if (it->second == conn) {
+            retired.push_back(conn);
+            return;
+        }
+    }
+    delete conn;
+}
+
+void TopologyMonitor::track(DBClientCursor *cursor, DBClientBase *conn) {
+    std::map<std::string, DBClientConnection *>::iterator it;
+    for (it = readers.begin(); it != readers.end(); ++it) {
+        if (it->second == conn) {
+            cursors[cursor] = it->second;
+            return;
+        }
+    }
+}
+
+/*
+ * deletes cursor, then its reader when it was retired and this was its
+ * last cursor
+ */
+void TopologyMonitor::delete_cursor(DBClientCursor *cursor) {
+    std::map<DBClientCursor *, DBClientConnection *>::iterator it = cursors.find(cursor);
+    delete cursor;
+    if (it == cursors.end()) return;
+    DBClientConnection *conn = it->second;
+    cursors.erase(it);
+    std::vector<DBClientConnection *>::iterator r = std::find(retired.begin(), retired.end(), conn);
+    if (r == retired.end()) return;
+    for (it = cursors.begin(); it != cursors.end(); ++it) {
+        if (it->second == conn) return;
+    }
+    retired.erase(r);
+    delete conn;
+}
+
+void TopologyMonitor::failed(const std::string &host, const std::string &error) {
+    state->failed(host, error);
+}
+
+MemberReadPtr TopologyMonitor::hedged_read(const BSONObj &pref, const MemberReadPtr &read,
+                                           const std::vector<LuaCredential> &credentials) {
+    return state->hedged_read(pref, read, credentials);
+}
+
+void TopologyMonitor::members(std::vector<MemberInfo> &result) {
+    state->members(result);
+}
+
+HedgeStats TopologyMonitor::hedge_stats() {
+    return state->hedge_stats();
+}
+
+TopologyState::TopologyState(const std::vector<HostAndPort> &seeds, const std::string &setName,
+                             const TopologyOptions &options) :
+    setName(setName), opts(options), selections(0), stopped(false), nworkers(0),
+    idleWorkers(0) {
+    for (size_t i = 0; i < seeds.size(); ++i) {
+        MemberInfo &info = known[seeds[i].toString()];
+        info.host = seeds[i].toString();
+    }
+}
+
+TopologyState::~TopologyState() {
+    std::multimap<std::string, Pooled>::iterator p;
+    for (p = pooled.begin(); p != pooled.end(); ++p) {
+        delete p->second.conn;
+    }
+    std::map<std::string, DBClientConnection *>::iterator it;
+    for (it = heartbeats.begin(); it != heartbeats.end(); ++it) {
+        delete it->second;
+    }
+}
+
+/*
+ * the threads return once they see stopped, a heartbeat or a read in
+ * progress is not waited for and the result of the read is discarded
+ */
+void TopologyState::stop() {
+    {
+        boost::mutex::scoped_lock lock(mutex);
+        stopped = true;
+        jobs.clear();
+    }
+    stopping.notify_all();
+    jobsAvailable.notify_all();
+}
+
+/*
+ * sends isMaster to host and updates info, a copy of its entry, with the
+ * reply; hosts receives the members it knows
+ */
+void TopologyState::check(const std::string &host, MemberInfo &info, std::vector<std::string> &hosts) {
+    DBClientConnection *&conn = heartbeats[host];
+    info.checked = monotonic_time();
+    try {
+        if (!conn) {
+            std::auto_ptr<DBClientConnection> fresh(new DBClientConnection(false, 0, opts.timeout));
+            std::string errmsg;
+            if (!fresh->connect(HostAndPort(host), errmsg)) {
+                throw std::runtime_error(errmsg);
+            }
+            conn = fresh.release();
+        }
+
+        BSONObj reply;
+        double start = monotonic_time();
+        if (!conn->runCommand("admin", BSON("isMaster" << 1), reply)) {
+            throw std::runtime_error(reply["errmsg"].str());
+        }
+        double sample = (monotonic_time() - start) * 1000;
+
+        if (reply["setName"].str() != setName) {
+            throw std::runtime_error("not a member of replica set " + setName);
+        }
+        info.ok = true;
+        info.primary = reply["ismaster"].trueValue();
+        info.secondary = reply["secondary"].trueValue();
+        info.arbiter = reply["arbiterOnly"].trueValue();
+        info.hidden = reply["hidden"].trueValue();
+        info.tags = reply["tags"].isABSONObj() ? reply["tags"].Obj().getOwned() : BSONObj();
+        info.error.clear();
+        info.lastRtt = sample;
+        info.rtt = info.rtt < 0 ? sample : opts.alpha * sample + (1 - opts.alpha) * info.rtt;
+
+        append_hosts(reply, "hosts", hosts);
+        append_hosts(reply, "passives", hosts);
+        append_hosts(reply, "arbiters", hosts);
+    } catch (std::exception &e) {
+        delete conn;
+        conn = NULL;
+        // a member coming back starts a new average
+        info.ok = info.primary = info.secondary = false;
+        info.rtt = info.lastRtt = -1;
+        info.error = e.what();
+    }
+}
+
+/*
+ * checks every known member, then waits heartbeatInterval; members listed
+ * by a primary replace the known ones, and new members are checked without
+ * waiting
+ */
+void TopologyState::run() {
+    for (;;) {
+        std::vector<MemberInfo> checking;
+        {
+            boost::mutex::scoped_lock lock(mutex);
+            if (stopped) return;
+            std::map<std::string, MemberInfo>::iterator it;
+            for (it = known.begin(); it != known.end(); ++it) {
+                checking.push_back(it->second);
+            }
+        }
+
+        std::set<std::string> listed;
+        bool fromPrimary = false;
+        for (size_t i = 0; i < checking.size(); ++i) {
+            // the destructor of the monitor waits for one heartbeat at most
+            {
+                boost::mutex::scoped_lock lock(mutex);
+                if (stopped) return;
+            }
+            std::vector<std::string> hosts;
+            check(checking[i].host, checking[i], hosts);
+            if (checking[i].primary && !fromPrimary) {
+                listed.clear();
+                fromPrimary = true;
+            }
+            if (checking[i].primary || !fromPrimary) {
+                listed.insert(hosts.begin(), hosts.end());
+            }
+        }
+
+        boost::mutex::scoped_lock lock(mutex);
+        if (stopped) return;
+        for (size_t i = 0; i < checking.size(); ++i) {
+            known[checking[i].host] = checking[i];
+        }
+        if (fromPrimary) {
+            std::map<std::string, MemberInfo>::iterator it = known.begin();
+            while (it != known.end()) {
+                if (listed.count(it->first)) {
+                    ++it;
+                    continue;
+                }
+                delete heartbeats[it->first];
+                heartbeats.erase(it->first);
+                known.erase(it++);
+            }
+        }
+        bool discovered = false;
+        for (std::set<std::string>::iterator it = listed.begin(); it != listed.end(); ++it) {
+            if (!known.count(*it)) {
+                known[*it].host = *it;
+                discovered = true;
+            }
+        }
+        if (!discovered) {
+            stopping.timed_wait(lock, boost::get_system_time() +
+                                boost::posix_time::milliseconds((long)opts.heartbeatInterval));
+        }
+    }
+}
+
+/*
+ * Candidates are the secondaries, and the primary for the nearest mode,
+ * which match the first tag set matching any of them. The selected member
+ * is taken in turn among the candidates within latencyWindow of the
+ * fastest one.
+ */
+bool TopologyState::select(const BSONObj &pref, std::string &host) {
+    boost::mutex::scoped_lock lock(mutex);
+    return select_locked(pref, host, std::string());
+}
+
+bool TopologyState::select_locked(const BSONObj &pref, std::string &host,
+                                  const std::string &exclude) {
+    std::string mode = pref.getStringField("mode");
+    if (mode.empty() || mode == "primary") return false;
+
+    std::vector<const MemberInfo *> candidates;
+    std::map<std::string, MemberInfo>::const_iterator it;
+    for (it = known.begin(); it != known.end(); ++it) {
+        const MemberInfo &m = it->second;
+        if (mode == "primaryPreferred" && m.ok && m.primary) return false;
+        if (!m.ok || m.rtt < 0 || m.arbiter || m.hidden || m.host == exclude) continue;
+        if (m.secondary || (m.primary && mode == "nearest")) {
+            candidates.push_back(&m);
+        }
+    }
+
+    BSONElement tagSets = pref["tags"];
+    if (tagSets.type() == Array && !tagSets.Obj().isEmpty()) {
+        std::vector<const MemberInfo *> matching;
+        BSONObjIterator sets(tagSets.Obj());
+        while (sets.more() && matching.empty()) {
+            BSONElement tagSet = sets.next();
+            if (!tagSet.isABSONObj()) continue;
+            for (size_t i = 0; i < candidates.size(); ++i) {
+                if (tags_match(candidates[i]->tags, tagSet.Obj())) {
+                    matching.push_back(candidates[i]);
+                }
+            }
+        }
+        candidates.swap(matching);
+    }
+    // secondaryPreferred falls back to the primary, the replica set client
+    // reports the other modes without members
+    if (candidates.empty()) return false;
+
+    double fastest = candidates[0]->rtt;
+    for (size_t i = 1; i < candidates.size(); ++i) {
+        fastest = std::min(fastest, candidates[i]->rtt);
+    }
+    std::vector<const MemberInfo *> nearest;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        if (candidates[i]->rtt <= fastest + opts.latencyWindow) {
+            nearest.push_back(candidates[i]);
+        }
+    }
+    const MemberInfo *chosen = nearest[selections++ % nearest.size()];
+    if (chosen->primary) return false;
+    host = chosen->host;
+    return true;
+}
+
+void TopologyState::failed(const std::string &host, const std::string &error) {
+    boost::mutex::scoped_lock lock(mutex);
+    failed_locked(host, error);
+}
+
+void TopologyState::failed_locked(const std::string &host, const std::string &error) {
+    std::map<std::string, MemberInfo>::iterator it = known.find(host);
+    if (it != known.end()) {
+        it->second.ok = false;
+        it->second.error = error;
+    }
+}
+
+void TopologyState::submit(const MemberReadPtr &read,
+                           const std::vector<LuaCredential> &credentials) {
+    Job job;
+    job.read = read;
+    job.credentials = credentials;
+    jobs.push_back(job);
+    if (jobs.size() > idleWorkers && nworkers < MAX_HEDGE_WORKERS) {
+        background_thread_start(boost::bind(&TopologyState::work, shared_from_this()));
+        ++nworkers;
+    }
+    jobsAvailable.notify_one();
+}
+
+/*
+ * The first attempt failing before the hedge delay is reported at once,
+ * hedging is for slow members, not for failing reads. Without a reply
+ * after hedgeDelay and readTimeout the read fails, the attempts still
+ * running are discarded by their workers.
+ */
+MemberReadPtr TopologyState::hedged_read(const BSONObj &pref, const MemberReadPtr &read,
+                                         const std::vector<LuaCredential> &credentials) {
+    boost::mutex::scoped_lock lock(mutex);
+    if (!select_locked(pref, read->host, std::string())) {
+        return MemberReadPtr();
+    }
+    submit(read, credentials);
+    ++hedges.reads;
+
+    MemberReadPtr hedge;
+    bool hedgeable = true;
+    boost::system_time deadline = boost::get_system_time() +
+        boost::posix_time::microseconds((long long)(opts.hedgeDelay * 1000));
+    boost::system_time expiry = deadline +
+        boost::posix_time::milliseconds((long)(opts.readTimeout * 1000));
+    for (;;) {
+        if (read->done && read->error.empty()) {
+            return read;
+        }
+        if (hedge && hedge->done && hedge->error.empty()) {
+            ++hedges.won;
+            return hedge;
+        }
+        if (read->done && (!hedge || hedge->done)) {
+            throw std::runtime_error(read->error);
+        }
+
+        if (!hedge && hedgeable) {
+            if (read->done || boost::get_system_time() >= deadline) {
+                hedgeable = false;
+                if (read->done) continue;
+                hedge.reset(read->clone());
+                if (select_locked(pref, hedge->host, read->host)) {
+                    submit(hedge, credentials);
+                    ++hedges.sent;
+                } else {
+                    hedge.reset();
+                    ++hedges.skipped;
+                }
+                continue;
+            }
+            readDone.timed_wait(lock, deadline);
+        } else if (opts.readTimeout <= 0) {
+            readDone.wait(lock);
+        } else if (!readDone.timed_wait(lock, expiry) && boost::get_system_time() >= expiry) {
+            throw std::runtime_error("hedged read timed out");
+        }
+    }
+}
+
+/*
+ * runs the queued reads with a connection of the pool of its member; a
+ * failed connection marks its member as down until its next heartbeat
+ */
+void TopologyState::work() {
+    boost::mutex::scoped_lock lock(mutex);
+    for (;;) {
+        ++idleWorkers;
+        while (!stopped && jobs.empty()) {
+            jobsAvailable.wait(lock);
+        }
+        --idleWorkers;
+        if (stopped) return;
+        Job job = jobs.front();
+        jobs.pop_front();
+
+        MemberRead &read = *job.read;
+        DBClientConnection *conn = NULL;
+        // the ones authenticated with other credentials are closed, the
+        // DBClient of the monitor changed them
+        std::vector<DBClientConnection *> stale;
+        std::multimap<std::string, Pooled>::iterator it = pooled.lower_bound(read.host);
+        while (!conn && it != pooled.end() && it->first == read.host) {
+            if (same_credentials(it->second.credentials, job.credentials)) {
+                conn = it->second.conn;
+            } else {
+                stale.push_back(it->second.conn);
+            }
+            pooled.erase(it++);
+        }
+        lock.unlock();
+        for (size_t i = 0; i < stale.size(); ++i) {
+            delete stale[i];
+        }
+
+        std::string error;
+        try {
+            if (!conn) conn = connect_member(read.host, job.credentials, opts.readTimeout);
+            read.run(conn);
+        } catch (std::exception &e) {
+            error = e.what();
+            if (error.empty()) error = "unknown error";
+        }
+
+        lock.lock();
+        if (conn && !conn->isFailed()) {
+            Pooled entry;
+            entry.credentials = job.credentials;
+            entry.conn = conn;
+            pooled.insert(std::make_pair(read.host, entry));
+        } else {
+            delete conn;
+            failed_locked(read.host, error);
+        }
+        read.error = error;
+        read.done = true;
+        readDone.notify_all();
+    }
+}
+
+HedgeStats TopologyState::hedge_stats() {
+    boost::mutex::scoped_lock lock(mutex);
+    return hedges;
+}
+
+void TopologyState::members(std::vector<MemberInfo> &result) {
+    boost::mutex::scoped_lock lock(mutex);
+    std::map<std::string, MemberInfo>::const_iterator it;
+    for (it = known.begin(); it != known.end(); ++it) {
+        result.push_back(it->second);
+    }
+}
@@ -0,0 +1,150 @@
+#ifndef LUAMONGO_TOPOLOGY_H
+#define LUAMONGO_TOPOLOGY_H
+
+#include <client/dbclient.h>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <map>
+#include <string>
+#include <vector>
+#include "mongo_dbclient.h"
+
+struct TopologyOptions {
+    // milliseconds between two isMaster heartbeats to every member
+    double heartbeatInterval;
+    // members whose average round trip exceeds the one of the fastest
+    // member by more than this, in milliseconds, are not selected
+    double latencyWindow;
+    // weight of the last round trip in the average
+    double alpha;
+    // seconds, connect and read timeout of the heartbeats
+    double timeout;
+    // seconds, socket timeout of the connections reading from the members
+    double readTimeout;
+    // milliseconds a read waits for its member before it is also sent to
+    // another one, 0 disables hedged reads
+    double hedgeDelay;
+
+    TopologyOptions() : heartbeatInterval(10000), latencyWindow(15), alpha(0.2),
+                        timeout(5), readTimeout(30), hedgeDelay(0) { }
+};
+
+struct HedgeStats {
+    // reads sent to a member by hedged_read(), copies sent to a second
+    // member, copies answering first, and reads without a second member
+    unsigned long long reads;
+    unsigned long long sent;
+    unsigned long long won;
+    unsigned long long skipped;
+
+    HedgeStats() : reads(0), sent(0), won(0), skipped(0) { }
+};
+
+/*
+ * An idempotent read run by a worker of a TopologyMonitor on a connection to
+ * host. Every attempt of a hedged read is a different object, the one of a
+ * losing attempt is kept alive by its worker until it is done.
+ */
+class MemberRead {
+public:
+    std::string host;
+    // set by the worker, under the lock of the monitor
+    bool done;
+    std::string error;
+
+    MemberRead() : done(false) { }
+    virtual ~MemberRead() { }
+    virtual void run(mongo::DBClientBase *client) = 0;
+    // a new read with the same arguments
+    virtual MemberRead* clone() const = 0;
+};
+
+typedef boost::shared_ptr<MemberRead> MemberReadPtr;
+
+class TopologyState;
+
+struct MemberInfo {
+    std::string host;
+    bool ok;
+    bool primary;
+    bool secondary;
+    bool arbiter;
+    bool hidden;
+    // milliseconds, average and last round trip of isMaster, negative until
+    // the first successful heartbeat or after a failed one
+    double rtt;
+    double lastRtt;
+    // monotonic_time() of the last heartbeat, 0 before the first one
+    double checked;
+    mongo::BSONObj tags;
+    std::string error;
+
+    MemberInfo() : ok(false), primary(false), secondary(false), arbiter(false),
+                   hidden(false), rtt(-1), lastRtt(-1), checked(0) { }
+};
+
+/*
+ * Background monitor of the members of a replica set. A thread sends
+ * isMaster to every member, discovers the members from the replies and
+ * keeps an exponentially weighted moving average of their round trip
+ * times. Reads with a non primary read preference are sent to one of the
+ * eligible members whose average is within the latency window of the
+ * fastest one, through connections opened on demand. With a hedge delay,
+ * reads are run by worker threads and sent to a second member when the
+ * first one is slow to answer.
+ *
+ * The threads share a TopologyState with the monitor. The destructor stops
+ * them and joins the monitor thread, which the heartbeat timeout bounds.
+ * It doesn't wait for a read in progress: the workers are joined once they
+ * returned or when the module is unloaded, bounded by readTimeout.
+ */
+class TopologyMonitor {
+public:
+    TopologyMonitor(const std::string &setName, const std::vector<mongo::HostAndPort> &seeds,
+                    const TopologyOptions &options);
+    ~TopologyMonitor();
+
+    // the member a read with the given $readPreference goes to, false when
+    // it is the primary or there is no eligible member
+    bool select(const mongo::BSONObj &pref, std::string &host);
+    // a connection to host for reads, authenticated with credentials; the
+    // readers opened with other credentials are closed. Only used by the
+    // thread of the owning DBClient, like the methods below
+    mongo::DBClientBase* reader(const std::string &host,
+                                const std::vector<LuaCredential> &credentials);
+    // cursor reads through conn, which is not closed before the cursor is
+    // deleted by delete_cursor() even if it failed
+    void track(mongo::DBClientCursor *cursor, mongo::DBClientBase *conn);
+    void delete_cursor(mongo::DBClientCursor *cursor);
+    // a read through host failed, it is not selected until its next heartbeat
+    void failed(const std::string &host, const std::string &error);
+    // sends read to the member selected for pref, and a clone of it to
+    // another member when it has not answered after hedgeDelay. Returns the
+    // first successful attempt, NULL when no member is eligible, and throws
+    // the error of the first attempt when they all fail or when none
+    // answered within hedgeDelay and readTimeout
+    MemberReadPtr hedged_read(const mongo::BSONObj &pref, const MemberReadPtr &read,
+                              const std::vector<LuaCredential> &credentials);
+
+    void members(std::vector<MemberInfo> &result);
+    HedgeStats hedge_stats();
+    const std::string& name() const { return setName; }
+    const TopologyOptions& options() const { return opts; }
+
+private:
+    std::string setName;
+    TopologyOptions opts;
+    boost::shared_ptr<TopologyState> state;
+    boost::thread monitor;
+    // only used by the thread of the owning DBClient
+    std::map<std::string, mongo::DBClientConnection *> readers;
+    std::vector<LuaCredential> readerCredentials;
+    // open cursors of the readers, and the readers closed while some of
+    // their cursors were still open
+    std::map<mongo::DBClientCursor *, mongo::DBClientConnection *> cursors;
+    std::vector<mongo::DBClientConnection *> retired;
+
+    void retire(mongo::DBClientConnection *conn);
+};
+
+#endif
@@ -0,0 +1,531 @@
+#include <client/dbclient.h>
+#include <stdexcept>
+#include <string>
+#ifdef LUAMONGO_ZLIB
+#include <zlib.h>
+#endif
+#include "utils.h"
+#include "common.h"
+#include "mongo_wire.h"
+
+using namespace mongo;
+
+/*
+ * integers of the wire protocol are little endian
+ */
+int wire_read_int32(const char *p) {
+    const unsigned char *u = (const unsigned char *)p;
+    return (int)((unsigned)u[0] | ((unsigned)u[1] << 8) |
+                 ((unsigned)u[2] << 16) | ((unsigned)u[3] << 24));
+}
+
+long long wire_read_int64(const char *p) {
+    unsigned long long lo = (unsigned)wire_read_int32(p);
+    unsigned long long hi = (unsigned)wire_read_int32(p + 4);
+    return (long long)(lo | (hi << 32));
+}
+
+void wire_append_int32(std::string &s, int v) {
+    unsigned u = (unsigned)v;
+    char bytes[4] = { (char)(u & 0xff), (char)((u >> 8) & 0xff),
+                      (char)((u >> 16) & 0xff), (char)((u >> 24) & 0xff) };
+    s.append(bytes, 4);
+}
+
+void wire_append_int64(std::string &s, long long v) {
+    unsigned long long u = (unsigned long long)v;
+    wire_append_int32(s, (int)(u & 0xffffffffULL));
+    wire_append_int32(s, (int)(u >> 32));
+}
+
+namespace {
+    // the header of s, reserved by begin_message, gets the final length
+    std::string begin_message(int requestId, int opCode) {
+        std::string s;
+        wire_append_int32(s, 0);
+        wire_append_int32(s, requestId);
+        wire_append_int32(s, 0);
+        wire_append_int32(s, opCode);
+        return s;
+    }
+
+    void end_message(std::string &s) {
+        std::string len;
+        wire_append_int32(len, (int)s.size());
+        s.replace(0, 4, len);
+    }
+}
+
+std::string wire_encode_query(int requestId, const std::string &ns,
+                              const BSONObj &query, int nToSkip, int nToReturn,
+                              const BSONObj *fieldsToReturn, int queryOptions) {
+    std::string s = begin_message(requestId, dbQuery);
+    wire_append_int32(s, queryOptions);
+    s.append(ns.c_str(), ns.size() + 1);
+    wire_append_int32(s, nToSkip);
+    wire_append_int32(s, nToReturn);
+    s.append(query.objdata(), query.objsize());
+    if (fieldsToReturn) {
+        s.append(fieldsToReturn->objdata(), fieldsToReturn->objsize());
+    }
+    end_message(s);
+    return s;
+}
+
+std::string wire_encode_get_more(int requestId, const std::string &ns,
+                                 int nToReturn, long long cursorId) {
+    std::string s = begin_message(requestId, dbGetMore);
+    wire_append_int32(s, 0); // reserved
+    s.append(ns.c_str(), ns.size() + 1);
+    wire_append_int32(s, nToReturn);
+    wire_append_int64(s, cursorId);
+    end_message(s);
+    return s;
+}
+
+std::string wire_encode_kill_cursors(int requestId, const std::vector<long long> &cursorIds) {
+    std::string s = begin_message(requestId, dbKillCursors);
+    wire_append_int32(s, 0); // reserved
+    wire_append_int32(s, (int)cursorIds.size());
+    for (size_t i = 0; i < cursorIds.size(); ++i) {
+        wire_append_int64(s, cursorIds[i]);
+    }
+    end_message(s);
+    return s;
+}
+
+int wire_compressor_id(const std::string &name) {
+    if (name == "noop") return WIRE_COMPRESSOR_NOOP;
+#ifdef LUAMONGO_ZLIB
+    if (name == "zlib") return WIRE_COMPRESSOR_ZLIB;
+#endif
+    return -1;
+}
+
+const char* wire_compressor_name(int compressor) {
+    switch (compressor) {
+    case WIRE_COMPRESSOR_NOOP: return "noop";
+    case WIRE_COMPRESSOR_ZLIB: return "zlib";
+    default: return NULL;
+    }
+}
+
+/*
+ * wraps the len bytes of a whole message in an OP_COMPRESSED message with
+ * the same requestID and responseTo, compressed by compressor (zlib at
+ * level, or noop)
+ */
+std::string wire_compress(const char *data, int len, int compressor, int level) {
+    if (len < WIRE_HEADER_SIZE || wire_read_int32(data) != len) {
+        throw std::runtime_error("truncated message");
+    }
+    int opCode = wire_read_int32(data + 12);
+    if (opCode == WIRE_OP_COMPRESSED) {
+        throw std::runtime_error("message already compressed");
+    }
+
+    int size = len - WIRE_HEADER_SIZE;
+    std::string s = begin_message(wire_read_int32(data + 4), WIRE_OP_COMPRESSED);
+    s.replace(8, 4, data + 8, 4); // responseTo
+    wire_append_int32(s, opCode);
+    wire_append_int32(s, size);
+    s.push_back((char)compressor);
+
+    if (compressor == WIRE_COMPRESSOR_NOOP) {
+        s.append(data + WIRE_HEADER_SIZE, size);
+#ifdef LUAMONGO_ZLIB
+    } else if (compressor == WIRE_COMPRESSOR_ZLIB) {
+        uLongf compressedSize = compressBound(size);
+        std::vector<Bytef> compressed(compressedSize);
+        int rc = compress2(&compressed[0], &compressedSize,
+                           (const Bytef *)(data + WIRE_HEADER_SIZE), size, level);
+        if (rc != Z_OK) {
+            throw std::runtime_error("zlib compression failed");
+        }
+        s.append((const char *)&compressed[0], compressedSize);
+#endif
+    } else {
+        throw std::runtime_error("unsupported compressor");
+    }
+    end_message(s);
+    return s;
+}
+
+/*
+ * the original message of an OP_COMPRESSED message, other messages are
+ * returned as they are
+ */
+std::string wire_decompress(const char *data, int len) {
+    if (len < WIRE_HEADER_SIZE || wire_read_int32(data) > len) {
+        throw std::runtime_error("truncated message");
+    }
+    len = wire_read_int32(data);
+    if (wire_read_int32(data + 12) != WIRE_OP_COMPRESSED) {
+        return std::string(data, len);
+    }
+    if (len < WIRE_HEADER_SIZE + 9) {
+        throw std::runtime_error("truncated compressed message");
+    }
+
+    int opCode = wire_read_int32(data + 16);
+    int size = wire_read_int32(data + 20);
+    int compressorId = (unsigned char)data[24];
+    const char *body = data + WIRE_HEADER_SIZE + 9;
+    int bodyLen = len - WIRE_HEADER_SIZE - 9;
+    if (size < 0 || size > WIRE_MAX_MESSAGE_SIZE) {
+        throw std::runtime_error("invalid compressed message");
+    }
+
+    std::string s = begin_message(wire_read_int32(data + 4), opCode);
+    s.replace(8, 4, data + 8, 4); // responseTo
+    if (compressorId == WIRE_COMPRESSOR_NOOP) {
+        if (bodyLen != size) {
+            throw std::runtime_error("invalid compressed message");
+        }
+        s.append(body, bodyLen);
+#ifdef LUAMONGO_ZLIB
+    } else if (compressorId == WIRE_COMPRESSOR_ZLIB) {
+        s.resize(WIRE_HEADER_SIZE + size);
+        uLongf uncompressedSize = size;
+        int rc = uncompress((Bytef *)&s[WIRE_HEADER_SIZE], &uncompressedSize,
+                            (const Bytef *)body, bodyLen);
+        if (rc != Z_OK || uncompressedSize != (uLongf)size) {
+            throw std::runtime_error("zlib decompression failed");
+        }
+#endif
+    } else {
+        throw std::runtime_error("unsupported compressor");
+    }
+    end_message(s);
+    return s;
+}
+
+/*
+ * offers the compressors of compression to the server with isMaster and
+ * keeps the first one it accepted, or none
+ */
+void wire_negotiate(DBClientConnection *connection, WireCompression &compression) {
+    compression.compressor = -1;
+    compression.socket = connection->getSockCreationMicroSec();
+
+    BSONObjBuilder cmd;
+    cmd.append("isMaster", 1);
+    cmd.append("compression", compression.offered);
+    BSONObj info;
+    if (!connection->runCommand("admin", cmd.obj(), info)) {
+        return;
+    }
+    BSONElement accepted = info["compression"];
+    if (accepted.type() != Array) {
+        return;
+    }
+    BSONObjIterator it(accepted.embeddedObject());
+    while (it.more()) {
+        int id = wire_compressor_id(it.next().str());
+        if (id >= 0) {
+            compression.compressor = id;
+            return;
+        }
+    }
+}
+
+/*
+ * requestID of a message, assigned when it is sent
+ */
+int wire_request_id(Message &m) {
+    return wire_read_int32(m.buf() + 4);
+}
+
+/*
+ * decodes the len bytes of a whole OP_REPLY message, header included
+ */
+void wire_decode_reply(const char *data, int len, WireReply &reply) {
+    if (len < WIRE_REPLY_HEADER_SIZE || wire_read_int32(data) > len) {
+        throw std::runtime_error("truncated reply message");
+    }
+    if (wire_read_int32(data + 12) != dbReply) {
+        throw std::runtime_error("not a reply message");
+    }
+    len = wire_read_int32(data);
+
+    reply.requestId    = wire_read_int32(data + 4);
+    reply.responseTo   = wire_read_int32(data + 8);
+    reply.flags        = wire_read_int32(data + 16);
+    reply.cursorId     = wire_read_int64(data + 20);
+    reply.startingFrom = wire_read_int32(data + 28);
+    reply.nReturned    = wire_read_int32(data + 32);
+    if (reply.nReturned < 0) {
+        throw std::runtime_error("invalid reply message");
+    }
+
+    reply.documents.clear();
+    reply.documents.reserve(reply.nReturned);
+    int pos = WIRE_REPLY_HEADER_SIZE;
+    for (int i = 0; i < reply.nReturned; ++i) {
+        if (pos + 5 > len || pos + wire_read_int32(data + pos) > len) {
+            throw std::runtime_error("truncated document in reply message");
+        }
+        BSONObj doc(data + pos);
+        reply.documents.push_back(doc.getOwned());
+        pos += doc.objsize();
+    }
+}
+
+void wire_decode_reply(Message &m, WireReply &reply) {
+    wire_decode_reply(m.buf(), wire_read_int32(m.buf()), reply);
+}
+
+/*
+ * throws the server error of a failed query
+ */
+void wire_check_reply(const WireReply &reply) {
+    if (reply.flags & WIRE_QUERY_FAILURE) {
+        std::string err = "query failure";
+        if (!reply.documents.empty() && reply.documents[0].hasField("$err")) {
+            err = reply.documents[0]["$err"].str();
+        }
+        throw std::runtime_error(err);
+    }
+    if (reply.flags & WIRE_CURSOR_NOT_FOUND) {
+        throw std::runtime_error("cursor not found");
+    }
+}
+
+/***********************************************************************/
+// mongo.Wire, the codec without any I/O for hosts doing their own
+/***********************************************************************/
+
+extern void bson_to_lua(lua_State *L, const BSONObj &obj);
+extern bool lua_to_bson_ordered(lua_State *L, int index, BSONObj &object);
+extern bool lua_to_bson_ordered_query(lua_State *L, int index, Query &query);
+
+namespace {
+    // cursor ids are 64 bits integers, kept as their 8 wire bytes in Lua
+    void push_cursor_id(lua_State *L, long long cursorId) {
+        std::string s;
+        wire_append_int64(s, cursorId);
+        lua_pushlstring(L, s.data(), s.size());
+    }
+
+    long long check_cursor_id(lua_State *L, int index) {
+        size_t len;
+        const char *s = luaL_checklstring(L, index, &len);
+        luaL_argcheck(L, len == 8, index, "cursor id of 8 bytes expected");
+        return wire_read_int64(s);
+    }
+
+    int push_message(lua_State *L, const std::string &msg, int requestId) {
+        lua_pushlstring(L, msg.data(), msg.size());
+        lua_pushinteger(L, requestId);
+        return 2;
+    }
+}
+
+/*
+ * msg,request_id = mongo.Wire.query(ns, query[, {skip=n, limit=n, fields=..., options=n, request_id=n}])
+ *    OP_QUERY message, a negative limit asks for a single batch. Commands
+ *    are queries on "<dbname>.$cmd" with limit -1.
+ */
+static int wire_query(lua_State *L) {
+    try {
+        const char *ns = luaL_checkstring(L, 1);
+        Query query;
+        if (!lua_isnoneornil(L, 2) && !lua_to_bson_ordered_query(L, 2, query)) {
+            throw (LUAMONGO_REQUIRES_QUERY);
+        }
+
+        int nToSkip = 0;
+        int nToReturn = 0;
+        int queryOptions = 0;
+        int requestId = 0;
+        BSONObj fields;
+        if (lua_type(L, 3) == LUA_TTABLE) {
+            lua_getfield(L, 3, "skip");
+            nToSkip = luaL_optint(L, -1, 0);
+            lua_getfield(L, 3, "limit");
+            nToReturn = luaL_optint(L, -1, 0);
+            lua_getfield(L, 3, "options");
+            queryOptions = luaL_optint(L, -1, 0);
+            lua_getfield(L, 3, "request_id");
+            requestId = luaL_optint(L, -1, 0);
+            lua_getfield(L, 3, "fields");
+            if (!lua_isnil(L, -1) && !lua_to_bson_ordered(L, lua_gettop(L), fields)) {
+                lua_pop(L, 5);
+                throw (LUAMONGO_REQUIRES_JSON_OR_TABLE);
+            }
+            lua_pop(L, 5);
+        }
+        if (!requestId) requestId = nextMessageId();
+
+        std::string msg = wire_encode_query(requestId, ns, query.obj, nToSkip, nToReturn,
+                                            fields.isEmpty() ? NULL : &fields, queryOptions);
+        return push_message(L, msg, requestId);
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_WIRE, "query", e.what());
+        return 2;
+    } catch (const char *err) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_WIRE, "query", err);
+        return 2;
+    }
+}
+
+/*
+ * msg,request_id = mongo.Wire.get_more(ns, cursor_id[, limit[, request_id]])
+ */
+static int wire_get_more(lua_State *L) {
+    const char *ns = luaL_checkstring(L, 1);
+    long long cursorId = check_cursor_id(L, 2);
+    int nToReturn = luaL_optint(L, 3, 0);
+    int requestId = luaL_optint(L, 4, 0);
+    if (!requestId) requestId = nextMessageId();
+
+    return push_message(L, wire_encode_get_more(requestId, ns, nToReturn, cursorId), requestId);
+}
+
+/*
+ * msg,request_id = mongo.Wire.kill_cursors({cursor_id1, ...}[, request_id])
+ *    the server doesn't reply to this message
+ */
+static int wire_kill_cursors(lua_State *L) {
+    luaL_checktype(L, 1, LUA_TTABLE);
+    std::vector<long long> ids;
+    int n = lua_rawlen(L, 1);
+    for (int i = 1; i <= n; ++i) {
+        lua_rawgeti(L, 1, i);
+        ids.push_back(check_cursor_id(L, lua_gettop(L)));
+        lua_pop(L, 1);
+    }
+    int requestId = luaL_optint(L, 2, 0);
+    if (!requestId) requestId = nextMessageId();
+
+    return push_message(L, wire_encode_kill_cursors(requestId, ids), requestId);
+}
+
+/*
+ * len = mongo.Wire.message_length(bytes)
+ *    total length of the message starting with bytes, nil if less than its
+ *    4 first bytes are given
+ */
+static int wire_message_length(lua_State *L) {
+    size_t len;
+    const char *bytes = luaL_checklstring(L, 1, &len);
+
+    if (len < 4) {
+        lua_pushnil(L);
+    } else {
+        lua_pushinteger(L, wire_read_int32(bytes));
+    }
+
+    return 1;
+}
+
+/*
+ * msg,err = mongo.Wire.compress(msg[, level[, compressor]])
+ *    OP_COMPRESSED message wrapping msg, compressed with zlib (the default,
+ *    unless the module was built without it) or noop. Only for servers which
+ *    accepted that compressor in the compression field of the isMaster
+ *    handshake.
+ */
+static int wire_compress_lua(lua_State *L) {
+    size_t len;
+    const char *bytes = luaL_checklstring(L, 1, &len);
+    int level = luaL_optint(L, 2, -1);
+    int compressor = wire_compressor_id(luaL_optstring(L, 3, "zlib"));
+    luaL_argcheck(L, compressor >= 0, 3, "unsupported compressor");
+
+    try {
+        std::string msg = wire_compress(bytes, (int)len, compressor, level);
+        lua_pushlstring(L, msg.data(), msg.size());
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_WIRE, "compress", e.what());
+        return 2;
+    }
+
+    return 1;
+}
+
+/*
+ * msg,err = mongo.Wire.decompress(bytes)
+ *    the message wrapped by an OP_COMPRESSED message, other messages are
+ *    returned unchanged, so every received message can go through it
+ */
+static int wire_decompress_lua(lua_State *L) {
+    size_t len;
+    const char *bytes = luaL_checklstring(L, 1, &len);
+
+    try {
+        std::string msg = wire_decompress(bytes, (int)len);
+        lua_pushlstring(L, msg.data(), msg.size());
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_WIRE, "decompress", e.what());
+        return 2;
+    }
+
+    return 1;
+}
+
+/*
+ * reply,err = mongo.Wire.decode_reply(bytes)
+ *    reply = {request_id=n, response_to=n, flags=n, cursor_id=str,
+ *             has_more=bool, starting_from=n, documents={...}}
+ *    failed queries return nil and the error of the server
+ */
+static int wire_decode_reply_lua(lua_State *L) {
+    size_t len;
+    const char *bytes = luaL_checklstring(L, 1, &len);
+
+    try {
+        WireReply reply;
+        wire_decode_reply(bytes, (int)len, reply);
+        wire_check_reply(reply);
+
+        lua_newtable(L);
+        LUA_PUSH_ATTRIB_INT("request_id", reply.requestId);
+        LUA_PUSH_ATTRIB_INT("response_to", reply.responseTo);
+        LUA_PUSH_ATTRIB_INT("flags", reply.flags);
+        LUA_PUSH_ATTRIB_INT("starting_from", reply.startingFrom);
+        LUA_PUSH_ATTRIB_BOOL("has_more", reply.cursorId != 0);
+        lua_pushstring(L, "cursor_id");
+        push_cursor_id(L, reply.cursorId);
+        lua_rawset(L, -3);
+
+        lua_pushstring(L, "documents");
+        lua_createtable(L, reply.documents.size(), 0);
+        for (size_t i = 0; i < reply.documents.size(); ++i) {
+            bson_to_lua(L, reply.documents[i]);
+            lua_rawseti(L, -2, i + 1);
+        }
+        lua_rawset(L, -3);
+    } catch (std::exception &e) {
+        lua_pushnil(L);
+        lua_pushfstring(L, LUAMONGO_ERR_CALLING, LUAMONGO_WIRE, "decode_reply", e.what());
+        return 2;
+    }
+
+    return 1;
+}
+
+int mongo_wire_register(lua_State *L) {
+    static const luaL_Reg wire_class_methods[] = {
+        {"compress", wire_compress_lua},
+        {"decode_reply", wire_decode_reply_lua},
+        {"decompress", wire_decompress_lua},
+        {"get_more", wire_get_more},
+        {"kill_cursors", wire_kill_cursors},
+        {"message_length", wire_message_length},
+        {"query", wire_query},
+        {NULL, NULL}
+    };
+
+    #if LUA_VERSION_NUM < 502
+    luaL_register(L, LUAMONGO_WIRE, wire_class_methods);
+    #else
+    luaL_newlib(L, wire_class_methods);
+    #endif
+
+    return 1;
+}
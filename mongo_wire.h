@@ -0,0 +1,87 @@
+#ifndef LUAMONGO_WIRE_H
+#define LUAMONGO_WIRE_H
+
+#include <client/dbclient.h>
+#include <string>
+#include <vector>
+
+// sizes of the standard message header and of the OP_REPLY header
+#define WIRE_HEADER_SIZE        16
+#define WIRE_REPLY_HEADER_SIZE  36
+// maxMessageSizeBytes of the servers
+#define WIRE_MAX_MESSAGE_SIZE   48000000
+
+// OP_COMPRESSED opCode and compressorId values
+#define WIRE_OP_COMPRESSED      2012
+#define WIRE_COMPRESSOR_NOOP    0
+#define WIRE_COMPRESSOR_ZLIB    2
+
+// OP_REPLY responseFlags
+#define WIRE_CURSOR_NOT_FOUND   1
+#define WIRE_QUERY_FAILURE      2
+
+/*
+ * Compression of the messages a DBClient sends on its own socket (pipelines
+ * and multiplexers), agreed with the server in an isMaster handshake.
+ */
+struct WireCompression {
+    // names offered to the server, in order of preference
+    std::vector<std::string> offered;
+    int level;
+    // compressorId agreed with the server, -1 for none
+    int compressor;
+    // getSockCreationMicroSec() of the socket it was agreed on, messages
+    // go uncompressed on a socket reconnected by the driver
+    unsigned long long socket;
+    // bytes of the messages before and after compression
+    unsigned long long bytesOut;
+    unsigned long long bytesOutCompressed;
+    unsigned long long bytesIn;
+    unsigned long long bytesInCompressed;
+
+    WireCompression() : level(-1), compressor(-1), socket(0), bytesOut(0),
+                        bytesOutCompressed(0), bytesIn(0), bytesInCompressed(0) { }
+};
+
+/*
+ * Decoded OP_REPLY message, documents are owned copies.
+ */
+struct WireReply {
+    int requestId;
+    int responseTo;
+    int flags;
+    long long cursorId;
+    int startingFrom;
+    int nReturned;
+    std::vector<mongo::BSONObj> documents;
+
+    WireReply() : requestId(0), responseTo(0), flags(0), cursorId(0),
+                  startingFrom(0), nReturned(0) { }
+};
+
+int wire_read_int32(const char *p);
+long long wire_read_int64(const char *p);
+
+void wire_append_int32(std::string &s, int v);
+void wire_append_int64(std::string &s, long long v);
+
+std::string wire_encode_query(int requestId, const std::string &ns,
+                              const mongo::BSONObj &query, int nToSkip, int nToReturn,
+                              const mongo::BSONObj *fieldsToReturn, int queryOptions);
+std::string wire_encode_get_more(int requestId, const std::string &ns,
+                                 int nToReturn, long long cursorId);
+std::string wire_encode_kill_cursors(int requestId, const std::vector<long long> &cursorIds);
+
+// compressorId of a compressor name, -1 if it isn't supported by this build
+int wire_compressor_id(const std::string &name);
+const char* wire_compressor_name(int compressor);
+std::string wire_compress(const char *data, int len, int compressor, int level);
+std::string wire_decompress(const char *data, int len);
+void wire_negotiate(mongo::DBClientConnection *connection, WireCompression &compression);
+
+int wire_request_id(mongo::Message &m);
+void wire_decode_reply(const char *data, int len, WireReply &reply);
+void wire_decode_reply(mongo::Message &m, WireReply &reply);
+void wire_check_reply(const WireReply &reply);
+
+#endif
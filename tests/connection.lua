@@ -65,6 +65,595 @@ function test_ReplicaSet()
 	assertEqual( result.b, data.b )
 end
 
-local t = {setup=setup, test=test_ReplicaSet, teardown=teardown}
+-- a Connection to the test server, authenticated when TEST_USER is set
+local function connect(options)
+    local db = assert( mongo.Connection.New(options) )
+    assert( db:connect(test_server), 'unable to forcefully connect to mongo instance' )
+    if test_user then
+        assertTrue( db:auth{dbname=test_db, username=test_user, password=test_password}, "unable to auth to db" )
+    end
+    return db
+end
+
+function test_CursorAggregate()
+    local db = connect()
+
+    assertTrue( db:drop_collection(test_ns) )
+    assertTrue( db:insert_batch(test_ns, { { host = 'a', bytes = 10, latency = 1 },
+        { host = 'a', bytes = 20, latency = 3 },
+        { host = 'b', bytes = 5, latency = 2 } }) )
+
+    local q = assert( db:query(test_ns, {}) )
+    local groups = assert( q:aggregate{ group_by = { 'host' }, count = true, sum = { 'bytes' },
+        max = { 'latency' }, top_k = { field = 'latency', k = 1 } } )
+    assertEqual( #groups, 2 )
+    assertEqual( groups[1]._id.host, 'a' )
+    assertEqual( groups[1].count, 2 )
+    assertEqual( groups[1].sum.bytes, 30 )
+    assertEqual( groups[1].max.latency, 3 )
+    assertEqual( groups[1].top_k[1], 3 )
+    assertEqual( groups[2]._id.host, 'b' )
+    assertEqual( groups[2].count, 1 )
+end
+
+function test_Export()
+    local db = connect()
+
+    assertTrue( db:drop_collection(test_ns) )
+    assertTrue( db:insert_batch(test_ns, { { a = 1 }, { a = 2 }, { a = 3 } }) )
+
+    local path = os.tmpname()
+    assertEqual( db:export(test_ns, {}, path, { format = 'jsonl', batch_size = 2 }), 3 )
+    local n = 0
+    for line in io.lines(path) do
+        assertTrue( line:find('"a"') ~= nil )
+        n = n + 1
+    end
+    assertEqual( n, 3 )
+
+    assertEqual( db:export(test_ns, { a = { ['$gt'] = 1 } }, path, { fields = { _id = 0 } }), 2 )
+    local f = assert( io.open(path, 'rb') )
+    local size = #f:read('*a')
+    f:close()
+    -- {a=2} and {a=3} without _id
+    assertEqual( size, 24 )
+
+    -- a failing query leaves the previous file as it was
+    local ok, err = db:export(test_ns, { a = { ['$bad'] = 1 } }, path, { format = 'jsonl' })
+    assertNil( ok )
+    assertType( err, 'string' )
+    f = assert( io.open(path, 'rb') )
+    assertEqual( #f:read('*a'), size )
+    f:close()
+    os.remove(path)
+
+    assertNil( db:export(test_ns, {}, '/nonexistent/dir/export.bson') )
+end
+
+function test_AdaptiveBatch()
+    local db = connect()
+
+    assertTrue( db:drop_collection(test_ns) )
+    local docs = {}
+    for i = 1, 100 do
+        docs[i] = { k = i, pad = string.rep('x', 1000) }
+    end
+    assertTrue( db:insert_batch(test_ns, docs) )
+
+    -- about 4 documents per batch once their size is known
+    local opts = { batch_size = 2, max_batch_bytes = 4096 }
+    local q = assert( db:query(test_ns, {}, 0, 0, { k = 1 }, 0, opts) )
+    local seen = {}
+    for r in q:results() do
+        seen[r.k] = true
+    end
+    for i = 1, 100 do
+        assertTrue( seen[i] )
+    end
+
+    q = assert( db:query(test_ns, {}, 0, 0, nil, 0, opts) )
+    assertEqual( q:itcount(), 100 )
+
+    local ok, err = db:query(test_ns, {}, 0, 0, nil, 0, { max_batch_bytes = -1 })
+    assertNil( ok )
+    assertType( err, 'string' )
+    ok, err = db:query(test_ns, {}, 0, 0, nil, 0, { max_batch_bytes = 2^31 })
+    assertNil( ok )
+    assertType( err, 'string' )
+end
+
+function test_DeferredKill()
+    local db = connect()
+
+    assertTrue( db:drop_collection(test_ns) )
+    assertTrue( db:insert_batch(test_ns, { { k = 1 }, { k = 2 }, { k = 3 }, { k = 4 } }) )
+
+    local function open_cursors()
+        local status = assert( db:run_command('admin', { serverStatus = 1 }) )
+        return status.metrics.cursor.open.total
+    end
+
+    local before = open_cursors()
+    local q = assert( db:query(test_ns, {}, 0, 0, nil, 0, 2) )
+    assertType( q:next(), 'table' )
+    assertEqual( open_cursors(), before + 1 )
+
+    -- queued by __gc, killed when db is used again
+    q = nil
+    collectgarbage()
+    collectgarbage()
+    assertEqual( open_cursors(), before )
+end
+
+function test_WriteConcern()
+    local db = connect{ write_concern = { w = 0 } }
+
+    assertTrue( db:drop_collection(test_ns) )
+    assertTrue( db:create_index(test_ns, { k = 1 }, { unique = true }) )
+    assertTrue( db:insert(test_ns, { k = 1 }) )
+    -- duplicate keys are not reported without acknowledgement
+    assertTrue( db:insert(test_ns, { k = 1 }) )
+    -- w=0 of the connection is kept by a table which doesn't set w
+    assertTrue( db:insert(test_ns, { k = 1 }, { wtimeout = 1000 }) )
+    local ok, err = db:insert(test_ns, { k = 1 }, { w = 1 })
+    assertNil( ok )
+    assertType( err, 'string' )
+    ok, err = db:insert_batch(test_ns, { { k = 2 }, { k = 2 } }, { w = 1 })
+    assertNil( ok )
+    assertType( err, 'string' )
+    assertEqual( db:count(test_ns), 2 )
+end
+
+function test_Close()
+    local db = connect()
+
+    local q = assert( db:query(test_ns, {}, 0, 0, nil, 0, 1) )
+    q:close()
+    q:close()
+    assertErrors( q.next, q )
+
+    local q2 = assert( db:query(test_ns, {}) )
+    local gridfs = assert( mongo.GridFS.New(db, test_db) )
+    assert( gridfs:store_data('data', 'close.txt') )
+    local file = assert( gridfs:find_file('close.txt') )
+    local files = assert( gridfs:list() )
+    db:close()
+    db:close()
+    assertErrors( db.count, db, test_ns )
+    assertErrors( q2.next, q2 )
+    assertErrors( gridfs.list, gridfs )
+    assertErrors( file.data, file )
+    assertErrors( files.next, files )
+end
+
+function test_Bulk()
+    local db = connect()
+
+    assertTrue( db:drop_collection(test_ns) )
+    assertTrue( db:create_index(test_ns, { k = 1 }, { unique = true }) )
+
+    local bulk = assert( db:bulk(test_ns, { ordered = false }) )
+    assertTrue( bulk:insert{ k = 1, v = 'a' } )
+    assertTrue( bulk:insert{ k = 1, v = 'dup' } )
+    assertTrue( bulk:update({ k = 2 }, { ['$set'] = { v = 'b' } }, { upsert = true }) )
+    assertTrue( bulk:remove({ k = 3 }, { limit = 1 }) )
+    assertEqual( bulk:count(), 4 )
+
+    local r = assert( bulk:execute() )
+    assertEqual( bulk:count(), 0 )
+    assertEqual( r.nInserted, 1 )
+    assertEqual( r.nUpserted, 1 )
+    assertEqual( r.upserted[1].index, 3 )
+    assertEqual( r.nRemoved, 0 )
+    assertEqual( #r.writeErrors, 1 )
+    assertEqual( r.writeErrors[1].index, 2 )
+    assertEqual( db:count(test_ns), 2 )
+end
+
+function test_UpdateBatch()
+    local db = connect()
+
+    assertTrue( db:drop_collection(test_ns) )
+    assertTrue( db:insert_batch(test_ns, { { k = 1, n = 0 }, { k = 2, n = 0 } }) )
+
+    local r = assert( db:update_batch(test_ns, {
+        { q = { k = 1 }, u = { ['$inc'] = { n = 1 } } },
+        { q = { k = 2 }, u = { ['$set'] = { n = 0 } } },
+        { q = { k = 3 }, u = { ['$inc'] = { n = 1 } }, upsert = true },
+    }, { ordered = false }) )
+    assertEqual( r.nMatched, 2 )
+    assertEqual( r.nModified, 1 )
+    assertEqual( r.nUpserted, 1 )
+    assertEqual( r.upserted[1].index, 3 )
+    assertEqual( db:find_one(test_ns, { k = 3 }).n, 1 )
+end
+
+function test_FindAndModify()
+    local db = connect()
+
+    assertTrue( db:drop_collection(test_ns) )
+    assertTrue( db:insert_batch(test_ns, { { k = 1, state = 'ready' }, { k = 2, state = 'ready' } }) )
+
+    local job = assert( db:find_and_modify(test_ns, {
+        query = { state = 'ready' }, sort = { k = -1 },
+        update = { ['$set'] = { state = 'running' } }, new = true,
+        fields = { k = 1, state = 1 },
+    }) )
+    assertEqual( job.k, 2 )
+    assertEqual( job.state, 'running' )
+    -- no match is nil without an error
+    local doc, err = db:find_and_modify(test_ns, { query = { state = 'done' }, remove = true })
+    assertNil( doc )
+    assertNil( err )
+
+    local claim = assert( db:prepare_find_and_modify(test_ns, {
+        query = { state = '$state' }, update = { ['$set'] = { state = 'running' } },
+        new = true, fields = { k = 1, state = 1 },
+    }, { '$state' }) )
+    job = assert( claim:run('ready') )
+    assertEqual( job.k, 1 )
+    assertEqual( job.state, 'running' )
+    doc, err = claim:run('ready')
+    assertNil( doc )
+    assertNil( err )
+end
+
+function test_InsertBuffer()
+    local db = connect()
+
+    assertTrue( db:drop_collection(test_ns) )
+
+    local buffer = assert( db:insert_buffer(test_ns, { max_docs = 3 }) )
+    assertTrue( buffer:add{ k = 1 } )
+    assertTrue( buffer:add{ k = 2 } )
+    assertEqual( #buffer, 2 )
+    assertEqual( db:count(test_ns), 0 )
+    local r = assert( buffer:add{ k = 3 } )
+    assertEqual( r.nInserted, 3 )
+    assertEqual( #buffer, 0 )
+    assertTrue( buffer:add{ k = 4 } )
+    assertFalse( buffer:poll() )
+    assertEqual( buffer:flush().nInserted, 1 )
+    assertEqual( db:count(test_ns), 4 )
+
+    -- documents with a write error stay pending
+    assertTrue( db:insert(test_ns, { _id = 'dup' }) )
+    local unordered = assert( db:insert_buffer(test_ns, { ordered = false }) )
+    assertTrue( unordered:add{ _id = 'dup' } )
+    assertTrue( unordered:add{ k = 5 } )
+    r = assert( unordered:flush() )
+    assertEqual( r.nInserted, 1 )
+    assertEqual( #r.writeErrors, 1 )
+    assertEqual( #unordered, 1 )
+    assertEqual( unordered:clear(), 1 )
+    assertEqual( #unordered, 0 )
+end
+
+function test_Pool()
+    local auth = test_user and { dbname = test_db, username = test_user, password = test_password }
+    local pool = assert( mongo.Pool.New{ uri = test_server, max = 2, auth = auth } )
+    local db1 = assert( pool:acquire() )
+    local db2 = assert( pool:acquire() )
+    assertNil( pool:acquire(0.1) )
+    assertEqual( pool:stats().in_use, 2 )
+    assertTrue( db1:drop_collection(test_ns) )
+    assertTrue( db1:insert_batch(test_ns, { { k = 1 }, { k = 2 } }) )
+    pool:release(db1)
+    assertErrors( db1.count, db1, test_ns )
+    assertEqual( pool:stats().idle, 1 )
+    db2:close()
+    assertEqual( pool:with(function(db) return db:count(test_ns) end), 2 )
+    assertEqual( pool:stats().idle, 2 )
+    assertEqual( pool:stats().in_use, 0 )
+    -- a connection with other credentials than the pool is not reused
+    if test_user then
+        local db = assert( pool:acquire() )
+        assertTrue( db:auth(auth) )
+        pool:release(db)
+        assertEqual( pool:stats().idle, 1 )
+        assertEqual( pool:stats().open, 1 )
+    end
+
+    local shared = assert( mongo.Pool.shared('test', { uri = test_server, auth = auth }) )
+    assertEqual( mongo.Pool.shared('test'):with(function(db) return db:count(test_ns) end), 2 )
+    assertEqual( shared:stats().idle, 1 )
+    assertTrue( mongo.Pool.drop('test') )
+    assertNil( mongo.Pool.shared('test') )
+end
+
+function test_Pipeline()
+    local db = connect()
+
+    assertTrue( db:drop_collection(test_ns) )
+    assertTrue( db:insert_batch(test_ns, { { k = 1 }, { k = 2 } }) )
+
+    local p = assert( db:pipeline() )
+    assertTrue( p:find_one(test_ns, { k = 2 }) )
+    assertTrue( p:count(test_ns, {}) )
+    assertTrue( p:find_one(test_ns, { k = 3 }) )
+    assertTrue( p:run_command(test_db, { ping = 1 }) )
+    assertEqual( #p, 4 )
+    local r1, r2, r3, r4 = p:execute()
+    assertEqual( r1.k, 2 )
+    assertEqual( r2, 2 )
+    assertNil( r3 )
+    assertEqual( r4.ok, 1 )
+    assertEqual( #p, 0 )
+end
+
+function test_Aggregate()
+    local db = connect()
+
+    assertTrue( db:drop_collection(test_ns) )
+    assertTrue( db:insert_batch(test_ns, { { g = 'a', v = 1 }, { g = 'a', v = 2 }, { g = 'b', v = 5 } }) )
+
+    local q = assert( db:aggregate(test_ns, { { ['$group'] = { _id = '$g', total = { ['$sum'] = '$v' } } },
+        { ['$sort'] = { _id = 1 } } },
+        { allowDiskUse = true, batchSize = 1 }) )
+    local r = q:next()
+    assertEqual( r._id, 'a' )
+    assertEqual( r.total, 3 )
+    r = q:next()
+    assertEqual( r._id, 'b' )
+    assertNil( q:next() )
+end
+
+function test_FindMany()
+    local db = connect()
+
+    assertTrue( db:drop_collection(test_ns) )
+    assertTrue( db:insert_batch(test_ns, { { k = 1, v = 'a' }, { k = 2, v = 'b' }, { k = 3, v = 'c' } }) )
+
+    local docs = assert( db:find_many(test_ns, 'k', { 3, 4, 1, 3 }, { projection = { v = 1 }, chunk = 2 }) )
+    assertEqual( docs[1].v, 'c' )
+    assertNil( docs[2] )
+    assertEqual( docs[3].v, 'a' )
+    assertEqual( docs[4].v, 'c' )
+end
+
+function test_Cache()
+    local db = connect()
+
+    assertTrue( db:drop_collection(test_ns) )
+    assertTrue( db:insert(test_ns, { k = 1, v = 'a' }) )
+    assertTrue( db:enable_cache{ max_bytes = 1024 * 1024, ttl = 60 } )
+
+    assertEqual( db:find_one(test_ns, { k = 1 }).v, 'a' )
+    assertEqual( db:find_one(test_ns, { k = 1 }).v, 'a' )
+    assertEqual( db:cache_stats().hits, 1 )
+
+    assertTrue( db:update(test_ns, { k = 1 }, { ['$set'] = { v = 'b' } }) )
+    assertEqual( db:find_one(test_ns, { k = 1 }).v, 'b' )
+
+    assertTrue( db:enable_cache(false) )
+    assertNil( db:cache_stats() )
+end
+
+function test_Async()
+    local db = connect()
+
+    assertTrue( db:drop_collection(test_ns) )
+    local async = assert( db:async{ threads = 2 } )
+    assertEqual( async, db:async() )
+
+    assertTrue( async:insert(test_ns, { k = 1 }):wait() )
+    local f1 = async:find_one(test_ns, { k = 1 })
+    local f2 = async:count(test_ns, {})
+    local co = coroutine.wrap(function() return f1:await() end)
+    local r = co()
+    while r == f1 do r = co() end
+    assertEqual( r.k, 1 )
+    assertEqual( f2:wait(10), 1 )
+    assertTrue( f2:ready() )
+
+    -- a result read while a write runs is not cached
+    assertTrue( db:enable_cache() )
+    assertEqual( db:find_one(test_ns, {}).k, 1 )
+    local f = async:update(test_ns, { k = 1 }, { k = 2 }, false, false, { w = 1, wtimeout = 1000 })
+    db:find_one(test_ns, {})
+    assertTrue( f:wait(10) )
+    assertEqual( db:find_one(test_ns, {}).k, 2 )
+    assertTrue( db:enable_cache(false) )
+
+    -- close() doesn't wait, the future still gets a result or an error
+    local f3 = async:count(test_ns, {})
+    async:close()
+    local n, err = f3:wait(10)
+    assertTrue( f3:ready() )
+    assertTrue( n == 1 or type(err) == 'string' )
+end
+
+function test_Wire()
+    local msg, id = assert( mongo.Wire.query(test_db .. '.$cmd', { ping = 1 }, { limit = -1 }) )
+    assertEqual( mongo.Wire.message_length(msg), #msg )
+    assertNil( mongo.Wire.message_length(msg:sub(1, 3)) )
+    assertType( id, 'number' )
+    local more = mongo.Wire.get_more(test_ns, string.rep('\0', 8), 10, id + 1)
+    assertEqual( mongo.Wire.message_length(more), #more )
+    -- a query is not a reply
+    assertNil( mongo.Wire.decode_reply(msg .. string.rep('\0', 20)) )
+    local compressed = assert( mongo.Wire.compress(msg) )
+    assertEqual( mongo.Wire.message_length(compressed), #compressed )
+    assertEqual( mongo.Wire.decompress(compressed), msg )
+    assertEqual( mongo.Wire.decompress(msg), msg )
+
+    -- an OP_REPLY to the query with the cursor id 5 and the document {ok=1.0}
+    local function int32(n)
+        return string.char(n % 256, math.floor(n / 256) % 256,
+            math.floor(n / 65536) % 256, math.floor(n / 16777216) % 256)
+    end
+    local cursor_id = '\5' .. string.rep('\0', 7)
+    local doc = int32(17) .. '\1ok\0' .. '\0\0\0\0\0\0\240\63' .. '\0'
+    local reply = int32(36 + #doc) .. int32(7) .. int32(id) .. int32(1)
+        .. int32(0) .. cursor_id .. int32(0) .. int32(1) .. doc
+    assertEqual( mongo.Wire.message_length(reply), #reply )
+    local r = assert( mongo.Wire.decode_reply(reply) )
+    assertEqual( r.request_id, 7 )
+    assertEqual( r.response_to, id )
+    assertEqual( r.flags, 0 )
+    assertTrue( r.has_more )
+    assertEqual( r.cursor_id, cursor_id )
+    assertEqual( #r.documents, 1 )
+    assertEqual( r.documents[1].ok, 1 )
+    assertNil( mongo.Wire.decode_reply(reply:sub(1, -2)) )
+
+    -- the body of a noop message has the uncompressed size
+    local noop = assert( mongo.Wire.compress(msg, -1, 'noop') )
+    assertEqual( mongo.Wire.decompress(noop), msg )
+    local bad = noop:sub(1, 20) .. int32(#msg - 15) .. noop:sub(25)
+    assertNil( mongo.Wire.decompress(bad) )
+    assertErrors( mongo.Wire.compress, msg, -1, 'snappy' )
+end
+
+function test_Multiplexer()
+    local db = connect()
+
+    assertTrue( db:drop_collection(test_ns) )
+    assertTrue( db:insert_batch(test_ns, { { k = 1 }, { k = 2 } }) )
+
+    local mux = assert( db:mux() )
+    local id1 = assert( mux:find_one(test_ns, { k = 1 }) )
+    local id2 = assert( mux:count(test_ns, {}) )
+    assertEqual( mux:pending(), 2 )
+    -- replies are kept for the request waiting for them
+    assertEqual( mux:wait(id2), 2 )
+    assertTrue( mux:ready(id1) )
+    assertEqual( mux:wait(id1).k, 1 )
+    assertEqual( mux:pending(), 0 )
+
+    -- the connection can't be used while replies are expected
+    local pipeline = assert( db:pipeline() )
+    assertTrue( pipeline:count(test_ns, {}) )
+    local id3 = assert( mux:count(test_ns, {}) )
+    assertNil( db:find_one(test_ns, {}) )
+    assertNil( db:pipeline() )
+    assertNil( pipeline:execute() )
+    assertEqual( mux:wait(id3), 2 )
+    assertEqual( db:count(test_ns), 2 )
+
+    -- closing with a request in flight shuts the socket down
+    assert( mux:count(test_ns, {}) )
+    mux:close()
+    assertErrors( mux.pending, mux )
+    assertNil( db:count(test_ns) )
+end
+
+function test_Compression()
+    assertErrors( mongo.Connection.New, { compressors = { 'snappy' } } )
+    local db = connect{ compressors = { 'zlib', 'noop' } }
+
+    local pad = string.rep('compressible ', 1000)
+    assertTrue( db:drop_collection(test_ns) )
+    assertTrue( db:insert(test_ns, { k = 1, pad = pad }) )
+
+    local p = assert( db:pipeline() )
+    assertTrue( p:find_one(test_ns, { k = 1 }) )
+    assertTrue( p:count(test_ns, {}) )
+    local doc, n = p:execute()
+    assertEqual( doc.pad, pad )
+    assertEqual( n, 1 )
+    local mux = assert( db:mux() )
+    assertEqual( mux:wait(assert( mux:find_one(test_ns, { k = 1 }) )).pad, pad )
+
+    local stats = db:compression_stats()
+    assertTrue( stats.bytes_in > #pad )
+    -- servers from 4.2 accept zlib unless started with --networkMessageCompressors
+    if stats.compressor == 'zlib' then
+        assertTrue( stats.bytes_in_compressed < stats.bytes_in / 10 )
+        assertTrue( stats.bytes_out_compressed > 0 )
+    elseif stats.compressor == nil then
+        assertEqual( stats.bytes_in_compressed, stats.bytes_in )
+    end
+end
+
+function test_Prepared()
+    local db = connect()
+
+    assertTrue( db:drop_collection(test_ns) )
+    assertTrue( db:insert_batch(test_ns, { { k = 1 }, { k = 2 }, { k = 2 } }) )
+
+    local coll = test_ns:match("^[^.]+%.(.+)$")
+    local count = assert( db:prepare(test_db, { { count = coll }, { query = { k = "$1" } } }, { "$1" }) )
+    assertEqual( count:run(1).n, 1 )
+    assertEqual( count:run(2).n, 2 )
+    assertEqual( count:run(3).n, 0 )
+    assertErrors( count.run, count )
+
+    local ok, err = db:prepare(test_db, { { count = coll }, { query = { k = "$1" } } }, { "$1", "$2" })
+    assertNil( ok )
+    assertType( err, 'string' )
+end
+
+function test_Breaker()
+    local db = assert( mongo.Connection.New{ breaker = true } )
+    assert( db:connect(test_server), 'unable to forcefully connect to mongo instance' )
+    local health = db:health()
+    assertTrue( health.connected )
+    assertEqual( health.state, 'closed' )
+    assertEqual( health.failures, 0 )
+
+    -- nothing listens on port 1
+    db = assert( mongo.Connection.New{ breaker = { failures = 2, cooldown_ms = 300,
+        backoff_ms = 100, jitter = 0 } } )
+    assertNil( db:connect('localhost:1') )
+    health = db:health()
+    assertFalse( health.connected )
+    assertEqual( health.failures, 1 )
+    assertTrue( health.retry_in_ms > 0 )
+
+    -- rejected during the backoff delay
+    local n, err = db:count(test_ns)
+    assertNil( n )
+    assertTrue( err:find('unavailable') ~= nil )
+    assertEqual( db:health().rejected, 1 )
+
+    -- the second failure opens the circuit
+    mongo.sleep(0.2)
+    assertNil( db:count(test_ns) )
+    health = db:health()
+    assertEqual( health.state, 'open' )
+    assertEqual( health.opened, 1 )
+    assertNil( db:count(test_ns) )
+    assertEqual( db:health().rejected, 2 )
+
+    -- the half-open probe fails and opens it again
+    mongo.sleep(0.4)
+    assertNil( db:count(test_ns) )
+    health = db:health()
+    assertEqual( health.state, 'open' )
+    assertEqual( health.opened, 2 )
+    assertEqual( health.total_failures, 3 )
+end
+
+function test_BreakerReconnect()
+    local db = connect{ breaker = true, rw_timeout = 0.2 }
+    assertTrue( db:drop_collection(test_ns) )
+    assertTrue( db:insert(test_ns, { k = 1 }) )
+
+    -- a read slower than rw_timeout fails the connection
+    assertNil( db:find_one(test_ns, { ['$where'] = 'sleep(1000) || true' }) )
+    assertFalse( db:health().connected )
+
+    -- the next call connects again and replays db:auth()
+    assertEqual( db:count(test_ns), 1 )
+    local health = db:health()
+    assertTrue( health.connected )
+    assertEqual( health.state, 'closed' )
+    assertEqual( health.total_failures, 0 )
+end
+
+local t = {setup=setup, test=test_ReplicaSet, test_CursorAggregate=test_CursorAggregate,
+    test_Export=test_Export, test_AdaptiveBatch=test_AdaptiveBatch,
+    test_DeferredKill=test_DeferredKill, test_WriteConcern=test_WriteConcern,
+    test_Close=test_Close, test_Bulk=test_Bulk, test_Pipeline=test_Pipeline,
+    test_Aggregate=test_Aggregate, test_FindMany=test_FindMany,
+    test_Cache=test_Cache, test_Async=test_Async,
+    test_Wire=test_Wire, test_Multiplexer=test_Multiplexer,
+    test_Compression=test_Compression,
+    test_Prepared=test_Prepared, test_UpdateBatch=test_UpdateBatch,
+    test_FindAndModify=test_FindAndModify,
+    test_InsertBuffer=test_InsertBuffer, test_Pool=test_Pool,
+    test_Breaker=test_Breaker, test_BreakerReconnect=test_BreakerReconnect,
+    teardown=teardown}
 lunity(t)
 t.runTests()
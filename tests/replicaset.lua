@@ -65,6 +65,113 @@ function test_ReplicaSet()
 	assertEqual( result.b, data.b )
 end
 
-local t = {setup=setup, test=test_ReplicaSet, teardown=teardown}
+-- a ReplicaSet seeded with the test server, authenticated when TEST_USER is set
+local function connect(options)
+    local db = assert( mongo.ReplicaSet.New('rsname', { test_server }, options) )
+    assert( db:connect(), 'unable to forcefully connect to ReplicaSet' )
+    if test_user then
+        assertTrue( db:auth{dbname=test_db, username=test_user, password=test_password}, "unable to auth to db" )
+    end
+    return db
+end
+
+-- needs a replica set with secondaries, TEST_SERVER being one of its members
+function test_ReadPreference()
+    local db = connect{ read_pref = 'secondaryPreferred',
+        write_concern = { w = 'majority' } }
+
+    assertTrue( db:drop_collection(test_ns) )
+    assertTrue( db:insert_batch(test_ns, { { a = 1 }, { a = 2 } }) )
+
+    -- majority writes are visible to a majority of the members
+    assertEqual( db:count(test_ns), 2 )
+    local q = mongo.Query.New{ a = 2 }
+    assertTrue( q:read_pref('nearest') )
+    assertEqual( db:find_one(test_ns, q).a, 2 )
+    assertEqual( db:count(test_ns, q), 1 )
+    assertFalse( q:read_pref('fastest') )
+    assertFalse( q:read_pref('primary', { { dc = 'east' } }) )
+
+    assertTrue( db:set_read_pref() )
+    assertEqual( db:count(test_ns), 2 )
+end
+
+function test_Topology()
+    local db = connect{ monitor = true, heartbeat_ms = 500,
+        read_pref = 'nearest' }
+
+    -- the first heartbeats discover the other members
+    local topology
+    for i = 1, 20 do
+        topology = assert( db:topology() )
+        if #topology.members > 1 and topology.members[#topology.members].rtt_ms then break end
+        mongo.sleep(0.5)
+    end
+    assertEqual( topology.set, 'rsname' )
+    assertEqual( topology.latency_window_ms, 15 )
+    local nearest, members = 0, 0
+    for _, m in ipairs(topology.members) do
+        assertType( m.host, 'string' )
+        if m.state == 'PRIMARY' or m.state == 'SECONDARY' then
+            assertTrue( m.rtt_ms >= 0 )
+            members = members + 1
+            if m.nearest then nearest = nearest + 1 end
+        end
+    end
+    assertTrue( nearest >= 1 )
+
+    -- written to every member, so any of them can read it
+    assertTrue( db:drop_collection(test_ns) )
+    assertTrue( db:insert(test_ns, { a = 1 }, { w = members }) )
+    assertEqual( db:find_one(test_ns, { a = 1 }).a, 1 )
+    assertEqual( db:count(test_ns), 1 )
+
+    local plain = assert( mongo.ReplicaSet.New( 'rsname', { test_server } ) )
+    assertNil( plain:topology() )
+
+    assertNil( mongo.ReplicaSet.New( 'rsname', { test_server }, { monitor = true, heartbeat_ms = 0 } ) )
+    assertNil( mongo.ReplicaSet.New( 'rsname', { test_server }, { monitor = true, latency_window_ms = -1 } ) )
+    -- the monitor is stopped without waiting for its heartbeats
+    local start = mongo.time()
+    db:close()
+    assertTrue( mongo.time() - start < 0.5 )
+end
+
+function test_HedgedReads()
+    -- a delay of 0.001 ms hedges about every read
+    local db = connect{ hedge_ms = 0.001, heartbeat_ms = 500,
+        read_pref = 'secondaryPreferred' }
+
+    local members = 0
+    for i = 1, 20 do
+        members = 0
+        for _, m in ipairs(assert( db:topology() ).members) do
+            if m.state == 'PRIMARY' or m.state == 'SECONDARY' then members = members + 1 end
+        end
+        if members > 1 then break end
+        mongo.sleep(0.5)
+    end
+
+    assertTrue( db:drop_collection(test_ns) )
+    assertTrue( db:insert_batch(test_ns, { { a = 1 }, { a = 2 } }, { w = members }) )
+    for i = 1, 10 do
+        assertEqual( db:find_one(test_ns, { a = 1 }).a, 1 )
+        assertEqual( db:count(test_ns), 2 )
+        local q = assert( db:query(test_ns, { a = 2 }, -1) )
+        assertEqual( q:next().a, 2 )
+        assertNil( q:next() )
+    end
+
+    local hedging = db:topology().hedging
+    assertEqual( hedging.delay_ms, 0.001 )
+    assertTrue( hedging.won <= hedging.sent )
+    if members > 1 then
+        -- the secondaries take every read
+        assertEqual( hedging.reads, 30 )
+    end
+end
+
+local t = {setup=setup, test=test_ReplicaSet, test_ReadPreference=test_ReadPreference,
+    test_Topology=test_Topology, test_HedgedReads=test_HedgedReads, teardown=teardown}
 lunity(t)
 t.runTests()
@@ -3,7 +3,9 @@
 #include "utils.h"
 #include "common.h"
 #include <limits.h>
+#include <string.h>
 #include <sstream>
+#include <time.h>
 
 using namespace mongo;
 
@@ -291,6 +293,18 @@ void lua_to_bson(lua_State *L, int stackpos, BSONObj &obj) {
     obj = builder.obj();
 }
 
+// appends the Lua value at stackpos to builder as the field key
+void lua_append_value(lua_State *L, const char *key, int stackpos, BSONObjBuilder &builder) {
+    if (stackpos < 0) stackpos = lua_gettop(L) + stackpos + 1;
+
+    lua_newtable(L);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+    lua_append_bson(L, key, stackpos, &builder, ref);
+
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+}
+
 /***********************************************************************/
 // The following methods are helpers to parse lua tables parameter
 /***********************************************************************/
@@ -447,6 +461,130 @@ bool lua_to_bson_batched(lua_State* L, int index, std::vector<BSONObj>& objects)
     return lua_to_bson_auto_array<std::vector<BSONObj>, lua_to_bson_ordered, lua_to_bson_select>(L, index, objects);
 }
 
+/**
+ * To generate a WriteConcern from a table {w=n|"majority"|"tag", j=bool, wtimeout=ms},
+ * returns false when there is no table at index
+ */
+bool lua_to_write_concern(lua_State *L, int index, WriteConcern &wc) {
+    if (lua_type(L, index) != LUA_TTABLE)
+        return false;
+
+    lua_getfield(L, index, "w");
+    if (lua_type(L, -1) == LUA_TNUMBER) {
+        wc.nodes(lua_tointeger(L, -1));
+    } else if (lua_type(L, -1) == LUA_TSTRING) {
+        wc.mode(lua_tostring(L, -1));
+    } else if (!lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        throw ("write_concern.w must be a number or a string");
+    }
+    lua_getfield(L, index, "j");
+    if (!lua_isnil(L, -1)) {
+        wc.journal(lua_toboolean(L, -1));
+    }
+    lua_getfield(L, index, "wtimeout");
+    if (!lua_isnil(L, -1)) {
+        wc.timeout(lua_tointeger(L, -1));
+    }
+    lua_pop(L, 3);
+
+    return true;
+}
+
+/**
+ * To generate a $readPreference document {mode, tags, maxStalenessSeconds}
+ * from a mode name, the index of an array of tag sets (0 for none) and a
+ * staleness in seconds (0 for none)
+ */
+BSONObj read_pref_document(lua_State *L, const char *mode, int tags, double maxStaleness) {
+    static const char *modes[] = {
+        "primary", "primaryPreferred", "secondary", "secondaryPreferred", "nearest", NULL
+    };
+    int i = 0;
+    while (modes[i] && strcmp(modes[i], mode) != 0) ++i;
+    if (!modes[i])
+        throw ("read_pref must be primary, primaryPreferred, secondary, secondaryPreferred or nearest");
+
+    BSONObjBuilder builder;
+    builder.append("mode", mode);
+    if (tags && !lua_isnoneornil(L, tags)) {
+        if (i == 0)
+            throw ("tags cannot be used with the primary read_pref");
+        if (!lua_istable(L, tags))
+            throw ("tags must be an array of tag sets");
+        BSONArrayBuilder tagSets(builder.subarrayStart("tags"));
+        for (size_t n = 1; n <= lua_rawlen(L, tags); ++n) {
+            lua_rawgeti(L, tags, n);
+            if (!lua_istable(L, -1)) {
+                lua_pop(L, 1);
+                throw ("tags must be an array of tag sets");
+            }
+            BSONObj tagSet;
+            lua_to_bson(L, lua_gettop(L), tagSet);
+            tagSets.append(tagSet);
+            lua_pop(L, 1);
+        }
+        tagSets.done();
+    }
+    if (maxStaleness > 0) {
+        if (i == 0)
+            throw ("max_staleness_s cannot be used with the primary read_pref");
+        builder.append("maxStalenessSeconds", (int)maxStaleness);
+    }
+    return builder.obj();
+}
+
+/**
+ * To generate a $readPreference document from a table
+ * {read_pref=mode, tags={{dc="east"}, ...}, max_staleness_s=n},
+ * returns false when there is no table or no read_pref at index
+ */
+bool lua_to_read_pref(lua_State *L, int index, BSONObj &pref) {
+    if (lua_type(L, index) != LUA_TTABLE)
+        return false;
+    if (index < 0) index = lua_gettop(L) + index + 1;
+
+    lua_getfield(L, index, "read_pref");
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return false;
+    }
+    if (!lua_isstring(L, -1)) {
+        lua_pop(L, 1);
+        throw ("read_pref must be a string");
+    }
+    lua_getfield(L, index, "tags");
+    lua_getfield(L, index, "max_staleness_s");
+    try {
+        pref = read_pref_document(L, lua_tostring(L, -3), lua_gettop(L) - 1, lua_tonumber(L, -1));
+    } catch (const char *) {
+        lua_pop(L, 3);
+        throw;
+    }
+    lua_pop(L, 3);
+
+    return true;
+}
+
+/**
+ * Sets the $readPreference of query, wrapping its filter in a query field
+ */
+void query_set_read_pref(Query &query, const BSONObj &pref) {
+    BSONObjBuilder builder;
+    if (query.isComplex()) {
+        BSONObjIterator it(query.obj);
+        while (it.more()) {
+            BSONElement elem = it.next();
+            if (strcmp(elem.fieldName(), "$readPreference") != 0)
+                builder.append(elem);
+        }
+    } else {
+        builder.append("query", query.obj);
+    }
+    builder.append("$readPreference", pref);
+    query.obj = builder.obj();
+}
+
 /***********************************************************************/
 //
 /***********************************************************************/
@@ -531,6 +669,47 @@ LUALIB_API int luaL_typeerror (lua_State *L, int narg, const char *tname) {
   return luaL_argerror(L, narg, msg);
 }
 
+/*
+ * seconds from an arbitrary point, unaffected by changes of the system time
+ */
+double monotonic_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/*
+ * the owner is stored in a table because Lua 5.1 environments and Lua 5.2
+ * user values must be tables
+ */
+void lua_set_owner(lua_State *L, int ud, int owner) {
+  if (ud < 0) ud = lua_gettop(L) + ud + 1;
+  if (owner < 0) owner = lua_gettop(L) + owner + 1;
+  lua_createtable(L, 1, 0);
+  lua_pushvalue(L, owner);
+  lua_rawseti(L, -2, 1);
+#if LUA_VERSION_NUM < 502
+  lua_setfenv(L, ud);
+#else
+  lua_setuservalue(L, ud);
+#endif
+}
+
+void lua_push_owner(lua_State *L, int ud) {
+#if LUA_VERSION_NUM < 502
+  lua_getfenv(L, ud);
+#else
+  lua_getuservalue(L, ud);
+#endif
+  if (lua_istable(L, -1)) {
+    lua_rawgeti(L, -1, 1);
+    lua_remove(L, -2);
+  } else {
+    lua_pop(L, 1);
+    lua_pushnil(L);
+  }
+}
+
 #if LUA_VERSION_NUM < 502
 LUALIB_API void luaL_setfuncs(lua_State *L, const luaL_Reg *l, int nup) {
   luaL_checkstack(L, nup+1, "too many upvalues");
@@ -42,6 +42,11 @@ extern "C" {
 #if LUA_VERSION_NUM < 502
 #define lua_rawlen lua_objlen
 #endif
+
+#if LUA_VERSION_NUM >= 503 && !defined(luaL_checkint)
+#define luaL_checkint(L,n)   ((int)luaL_checkinteger(L, (n)))
+#define luaL_optint(L,n,d)   ((int)luaL_optinteger(L, (n), (d)))
+#endif
 };
 
 #define UNUSED_VARIABLE(x) (void)(x)
@@ -53,6 +58,11 @@ LUALIB_API int luaL_typeerror (lua_State *L, int narg, const char *tname);
 LUALIB_API void luaL_setfuncs(lua_State *L, const luaL_Reg *l, int nup);
 #endif
 
+/* keeps the value at index owner alive as long as the userdata at index ud */
+void lua_set_owner(lua_State *L, int ud, int owner);
+/* pushes the owner of the userdata at index ud, nil if it has none */
+void lua_push_owner(lua_State *L, int ud);
+
 #define LUA_PUSH_ATTRIB_INT(n, v) \
     lua_pushstring(L, n); \
     lua_pushinteger(L, v); \